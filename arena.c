@@ -0,0 +1,120 @@
+/* MD5DEEP - arena.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* Arenas for filenames. When we have a lot of little strings that all
+   go away at the same time, there's no point in asking malloc for each
+   of them and giving them back one by one. An arena hands out space
+   from big chunks, one after another, and everything it handed out is
+   given back at once with arenaReset. The first chunk is kept around
+   after a reset, so an arena that's reset over and over, like the one
+   for each batch of files, doesn't call malloc at all once it's going.
+
+   An arena isn't locked. The caller has to take care of that if more
+   than one thread uses it. */
+
+#define ARENA_CHUNK_SIZE   (64 * 1024)
+
+typedef struct arenaChunk {
+  struct arenaChunk *next;
+  size_t size;
+} arenaChunk;
+
+/* Where the space in a chunk starts. This keeps what we hand out lined
+   up well enough for anything. */
+#define CHUNK_HEADER   ((sizeof(arenaChunk) + 15) & ~(size_t)15)
+#define CHUNK_DATA(c)  ((char *)(c) + CHUNK_HEADER)
+
+
+void arenaInit(arena *a) {
+  a->chunks = NULL;
+  a->next = NULL;
+  a->left = 0;
+}
+
+
+void *arenaAlloc(arena *a, size_t len) {
+
+  arenaChunk *c;
+  size_t size;
+  char *p;
+
+  len = (len + 15) & ~(size_t)15;
+
+  if (len > a->left) {
+
+    /* Something too big for a chunk gets a chunk of its own */
+    size = (len > ARENA_CHUNK_SIZE) ? len : ARENA_CHUNK_SIZE;
+    if ((c = (arenaChunk *)malloc(CHUNK_HEADER + size)) == NULL) {
+      fprintf(stderr,"%s: Out of memory\n", __progname);
+      exit (1);
+    }
+    c->size = size;
+
+    /* The first chunk is the one we keep on a reset, so new chunks go
+       after it */
+    if (a->chunks == NULL) {
+      c->next = NULL;
+      a->chunks = c;
+    } else {
+      c->next = a->chunks->next;
+      a->chunks->next = c;
+    }
+
+    a->next = CHUNK_DATA(c);
+    a->left = size;
+  }
+
+  p = a->next;
+  a->next += len;
+  a->left -= len;
+  return p;
+}
+
+
+char *arenaStrdup(arena *a, char *s) {
+  size_t len = strlen(s) + 1;
+  return (char *)memcpy(arenaAlloc(a,len),s,len);
+}
+
+
+/* Gives back everything we handed out, but keeps the first chunk */
+void arenaReset(arena *a) {
+
+  arenaChunk *c, *next;
+
+  if (a->chunks == NULL)
+    return;
+
+  for (c = a->chunks->next ; c != NULL ; c = next) {
+    next = c->next;
+    free(c);
+  }
+
+  a->chunks->next = NULL;
+  a->next = CHUNK_DATA(a->chunks);
+  a->left = a->chunks->size;
+}
+
+
+void arenaFree(arena *a) {
+
+  arenaChunk *c, *next;
+
+  for (c = a->chunks ; c != NULL ; c = next) {
+    next = c->next;
+    free(c);
+  }
+  arenaInit(a);
+}
@@ -0,0 +1,316 @@
+/* MD5DEEP - batch.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+#include "uring.h"
+
+/* Small file batches (-U). On a tree full of little files we spend
+   most of our time waiting on stat, open, read and close, one file at
+   a time. Here we save up BATCH_FILES files and hand the kernel all of
+   their system calls at once with io_uring.
+
+   A batch goes in two rounds. First we statx all of the files. That
+   tells us which ones we can skip because we know their hash (-C or a
+   hard link) or they can't match (-m), and which ones are too big for
+   a batch. The rest each get an open, a read, and a close, linked
+   together so that they run in order. The open puts the file straight
+   into a slot in the ring's file table, so we never see a descriptor.
+   The read asks for one byte more than the file should have. If we get
+   anything but the size we expected, the file changed or something went
+   wrong, and it gets hashed the normal way. So do the big files and the
+   ones we couldn't stat, which takes care of printing any errors.
+
+   The files in a batch are printed in the order we got them. */
+
+int modeBatch = FALSE;
+
+#ifdef HAVE_IO_URING
+
+#include <fcntl.h>
+#include <sys/sysmacros.h>
+
+#define BATCH_FILES        32
+#define BATCH_SMALL_SIZE   (16 * 1024)
+
+/* A statx for every file, or an open, a read and a close */
+#define BATCH_RING_SIZE    (4 * BATCH_FILES)
+
+/* What we're doing with each file in a batch */
+#define BATCH_READ     0
+#define BATCH_KNOWN    1
+#define BATCH_SKIP     2
+#define BATCH_SLOW     3
+
+/* The user data on each request is the file's number times four plus
+   one of these */
+#define OP_STATX   0
+#define OP_OPEN    1
+#define OP_READ    2
+#define OP_CLOSE   3
+
+typedef struct batchFile {
+  char *filename;
+  struct statx sx;
+  struct stat info;
+  int state, statStatus, openStatus;
+  long readStatus;
+  char result[DIGEST_STRING_LENGTH];
+} batchFile;
+
+static uring ring;
+static batchFile files[BATCH_FILES];
+static int fileCount = 0;
+static unsigned char *buffers = NULL;
+
+/* The names of the files in the batch we're saving up */
+static arena names;
+
+static unsigned long batched = 0, slow = 0;
+
+
+int batchInit(void) {
+
+  int slots[BATCH_FILES], i;
+
+  if (!uringInit(&ring,BATCH_RING_SIZE))
+    return FALSE;
+  arenaInit(&names);
+
+  /* The file table starts out empty. The opens fill it in. */
+  for (i = 0 ; i < BATCH_FILES ; i++)
+    slots[i] = -1;
+
+  if (syscall(__NR_io_uring_register,ring.fd,IORING_REGISTER_FILES,
+	      slots,BATCH_FILES) < 0 ||
+      (buffers = (unsigned char *)malloc(BATCH_FILES *
+					 (BATCH_SMALL_SIZE + 1))) == NULL) {
+    uringFree(&ring);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+/* Hands everything we've queued to the kernel and waits for count
+   completions, which get recorded in the files they belong to */
+static void runRequests(unsigned count) {
+
+  struct io_uring_cqe *cqe;
+  batchFile *f;
+
+  while (count > 0) {
+
+    if (uringSubmit(&ring,count) < 0) {
+      fprintf(stderr,"%s: io_uring: %s\n", __progname,strerror(errno));
+      exit (1);
+    }
+
+    while ((cqe = uringPeek(&ring)) != NULL) {
+      f = &files[cqe->user_data / 4];
+      switch (cqe->user_data % 4) {
+      case OP_STATX: f->statStatus = cqe->res;  break;
+      case OP_OPEN:  f->openStatus = cqe->res;  break;
+      case OP_READ:  f->readStatus = cqe->res;  break;
+      }
+      uringSeen(&ring);
+      count--;
+    }
+  }
+}
+
+
+static void statxToStat(struct statx *sx, struct stat *info) {
+  memset(info,0,sizeof(struct stat));
+  info->st_dev   = makedev(sx->stx_dev_major,sx->stx_dev_minor);
+  info->st_ino   = sx->stx_ino;
+  info->st_mode  = sx->stx_mode;
+  info->st_nlink = sx->stx_nlink;
+  info->st_size  = sx->stx_size;
+  info->st_mtim.tv_sec  = sx->stx_mtime.tv_sec;
+  info->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+  info->st_ctim.tv_sec  = sx->stx_ctime.tv_sec;
+  info->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+
+static void queueStatx(int i) {
+  struct io_uring_sqe *sqe = uringGetSqe(&ring);
+  sqe->opcode    = IORING_OP_STATX;
+  sqe->fd        = AT_FDCWD;
+  sqe->addr      = (unsigned long)files[i].filename;
+  sqe->len       = STATX_BASIC_STATS;
+  sqe->off       = (unsigned long)&files[i].sx;
+  sqe->user_data = i * 4 + OP_STATX;
+}
+
+
+/* The open and the read are hard links, so the ones after them still
+   run if they fail. Otherwise a short read would cancel the close. */
+static void queueRead(int i) {
+
+  struct io_uring_sqe *sqe;
+
+  sqe = uringGetSqe(&ring);
+  sqe->opcode     = IORING_OP_OPENAT;
+  sqe->fd         = AT_FDCWD;
+  sqe->addr       = (unsigned long)files[i].filename;
+  sqe->open_flags = O_RDONLY;
+  sqe->file_index = i + 1;
+  sqe->flags      = IOSQE_IO_HARDLINK;
+  sqe->user_data  = i * 4 + OP_OPEN;
+
+  sqe = uringGetSqe(&ring);
+  sqe->opcode    = IORING_OP_READ;
+  sqe->fd        = i;
+  sqe->addr      = (unsigned long)(buffers + i * (BATCH_SMALL_SIZE + 1));
+  sqe->len       = files[i].info.st_size + 1;
+  sqe->off       = 0;
+  sqe->flags     = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+  sqe->user_data = i * 4 + OP_READ;
+
+  sqe = uringGetSqe(&ring);
+  sqe->opcode     = IORING_OP_CLOSE;
+  sqe->file_index = i + 1;
+  sqe->user_data  = i * 4 + OP_CLOSE;
+}
+
+
+/* Hashes the file we read into its buffer */
+static char *hashBuffer(int i) {
+
+  batchFile *f = &files[i];
+  digestSet set;
+
+  digestInit(&set,NULL);
+  digestUpdate(&set,buffers + i * (BATCH_SMALL_SIZE + 1),f->readStatus);
+  digestFinal(&set,f->result);
+  rememberHash(f->filename,&f->info,f->result);
+
+  return makeOutputLine(f->filename,f->result);
+}
+
+
+static void runBatch(void) {
+
+  batchFile *f;
+  unsigned count = 0;
+  char *line;
+  int i;
+
+  for (i = 0 ; i < fileCount ; i++)
+    queueStatx(i);
+  runRequests(fileCount);
+
+  for (i = 0 ; i < fileCount ; i++) {
+
+    f = &files[i];
+    f->state = BATCH_SLOW;
+
+    if (f->statStatus < 0)
+      continue;
+
+    statxToStat(&f->sx,&f->info);
+    if (!S_ISREG(f->info.st_mode) || f->info.st_size > BATCH_SMALL_SIZE)
+      continue;
+
+    if (lookupHash(&f->info,f->result))
+      f->state = BATCH_KNOWN;
+    else if (cannotMatch(&f->info))
+      f->state = BATCH_SKIP;
+    else {
+      f->state = BATCH_READ;
+      f->openStatus = -1;
+      f->readStatus = -1;
+      queueRead(i);
+      count += 3;
+    }
+  }
+
+  runRequests(count);
+
+  for (i = 0 ; i < fileCount ; i++) {
+
+    f = &files[i];
+    line = NULL;
+
+    switch (f->state) {
+
+    case BATCH_KNOWN:
+      line = makeOutputLine(f->filename,f->result);
+      break;
+
+    case BATCH_READ:
+      if (f->openStatus >= 0 && f->readStatus == f->info.st_size) {
+	line = hashBuffer(i);
+	batched++;
+	break;
+      }
+      /* Fall through */
+
+    case BATCH_SLOW:
+      line = hashFileToLine(mainReader,f->filename);
+      slow++;
+      break;
+    }
+
+    if (line != NULL) {
+      fputs(line,stdout);
+      free(line);
+    }
+  }
+
+  fileCount = 0;
+  arenaReset(&names);
+}
+
+
+void batchAdd(char *filename) {
+  files[fileCount++].filename = arenaStrdup(&names,filename);
+  if (fileCount == BATCH_FILES)
+    runBatch();
+}
+
+
+void batchFinish(void) {
+  if (fileCount > 0)
+    runBatch();
+  uringFree(&ring);
+  free(buffers);
+  arenaFree(&names);
+}
+
+
+void printBatchStats(void) {
+  fprintf(stderr,"%s: %lu files read in batches, %lu left to the normal code\n",
+	  __progname,batched,slow);
+}
+
+#else
+
+/* Without io_uring there's nothing to batch with */
+
+int batchInit(void) {
+  return FALSE;
+}
+
+void batchAdd(char *filename) {
+}
+
+void batchFinish(void) {
+}
+
+void printBatchStats(void) {
+}
+
+#endif /* ifdef HAVE_IO_URING */
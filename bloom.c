@@ -0,0 +1,119 @@
+/* MD5DEEP - bloom.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+#include "hashTable.h"
+
+/* A blocked Bloom filter in front of the known hashes. Almost every
+   file we hash in matching mode isn't known, and the filter can tell us
+   so without going near the table, which for a big hash set is much too
+   big to stay in the cache. The filter is an array of 512 bit blocks,
+   one cache line each. Every hash sets k bits, all in the same block,
+   so a lookup touches exactly one cache line. The hashes are random
+   already, so we take the block and the bits straight from the digest.
+
+   The filter is sized for the false positive rate given with -F. Its
+   size is rounded up to a power of two, so the real rate is usually
+   somewhat better than that. */
+
+#define BLOOM_BLOCK_BITS   512
+#define BLOOM_MAX_K         16
+
+
+/* Bytes 8 to 15 of the digest pick the block. The table uses the first
+   eight bytes, so the two don't have anything to do with each other. */
+static unsigned long long *findBlock(bloomFilter *b, unsigned char *digest) {
+  unsigned long long key;
+  memcpy(&key,digest + 8,sizeof(key));
+  return b->blocks + (key & (b->count - 1)) * (BLOOM_BLOCK_BITS / 64);
+}
+
+
+/* The bits in the block come from the first eight bytes of the digest.
+   We stir them between bits so that every one of the 64 bits has a say
+   in every bit we pick. */
+static unsigned long long bloomBits(unsigned char *digest) {
+  unsigned long long bits;
+  memcpy(&bits,digest,sizeof(bits));
+  return bits;
+}
+
+#define BLOOM_NEXT_BIT(bits) \
+  (bits = bits * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL, \
+   (unsigned long)(bits >> 55))
+
+
+/* Sets up an empty filter big enough for entries hashes. Returns FALSE
+   if we ran out of memory, in which case we just do without one. */
+int bloomInit(bloomFilter *b, unsigned long entries, double rate) {
+
+  /* This is the size a normal Bloom filter would need, plus a fifth to
+     make up for keeping all of the bits in one block */
+  double bits = 1.2 * entries * -log(rate) / (log(2) * log(2));
+
+  b->count = 0;
+  if (entries == 0)
+    return FALSE;
+
+  b->count = 1;
+  while (b->count * BLOOM_BLOCK_BITS < bits)
+    b->count *= 2;
+
+  /* More bits per hash would be better for a normal Bloom filter of
+     this size, but they would crowd each other inside the block */
+  b->k = (int)floor(log(2) * b->count * BLOOM_BLOCK_BITS / entries + 0.5);
+  if (b->k > (int)ceil(-log(rate) / log(2)))
+    b->k = (int)ceil(-log(rate) / log(2));
+  if (b->k < 1)
+    b->k = 1;
+  if (b->k > BLOOM_MAX_K)
+    b->k = BLOOM_MAX_K;
+
+  b->blocks = calloc(b->count,BLOOM_BLOCK_BITS / 8);
+  if (b->blocks == NULL) {
+    b->count = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+void bloomAdd(bloomFilter *b, unsigned char *digest) {
+  unsigned long long *block = findBlock(b,digest), bits = bloomBits(digest);
+  unsigned long bit;
+  int i;
+  for (i = 0 ; i < b->k ; i++) {
+    bit = BLOOM_NEXT_BIT(bits);
+    block[bit / 64] |= 1ULL << (bit % 64);
+  }
+}
+
+
+/* Returns FALSE if digest definitely wasn't added to the filter */
+int bloomMaybe(bloomFilter *b, unsigned char *digest) {
+
+  unsigned long long *block, bits = bloomBits(digest);
+  unsigned long bit;
+  int i;
+
+  if (b->count == 0)
+    return TRUE;
+
+  block = findBlock(b,digest);
+  for (i = 0 ; i < b->k ; i++) {
+    bit = BLOOM_NEXT_BIT(bits);
+    if (!(block[bit / 64] & (1ULL << (bit % 64))))
+      return FALSE;
+  }
+  return TRUE;
+}
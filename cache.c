@@ -0,0 +1,560 @@
+/* MD5DEEP - cache.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* The hash cache (-C). When the same file server gets hashed every
+   night, almost none of the files have changed since the last time.
+   The cache remembers the hash of every file we've hashed along with
+   the device, inode, size, modification time and change time it had.
+   If a file still has all of those, we use the hash from the cache and
+   never read the file at all.
+
+   The cache file is a small header followed by records, each of which
+   is a fixed size part and then the name of the file. New hashes are
+   appended to the end as we go, so a run that gets killed halfway
+   through still saves what it did. When a file has more than one
+   record, the last one wins.
+
+   More than one run can use the same cache at once. The file is opened
+   for appending and each record goes out in a single write, so records
+   from different runs never land on top of each other. Every run holds
+   a shared lock on the file while it's going. Only a run that finds
+   nobody else using the cache, which it tells by getting an exclusive
+   lock, may cut a partial record off the end or rewrite the file.
+
+   The cache is rewritten with just the records that count (compaction)
+   once more than a third of them have been replaced by later ones, or
+   every CACHE_COMPACT_RUNS runs. Compaction also throws out the records
+   for files that have been deleted or changed since they were hashed,
+   which is what the names are for.
+
+   The record for a file is made from what stat told us before we read
+   it. A file whose change time isn't at least a second before we started
+   might still be changing while we hash it, so we never cache those.
+   Nobody can set the change time of a file by hand, so that also
+   protects us from files that are changed without touching their
+   modification time or size. Still, to catch anything that gets past
+   all of that, -y rehashes a random fraction of the files we find in
+   the cache and complains about any that don't match.
+
+   The cache relies on inode numbers, so it's only available on *nix. */
+
+#ifdef __UNIX
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/file.h>
+
+#define CACHE_MAGIC         "MD5DCAC1"
+#define CACHE_VERSION       2
+#define CACHE_BYTE_ORDER    0x01020304
+#define CACHE_MIN_SIZE      1024
+#define CACHE_MIN_GARBAGE   4096
+#define CACHE_COMPACT_RUNS  16
+
+typedef struct cacheHeader {
+  char magic[8];
+  u_int32_t version, byteOrder;
+
+  /* How many runs have used the cache since it was last compacted */
+  u_int32_t runs, unused;
+} cacheHeader;
+
+/* Followed in the file by nameLength bytes of the filename, which is
+   always a full path */
+typedef struct cacheRecord {
+  unsigned long long dev, ino, size;
+  long long mtime, mtimeNsec, ctime, ctimeNsec;
+  unsigned char digest[MD5_HASH_LENGTH];
+  u_int32_t nameLength, unused;
+} cacheRecord;
+
+/* What we keep in memory for each record. The names stay in the file
+   until compaction needs them. */
+typedef struct cacheEntry {
+  cacheRecord record;
+  off_t offset;
+} cacheEntry;
+
+/* The records we loaded, in an open addressed table keyed by device
+   and inode. The table is only written before the hashing starts, so
+   the hashing threads can all look in it without locking. */
+static cacheEntry *table = NULL;
+static unsigned long tableSize = 0, tableCount = 0;
+
+/* The records in the file that have been replaced by later ones */
+static unsigned long superseded = 0;
+
+static char *cacheName = NULL;
+static int cacheFd = -1, readOnly = FALSE;
+static u_int32_t runs = 0;
+static time_t runStart;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+double cacheVerifyRate = 0;
+static unsigned long hits = 0, misses = 0, checked = 0, stale = 0;
+static unsigned long dropped = 0;
+
+#ifdef __GNUC__
+#define COUNT(x)   __sync_fetch_and_add(&(x),1)
+#else
+#define COUNT(x)   (x)++
+#endif
+
+
+static unsigned long long mix(unsigned long long dev, unsigned long long ino) {
+  unsigned long long key = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+  key *= 0xff51afd7ed558ccdULL;
+  return key ^ (key >> 32);
+}
+
+
+/* Returns the slot for dev and ino, which is empty if they aren't
+   in the table. An inode number is never zero. */
+static cacheEntry *findSlot(unsigned long long dev, unsigned long long ino) {
+
+  unsigned long key = mix(dev,ino) & (tableSize - 1);
+
+  while (table[key].record.ino != 0 &&
+	 (table[key].record.dev != dev || table[key].record.ino != ino))
+    key = (key + 1) & (tableSize - 1);
+
+  return &table[key];
+}
+
+
+/* Returns the record for dev and ino, or NULL if there isn't one */
+static cacheRecord *findRecord(unsigned long long dev, unsigned long long ino) {
+  cacheEntry *slot;
+  if (tableSize == 0)
+    return NULL;
+  slot = findSlot(dev,ino);
+  return slot->record.ino ? &slot->record : NULL;
+}
+
+
+static int insertRecord(cacheEntry *e) {
+
+  cacheEntry *old = table, *slot;
+  unsigned long oldSize = tableSize, count;
+
+  if ((tableCount + 1) * 2 > tableSize) {
+
+    tableSize = tableSize ? tableSize * 2 : CACHE_MIN_SIZE;
+    if ((table = (cacheEntry *)calloc(tableSize,sizeof(cacheEntry))) == NULL) {
+      table = old;
+      tableSize = oldSize;
+      return FALSE;
+    }
+
+    for (count = 0 ; count < oldSize ; count++)
+      if (old[count].record.ino != 0)
+	*findSlot(old[count].record.dev,old[count].record.ino) = old[count];
+    free(old);
+  }
+
+  slot = findSlot(e->record.dev,e->record.ino);
+  if (slot->record.ino == 0)
+    tableCount++;
+  else
+    superseded++;
+  *slot = *e;
+  return TRUE;
+}
+
+
+static void fillRecord(cacheRecord *c, struct stat *info) {
+  memset(c,0,sizeof(cacheRecord));
+  c->dev   = info->st_dev;
+  c->ino   = info->st_ino;
+  c->size  = info->st_size;
+  c->mtime = info->st_mtime;
+  c->ctime = info->st_ctime;
+#ifdef __LINUX
+  c->mtimeNsec = info->st_mtim.tv_nsec;
+  c->ctimeNsec = info->st_ctim.tv_nsec;
+#endif
+}
+
+
+static int sameFile(cacheRecord *a, cacheRecord *b) {
+  return (a->size  == b->size  &&
+	  a->mtime == b->mtime && a->mtimeNsec == b->mtimeNsec &&
+	  a->ctime == b->ctime && a->ctimeNsec == b->ctimeNsec);
+}
+
+
+/* Reads every record in the cache file open on fd into the table.
+   Returns the length of the file up to the end of the last whole
+   record, or -1 if this isn't a cache file. */
+static off_t readCache(int fd) {
+
+  cacheHeader header;
+  cacheEntry e;
+  char name[PATH_MAX];
+  FILE *f;
+  off_t length = sizeof(header);
+
+  if ((f = fdopen(dup(fd),"rb")) == NULL)
+    return -1;
+  rewind(f);
+
+  if (fread(&header,sizeof(header),1,f) != 1 ||
+      memcmp(header.magic,CACHE_MAGIC,sizeof(header.magic)) ||
+      header.version != CACHE_VERSION ||
+      header.byteOrder != CACHE_BYTE_ORDER) {
+    fclose(f);
+    return -1;
+  }
+  runs = header.runs;
+
+  /* A run that was killed, or one that's writing right now, may have
+     left part of a record at the end */
+  while (fread(&e.record,sizeof(cacheRecord),1,f) == 1 &&
+	 e.record.nameLength > 0 && e.record.nameLength < PATH_MAX &&
+	 fread(name,e.record.nameLength,1,f) == 1) {
+    e.offset = length;
+    if (!insertRecord(&e)) {
+      fprintf(stderr,"%s: Out of memory\n", __progname);
+      exit (1);
+    }
+    length += sizeof(cacheRecord) + e.record.nameLength;
+  }
+
+  fclose(f);
+  return length;
+}
+
+
+static int writeHeader(int fd, u_int32_t runCount) {
+  cacheHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,CACHE_MAGIC,sizeof(header.magic));
+  header.version   = CACHE_VERSION;
+  header.byteOrder = CACHE_BYTE_ORDER;
+  header.runs      = runCount;
+  return write(fd,&header,sizeof(header)) == sizeof(header);
+}
+
+
+static void cacheFailed(void) {
+  close(cacheFd);
+  cacheFd = -1;
+  free(table);
+  table = NULL;
+  tableSize = tableCount = 0;
+}
+
+
+int cacheOpen(char *filename) {
+
+  struct stat opened, named;
+  off_t length, end;
+  int exclusive;
+
+  time(&runStart);
+  cacheName = filename;
+
+  /* If another run compacted the cache between our open and our lock,
+     we've got the old file and have to open the new one */
+  for (;;) {
+
+    if ((cacheFd = open(filename,O_RDWR | O_CREAT | O_APPEND,0644)) < 0) {
+      printError(filename);
+      return FALSE;
+    }
+
+    exclusive = !flock(cacheFd,LOCK_EX | LOCK_NB);
+    if (!exclusive)
+      flock(cacheFd,LOCK_SH);
+
+    if (fstat(cacheFd,&opened) || stat(filename,&named) ||
+	(opened.st_dev == named.st_dev && opened.st_ino == named.st_ino))
+      break;
+    close(cacheFd);
+  }
+
+  if ((end = lseek(cacheFd,0,SEEK_END)) == 0 && exclusive) {
+    if (!writeHeader(cacheFd,0)) {
+      printError(filename);
+      cacheFailed();
+      return FALSE;
+    }
+    flock(cacheFd,LOCK_SH);
+    return TRUE;
+  }
+
+  if ((length = readCache(cacheFd)) < 0) {
+    fprintf(stderr,"%s: %s: Invalid or incompatible cache\n",
+	    __progname,filename);
+    cacheFailed();
+    return FALSE;
+  }
+
+  /* Cut off any partial record so that the new ones line up. If
+     another run is using the cache, the partial record may be one it's
+     writing right now, so we leave it alone. If it's still there after
+     everybody else is done, we add nothing this time. */
+  if (length < end) {
+    if (!exclusive)
+      readOnly = TRUE;
+    else if (ftruncate(cacheFd,length)) {
+      printError(filename);
+      cacheFailed();
+      return FALSE;
+    }
+  }
+
+  flock(cacheFd,LOCK_SH);
+  return TRUE;
+}
+
+
+/* We check a record with -y if its inode, mixed up with the time we
+   started, lands in the first cacheVerifyRate of all possible values.
+   That picks a different random set of files every time we run. */
+static int verifyThis(cacheRecord *c) {
+  unsigned long long pick = mix(c->dev ^ runStart,c->ino);
+  return ((double)(pick >> 11) / (double)(1ULL << 53) < cacheVerifyRate);
+}
+
+
+/* If the file described by info is in the cache and hasn't changed,
+   puts its hash in result and returns result. Otherwise returns NULL
+   and the caller has to hash the file. */
+char *cacheLookup(struct stat *info, char *result) {
+
+  cacheRecord c, *slot;
+
+  if (cacheFd < 0)
+    return NULL;
+
+  fillRecord(&c,info);
+  slot = findRecord(c.dev,c.ino);
+
+  if (slot == NULL || !sameFile(slot,&c)) {
+    COUNT(misses);
+    return NULL;
+  }
+
+  if (cacheVerifyRate > 0 && verifyThis(slot)) {
+    COUNT(checked);
+    return NULL;
+  }
+
+  COUNT(hits);
+  formatDigest(slot->digest,result);
+  return result;
+}
+
+
+/* Records that filename, which info says what it was like before we
+   read it, has the hash in result */
+void cacheStore(char *filename, struct stat *info, char *result) {
+
+  unsigned char buf[sizeof(cacheRecord) + PATH_MAX];
+  cacheRecord c, *slot;
+  size_t len = strlen(filename);
+
+  /* A link count of zero means we couldn't stat the file */
+  if (cacheFd < 0 || readOnly || info->st_nlink == 0 || len >= PATH_MAX)
+    return;
+
+  /* The file may have changed while we hashed it */
+  if (info->st_ctime >= runStart)
+    return;
+
+  fillRecord(&c,info);
+  if (!scanHexDigest(result,c.digest))
+    return;
+  c.nameLength = len;
+
+  slot = findRecord(c.dev,c.ino);
+  if (slot != NULL && sameFile(slot,&c)) {
+
+    /* This file was checked with -y */
+    if (!memcmp(slot->digest,c.digest,MD5_HASH_LENGTH))
+      return;
+
+    COUNT(stale);
+    if (!modeSilent)
+      fprintf(stderr,"%s: %s: Hash in the cache was out of date\n",
+	      __progname,filename);
+  }
+
+  if (slot != NULL)
+    COUNT(superseded);
+
+  /* One write per record, so that with O_APPEND a record from another
+     run can't end up in the middle of it */
+  memcpy(buf,&c,sizeof(c));
+  memcpy(buf + sizeof(c),filename,len);
+
+  pthread_mutex_lock(&cacheLock);
+  if (write(cacheFd,buf,sizeof(c) + len) != (ssize_t)(sizeof(c) + len) &&
+      !modeSilent)
+    fprintf(stderr,"%s: %s: %s\n", __progname,cacheName,strerror(errno));
+  pthread_mutex_unlock(&cacheLock);
+}
+
+
+/* Returns TRUE if the file the record at e was made for is still
+   there and hasn't changed */
+static int stillThere(cacheEntry *e, char *name) {
+
+  struct stat info;
+  cacheRecord now;
+  u_int32_t len = e->record.nameLength;
+
+  if (pread(cacheFd,name,len,e->offset + sizeof(cacheRecord)) != len)
+    return FALSE;
+  name[len] = 0;
+
+  if (stat(name,&info))
+    return FALSE;
+  fillRecord(&now,&info);
+  return (now.dev == e->record.dev && now.ino == e->record.ino &&
+	  sameFile(&now,&e->record));
+}
+
+
+/* Rewrites the cache with only the last record for each file that's
+   still there. Only called when we have the cache to ourselves. */
+static void compactCache(void) {
+
+  unsigned char buf[sizeof(cacheRecord) + PATH_MAX];
+  char *temp;
+  unsigned long count;
+  size_t len;
+  int fd;
+
+  free(table);
+  table = NULL;
+  tableSize = tableCount = superseded = 0;
+  if (readCache(cacheFd) < 0)
+    return;
+
+  if ((temp = (char *)malloc(strlen(cacheName) + 5)) == NULL)
+    return;
+  sprintf(temp,"%s.new",cacheName);
+
+  if ((fd = open(temp,O_WRONLY | O_CREAT | O_TRUNC,0644)) < 0) {
+    printError(temp);
+    free(temp);
+    return;
+  }
+
+  if (!writeHeader(fd,0)) {
+    printError(temp);
+    close(fd);
+    unlink(temp);
+    free(temp);
+    return;
+  }
+
+  for (count = 0 ; count < tableSize ; count++) {
+
+    if (table[count].record.ino == 0)
+      continue;
+
+    if (!stillThere(&table[count],(char *)buf + sizeof(cacheRecord))) {
+      dropped++;
+      continue;
+    }
+
+    memcpy(buf,&table[count].record,sizeof(cacheRecord));
+    len = sizeof(cacheRecord) + table[count].record.nameLength;
+    if (write(fd,buf,len) != (ssize_t)len) {
+      printError(temp);
+      close(fd);
+      unlink(temp);
+      free(temp);
+      return;
+    }
+  }
+
+  if (close(fd) || rename(temp,cacheName))
+    printError(temp);
+  free(temp);
+}
+
+
+/* Counts this run in the header */
+static void countRun(void) {
+
+  u_int32_t next = runs + 1;
+  int fd;
+
+  /* With O_APPEND, pwrite on cacheFd would go to the end of the file */
+  if ((fd = open(cacheName,O_WRONLY)) < 0)
+    return;
+  if (pwrite(fd,&next,sizeof(next),offsetof(cacheHeader,runs)) != sizeof(next))
+    printError(cacheName);
+  close(fd);
+}
+
+
+void cacheClose(void) {
+
+  if (cacheFd < 0)
+    return;
+
+  /* If anybody else is using the cache, we leave it for them */
+  if (!flock(cacheFd,LOCK_EX | LOCK_NB)) {
+    if ((superseded > CACHE_MIN_GARBAGE &&
+	 superseded * 3 > tableCount + superseded) ||
+	runs + 1 >= CACHE_COMPACT_RUNS)
+      compactCache();
+    else
+      countRun();
+  }
+
+  close(cacheFd);
+  cacheFd = -1;
+  free(table);
+  table = NULL;
+}
+
+
+void printCacheStats(void) {
+  fprintf(stderr,"%s: %lu files found in the cache, %lu not found, "
+	  "%lu rechecked, %lu out of date, %lu gone\n",
+	  __progname,hits,misses,checked,stale,dropped);
+}
+
+#else
+
+/* Without inode numbers there's nothing to key the cache on */
+
+double cacheVerifyRate = 0;
+
+int cacheOpen(char *filename) {
+  return FALSE;
+}
+
+char *cacheLookup(struct stat *info, char *result) {
+  return NULL;
+}
+
+void cacheStore(char *filename, struct stat *info, char *result) {
+}
+
+void cacheClose(void) {
+}
+
+void printCacheStats(void) {
+}
+
+#endif /* ifdef __UNIX */
@@ -0,0 +1,204 @@
+#!/bin/sh
+#
+# MD5DEEP - check.sh
+#
+# A few checks that options which change how files are read or walked
+# still give the same output. Run with "make check".
+
+MD5DEEP=${MD5DEEP:-./md5deep}
+DIR=`mktemp -d ${TMPDIR:-/tmp}/md5deep-check.XXXXXX` || exit 1
+trap 'rm -rf "$DIR"' 0
+
+FAILED=0
+
+check() {
+  if [ "$2" = "$3" ]; then
+    echo "ok: $1"
+  else
+    echo "FAILED: $1"
+    FAILED=1
+  fi
+}
+
+mkdir "$DIR/tree" "$DIR/tree/sub"
+echo same > "$DIR/tree/a"
+echo same > "$DIR/tree/sub/b"
+echo different > "$DIR/tree/c"
+echo also different > "$DIR/tree/sub/d"
+
+# Only the two files with the same contents are duplicates, whichever
+# order the files are read in
+WANT=`$MD5DEEP -r -d "$DIR/tree"`
+check "-d prints only duplicates" "`echo "$WANT" | grep -c /`" 2
+check "-d with -P -O" "`$MD5DEEP -r -d -P -O "$DIR/tree"`" "$WANT"
+
+WANT=`$MD5DEEP -r "$DIR/tree"`
+check "-P -O keeps the directory order" "`$MD5DEEP -r -P -O "$DIR/tree"`" "$WANT"
+
+# A list of known hashes is the same whether it's a file or a pipe
+md5sum "$DIR/tree/a" "$DIR/tree/c" > "$DIR/known"
+WANT=`$MD5DEEP -r -m "$DIR/known" "$DIR/tree" | sort`
+check "-m finds the known files" "`echo "$WANT" | grep -c /`" 3
+check "-m reads a list from a pipe" \
+  "`cat "$DIR/known" | $MD5DEEP -r -m /dev/stdin "$DIR/tree" | sort`" "$WANT"
+
+# NSRL files give the size of every known file, so -m doesn't have to
+# read the files of other sizes. It still finds the same files.
+nsrl() {
+  echo "\"`sha1sum "$1" | cut -c 1-40`\",\"`basename "$1"`\",`wc -c < "$1"`,1,\"1\",\"\",\"`md5sum "$1" | cut -c 1-32`\",\"00000000\",\"\""
+}
+{
+  echo '"SHA-1","FileName","FileSize","ProductCode","OpSystemCode","MD4","MD5","CRC32","SpecialCode"'
+  nsrl "$DIR/tree/a"
+  nsrl "$DIR/tree/c"
+} > "$DIR/nsrl"
+check "-m with sizes finds the known files" \
+  "`$MD5DEEP -r -m "$DIR/nsrl" "$DIR/tree" | sort`" "$WANT"
+check "-m skips the file whose size isn't known" \
+  "`$MD5DEEP -r -S -m "$DIR/nsrl" "$DIR/tree" 2>&1 >/dev/null | grep -c ' 1 files skipped because of their size'`" 1
+
+# An index (-I) made from the list of known hashes finds the same files
+# as the list, and -K catches one that has been changed or cut short
+$MD5DEEP -m "$DIR/known" -I "$DIR/index" 2>/dev/null
+check "-I makes an index that finds the known files" \
+  "`$MD5DEEP -r -m "$DIR/index" "$DIR/tree" | sort`" "$WANT"
+check "-K passes a good index" \
+  "`$MD5DEEP -r -K -m "$DIR/index" "$DIR/tree" 2>&1 | sort`" "$WANT"
+cp "$DIR/index" "$DIR/bad"
+printf X | dd of="$DIR/bad" bs=1 seek=`expr \`wc -c < "$DIR/bad"\` - 4` \
+  conv=notrunc 2>/dev/null
+check "-K finds a corrupt index" \
+  "`$MD5DEEP -r -K -m "$DIR/bad" "$DIR/tree" 2>&1 | grep -c 'Index is corrupt'`" 1
+head -c 40 "$DIR/index" > "$DIR/bad"
+check "an index that was cut short isn't used" \
+  "`$MD5DEEP -r -m "$DIR/bad" "$DIR/tree" 2>&1 | grep -c 'Invalid or incompatible index'`" 1
+
+# The cache (-C) gives the same hashes as reading the files. Files that
+# change during a run aren't put in the cache, so we give the tree a
+# second to be old enough first.
+WANT=`find "$DIR/tree" -type f | sort | xargs md5sum`
+sleep 1
+check "-C hashes the files" \
+  "`$MD5DEEP -r -C "$DIR/cache" "$DIR/tree" | sort -k 2`" "$WANT"
+check "-C finds them in the cache the next time" \
+  "`$MD5DEEP -r -S -C "$DIR/cache" "$DIR/tree" 2>&1 >/dev/null | grep -c '4 files found in the cache'`" 1
+check "-C gives the same hashes from the cache" \
+  "`$MD5DEEP -r -C "$DIR/cache" "$DIR/tree" | sort -k 2`" "$WANT"
+check "-y 1 rechecks every file" \
+  "`$MD5DEEP -r -S -y 1 -C "$DIR/cache" "$DIR/tree" 2>&1 >/dev/null | grep -c '4 rechecked, 0 out of date'`" 1
+echo changed > "$DIR/tree/c"
+check "-C notices a file that changed" \
+  "`$MD5DEEP -r -C "$DIR/cache" "$DIR/tree" | sort -k 2`" \
+  "`find "$DIR/tree" -type f | sort | xargs md5sum`"
+echo different > "$DIR/tree/c"
+
+# A sparse file hashes the same whether or not we read its holes, and
+# whatever size blocks we read it in. There's a hole at the start, one
+# in the middle, and one at the end.
+dd if=/dev/urandom of="$DIR/sparse" bs=4096 count=3 seek=256 2>/dev/null
+dd if=/dev/urandom of="$DIR/sparse" bs=4096 count=1 seek=1024 conv=notrunc \
+  2>/dev/null
+dd if=/dev/null of="$DIR/sparse" bs=1024 seek=8192 2>/dev/null
+WANT=`md5sum "$DIR/sparse"`
+for opts in "" "-B 5000" "-M" "-A" "-D"; do
+  check "sparse file with options '$opts'" \
+    "`$MD5DEEP $opts "$DIR/sparse" 2>/dev/null`" "$WANT"
+done
+
+# Some filesystems don't keep holes, and then there's nothing to skip
+if [ `du -k "$DIR/sparse" | cut -f 1` -lt 1024 ]; then
+  check "the holes in a sparse file aren't read" \
+    "`$MD5DEEP -S "$DIR/sparse" 2>&1 >/dev/null | grep -c ' in 1 sparse files were not read'`" 1
+fi
+
+# Piecewise hashing (-p) gives the MD5 of each piece as dd cuts it out,
+# then the MD5 of the whole file, with one thread or several
+dd if=/dev/urandom of="$DIR/pieces" bs=50000 count=5 2>/dev/null
+piece() {
+  dd if="$DIR/pieces" bs=100000 skip=$1 count=1 2>/dev/null | md5sum | cut -c 1-32
+}
+WANT="`piece 0`  $DIR/pieces offset 0-99999
+`piece 1`  $DIR/pieces offset 100000-199999
+`piece 2`  $DIR/pieces offset 200000-249999
+`md5sum "$DIR/pieces"`"
+check "-p hashes each piece" "`$MD5DEEP -p 100000 "$DIR/pieces"`" "$WANT"
+check "-p with -j 2" "`$MD5DEEP -j 2 -p 100000 "$DIR/pieces"`" "$WANT"
+
+# The tree digest (-T) of the same file, worked out here from the man
+# page. Three leaves make a tree with the first two on the left.
+hex2bin() {
+  printf "`echo "$1" | awk '{
+    for (i = 1; i < length($0); i += 2) {
+      n = index("0123456789abcdef", substr($0, i, 1)) - 1
+      n = n * 16 + index("0123456789abcdef", substr($0, i + 1, 1)) - 1
+      printf "\\\\%03o", n
+    }
+  }'`"
+}
+leaf() {
+  { printf '\000'; dd if="$DIR/pieces" bs=100000 skip=$1 count=1 2>/dev/null; } |
+    md5sum | cut -c 1-32
+}
+node() {
+  { printf '\001'; hex2bin $1; hex2bin $2; } | md5sum | cut -c 1-32
+}
+LEFT=`node \`leaf 0\` \`leaf 1\``
+WANT="`md5sum "$DIR/pieces" | cut -c 1-32`  `node $LEFT \`leaf 2\``  $DIR/pieces"
+check "-T computes the tree digest" "`$MD5DEEP -T 100000 "$DIR/pieces"`" "$WANT"
+check "-T with -j 2" "`$MD5DEEP -j 2 -T 100000 "$DIR/pieces"`" "$WANT"
+
+# -c computes the digests that sha1sum and sha256sum do, and all three
+# at once in one line per file. Known SHA-1 and SHA-256 hashes find the
+# same files as their MD5 hashes.
+check "-c sha1" "`$MD5DEEP -r -c sha1 "$DIR/tree" | sort -k 2`" \
+  "`find "$DIR/tree" -type f | sort | xargs sha1sum`"
+check "-c sha256" "`$MD5DEEP -r -c sha256 "$DIR/tree" | sort -k 2`" \
+  "`find "$DIR/tree" -type f | sort | xargs sha256sum`"
+find "$DIR/tree" -type f | sort | xargs md5sum | cut -c 1-32 > "$DIR/md5"
+find "$DIR/tree" -type f | sort | xargs sha1sum | cut -c 1-40 > "$DIR/sha1"
+find "$DIR/tree" -type f | sort | xargs sha256sum > "$DIR/sha256"
+WANT=`paste -d ' ' "$DIR/md5" /dev/null "$DIR/sha1" /dev/null "$DIR/sha256"`
+check "-c md5,sha1,sha256" \
+  "`$MD5DEEP -r -c md5,sha1,sha256 "$DIR/tree" | sort -k 4`" "$WANT"
+WANT=`$MD5DEEP -r -m "$DIR/known" "$DIR/tree" | sort`
+sha1sum "$DIR/tree/a" "$DIR/tree/c" > "$DIR/known1"
+check "-c sha1 -m finds files from their SHA-1" \
+  "`$MD5DEEP -r -c sha1 -m "$DIR/known1" "$DIR/tree" | sort`" "$WANT"
+sha256sum "$DIR/tree/a" "$DIR/tree/c" > "$DIR/known256"
+check "-c sha256 -m finds files from their SHA-256" \
+  "`$MD5DEEP -r -c sha256 -m "$DIR/known256" "$DIR/tree" | sort`" "$WANT"
+
+# Memory mapped files (-M) hash the same as files we read, small or big
+SUMS=`find "$DIR/tree" "$DIR/pieces" -type f | xargs md5sum | sort -k 2`
+for opts in "-M" "-M -j 2" "-M -L"; do
+  check "$opts" \
+    "`$MD5DEEP -r $opts "$DIR/tree" "$DIR/pieces" 2>/dev/null | sort -k 2`" "$SUMS"
+done
+
+# Reading ahead (-A) hashes the same, even in blocks small enough that
+# the big file takes many of them
+for opts in "-A" "-A -B 4096" "-A -j 2" "-A -D"; do
+  check "$opts" \
+    "`$MD5DEEP -r $opts "$DIR/tree" "$DIR/pieces" 2>/dev/null | sort -k 2`" "$SUMS"
+done
+
+# Batches of small files read with io_uring (-U) hash the same as files
+# read one at a time. There are enough files here to fill a few batches.
+# Without io_uring, -U falls back to reading them the usual way.
+mkdir "$DIR/small"
+i=0
+while [ $i -lt 300 ]; do
+  echo "file $i" > "$DIR/small/$i"
+  i=`expr $i + 1`
+done
+check "-U" \
+  "`$MD5DEEP -r -U "$DIR/small" "$DIR/pieces" 2>/dev/null | sort -k 2`" \
+  "`find "$DIR/small" "$DIR/pieces" -type f | xargs md5sum | sort -k 2`"
+check "-U -c sha1" \
+  "`$MD5DEEP -r -U -c sha1 "$DIR/small" 2>/dev/null | sort -k 2`" \
+  "`find "$DIR/small" -type f | xargs sha1sum | sort -k 2`"
+check "-U -m finds the known files" \
+  "`$MD5DEEP -r -U -m "$DIR/known" "$DIR/tree" 2>/dev/null | sort`" \
+  "`$MD5DEEP -r -m "$DIR/known" "$DIR/tree" | sort`"
+
+exit $FAILED
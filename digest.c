@@ -0,0 +1,307 @@
+/* MD5DEEP - digest.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* The digest set (-c). Some people need the SHA-1 or the SHA-256 of
+   every file as well as the MD5. Rather than reading the file once for
+   each, every block we read is fed to all of the digests in the set.
+
+   SHA-256 is a lot slower than reading from a disk, so when we're only
+   hashing one file at a time and there's more than one processor, big
+   files get a helper thread for each digest after the first. The
+   helpers work on the same block as the caller, and we wait for all of
+   them to finish it before we read the next one. With -j the other
+   processors are already busy with other files, so we don't bother. */
+
+int digestMask = DIGEST_MD5;
+
+static void formatHex(unsigned char *sum, int len, char *result) {
+
+  static char hex[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0 ; i < len ; i++) {
+    result[2 * i] = hex[(sum[i] >> 4) & 0xf];
+    result[2 * i + 1] = hex[sum[i] & 0xf];
+  }
+  result[2 * len] = 0;
+}
+
+
+/* Reads a list of digests like "md5,sha1,sha256". Returns the set, or
+   zero if the list has something in it we don't know about. */
+int parseDigestList(char *arg) {
+
+  int mask = 0;
+  size_t len;
+
+  while (*arg) {
+
+    len = strcspn(arg,",");
+
+    if (len == 3 && !strncasecmp(arg,"md5",len))
+      mask |= DIGEST_MD5;
+    else if (len == 4 && !strncasecmp(arg,"sha1",len))
+      mask |= DIGEST_SHA1;
+    else if (len == 6 && !strncasecmp(arg,"sha256",len))
+      mask |= DIGEST_SHA256;
+    else
+      return 0;
+
+    arg += len;
+    if (*arg == ',')
+      arg++;
+  }
+
+  return mask;
+}
+
+
+static void updateDigests(digestSet *d, int mask, unsigned char *buf,
+			  unsigned long len) {
+  if (mask & DIGEST_MD5)
+    MD5Update(&d->md5,buf,len);
+  if (mask & DIGEST_SHA1)
+    SHA1Update(&d->sha1,buf,len);
+  if (mask & DIGEST_SHA256)
+    SHA256Update(&d->sha256,buf,len);
+}
+
+
+#ifdef __UNIX
+
+#include <pthread.h>
+
+/* Files smaller than this aren't worth starting threads for */
+#define DIGEST_PARALLEL_SIZE   (16 * ONE_MEGABYTE)
+
+typedef struct digestHelper {
+  struct digestHelpers *all;
+  int mask;
+  unsigned long seen;
+  pthread_t thread;
+} digestHelper;
+
+struct digestHelpers {
+  digestSet *set;
+  int count, callerMask;
+  digestHelper helper[2];
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready, done;
+  unsigned char *buf;
+  unsigned long len, generation;
+  int pending;
+  bool finished;
+};
+
+
+static void *helperThread(void *arg) {
+
+  digestHelper *me = (digestHelper *)arg;
+  struct digestHelpers *h = me->all;
+
+  pthread_mutex_lock(&h->lock);
+
+  for (;;) {
+    while (me->seen == h->generation && !h->finished)
+      pthread_cond_wait(&h->ready,&h->lock);
+    if (me->seen == h->generation)
+      break;
+
+    me->seen = h->generation;
+    pthread_mutex_unlock(&h->lock);
+
+    updateDigests(h->set,me->mask,h->buf,h->len);
+
+    pthread_mutex_lock(&h->lock);
+    if (--h->pending == 0)
+      pthread_cond_signal(&h->done);
+  }
+
+  pthread_mutex_unlock(&h->lock);
+  return NULL;
+}
+
+
+static int wantHelpers(fileReader *r) {
+
+  static long cpus = 0;
+  unsigned long long size;
+
+  /* Is there more than one digest in the set? */
+  if ((digestMask & (digestMask - 1)) == 0 ||
+      threadCount > 1 || modeMultiBuffer)
+    return FALSE;
+
+  if (cpus == 0 && (cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    cpus = 1;
+  if (cpus < 2)
+    return FALSE;
+
+  size = measureOpenFile(r);
+  return (size != (unsigned long long)-1 && size >= DIGEST_PARALLEL_SIZE);
+}
+
+
+/* The caller keeps the first digest in the set and the helpers take
+   the rest. If we can't start a helper, the caller does its digest. */
+static void startHelpers(digestSet *d) {
+
+  struct digestHelpers *h;
+  int bit, first = TRUE;
+
+  if ((h = (struct digestHelpers *)calloc(1,sizeof(*h))) == NULL)
+    return;
+
+  h->set = d;
+  pthread_mutex_init(&h->lock,NULL);
+  pthread_cond_init(&h->ready,NULL);
+  pthread_cond_init(&h->done,NULL);
+
+  for (bit = DIGEST_MD5 ; bit <= DIGEST_SHA256 ; bit <<= 1) {
+    if (!(digestMask & bit))
+      continue;
+
+    if (!first) {
+      h->helper[h->count].all  = h;
+      h->helper[h->count].mask = bit;
+      if (!pthread_create(&h->helper[h->count].thread,NULL,helperThread,
+			  &h->helper[h->count])) {
+	h->count++;
+	continue;
+      }
+    }
+
+    h->callerMask |= bit;
+    first = FALSE;
+  }
+
+  if (h->count == 0) {
+    pthread_mutex_destroy(&h->lock);
+    pthread_cond_destroy(&h->ready);
+    pthread_cond_destroy(&h->done);
+    free(h);
+    return;
+  }
+
+  d->helpers = h;
+}
+
+
+static void stopHelpers(digestSet *d) {
+
+  struct digestHelpers *h = d->helpers;
+  int i;
+
+  pthread_mutex_lock(&h->lock);
+  h->finished = TRUE;
+  pthread_cond_broadcast(&h->ready);
+  pthread_mutex_unlock(&h->lock);
+
+  for (i = 0 ; i < h->count ; i++)
+    pthread_join(h->helper[i].thread,NULL);
+
+  pthread_mutex_destroy(&h->lock);
+  pthread_cond_destroy(&h->ready);
+  pthread_cond_destroy(&h->done);
+  free(h);
+  d->helpers = NULL;
+}
+
+#endif /* ifdef __UNIX */
+
+
+/* Starts on the digests of the file open in r. If r is NULL, the
+   caller has the whole file in memory already. */
+void digestInit(digestSet *d, fileReader *r) {
+
+  d->helpers = NULL;
+
+  if (digestMask & DIGEST_MD5)
+    MD5Init(&d->md5);
+  if (digestMask & DIGEST_SHA1)
+    SHA1Init(&d->sha1);
+  if (digestMask & DIGEST_SHA256)
+    SHA256Init(&d->sha256);
+
+#ifdef __UNIX
+  if (r != NULL && wantHelpers(r))
+    startHelpers(d);
+#endif
+}
+
+
+void digestUpdate(digestSet *d, unsigned char *buf, unsigned long len) {
+
+#ifdef __UNIX
+  struct digestHelpers *h = d->helpers;
+
+  if (h != NULL) {
+
+    pthread_mutex_lock(&h->lock);
+    h->buf = buf;
+    h->len = len;
+    h->pending = h->count;
+    h->generation++;
+    pthread_cond_broadcast(&h->ready);
+    pthread_mutex_unlock(&h->lock);
+
+    updateDigests(d,h->callerMask,buf,len);
+
+    /* The buffer is only good until the next read */
+    pthread_mutex_lock(&h->lock);
+    while (h->pending > 0)
+      pthread_cond_wait(&h->done,&h->lock);
+    pthread_mutex_unlock(&h->lock);
+    return;
+  }
+#endif
+
+  updateDigests(d,digestMask,buf,len);
+}
+
+
+/* Finishes the digests and writes them into result, which must hold
+   at least DIGEST_STRING_LENGTH characters */
+void digestFinal(digestSet *d, char *result) {
+
+  unsigned char sum[SHA256_HASH_LENGTH];
+
+#ifdef __UNIX
+  if (d->helpers != NULL)
+    stopHelpers(d);
+#endif
+
+  *result = 0;
+
+  if (digestMask & DIGEST_MD5) {
+    MD5Final(sum,&d->md5);
+    formatHex(sum,MD5_HASH_LENGTH,result);
+  }
+
+  if (digestMask & DIGEST_SHA1) {
+    SHA1Final(sum,&d->sha1);
+    if (*result)
+      strcat(result,"  ");
+    formatHex(sum,SHA1_HASH_LENGTH,result + strlen(result));
+  }
+
+  if (digestMask & DIGEST_SHA256) {
+    SHA256Final(sum,&d->sha256);
+    if (*result)
+      strcat(result,"  ");
+    formatHex(sum,SHA256_HASH_LENGTH,result + strlen(result));
+  }
+}
@@ -0,0 +1,283 @@
+/* MD5DEEP - dupes.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* Duplicate mode (-d). People used to find duplicate files by hashing
+   everything and sorting the output, but two files can't be the same
+   unless they're the same size, and most files on a disk have a size
+   nobody else has. So instead of hashing the files as we find them, we
+   just write down their names and sizes. When the walk is done we only
+   look at the files that share their size with another file.
+
+   Of those, we first hash the first DUPES_PREFIX_SIZE bytes. Files that
+   are different usually differ right at the start, so that takes care
+   of most of them. Only the files that still look the same are hashed
+   all the way through. A file that's no bigger than the prefix is done
+   after the first step.
+
+   The duplicates are printed in groups, biggest files first. Each line
+   is a hash and a filename, like our normal output, and the groups are
+   separated by blank lines. The output can be used with -m as is. */
+
+#ifdef __UNIX
+#include <pthread.h>
+#endif
+
+#define DUPES_PREFIX_SIZE   65536
+
+/* How much we know about the digest of a file */
+#define DUPE_NONE     0
+#define DUPE_PREFIX   1
+#define DUPE_WHOLE    2
+#define DUPE_FAILED   3
+
+typedef struct dupeFile {
+  char *filename;
+  unsigned long long size;
+  int state;
+  unsigned char digest[MD5_HASH_LENGTH];
+} dupeFile;
+
+int modeDupes = FALSE;
+
+static dupeFile *files = NULL;
+static unsigned long fileCount = 0, fileAllocated = 0;
+
+/* All of the filenames are kept until the walk is done and then thrown
+   away together */
+static arena names = { NULL, NULL, 0 };
+
+static unsigned long candidates = 0, prefixes = 0, wholes = 0;
+static unsigned long duplicates = 0, groups = 0;
+
+/* With -W several walkers can find files at once */
+#ifdef __UNIX
+static pthread_mutex_t dupesLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/* Writes down filename so that we can look at it when the walk is
+   done. The caller has already stat'ed the file to find its size. */
+void dupesAdd(char *filename, unsigned long long size) {
+
+#ifdef __UNIX
+  pthread_mutex_lock(&dupesLock);
+#endif
+
+  if (fileCount == fileAllocated) {
+    fileAllocated = fileAllocated ? fileAllocated * 2 : 1024;
+    files = (dupeFile *)realloc(files,fileAllocated * sizeof(dupeFile));
+    if (files == NULL) {
+      fprintf(stderr,"%s: Out of memory\n", __progname);
+      exit (1);
+    }
+  }
+
+  files[fileCount].filename = arenaStrdup(&names,filename);
+  files[fileCount].size     = size;
+  files[fileCount].state    = DUPE_NONE;
+  fileCount++;
+
+#ifdef __UNIX
+  pthread_mutex_unlock(&dupesLock);
+#endif
+}
+
+
+/* Biggest files first */
+static int compareSize(const void *a, const void *b) {
+  dupeFile *x = (dupeFile *)a, *y = (dupeFile *)b;
+  return (x->size < y->size) - (x->size > y->size);
+}
+
+
+/* Puts files with the same state and digest next to each other, in
+   order by name. The walk finds files in a different order every time
+   with -W, but the output shouldn't change. */
+static int compareDigest(const void *a, const void *b) {
+
+  dupeFile *x = (dupeFile *)a, *y = (dupeFile *)b;
+  int diff;
+
+  if (x->state != y->state)
+    return x->state - y->state;
+  if ((diff = memcmp(x->digest,y->digest,MD5_HASH_LENGTH)) != 0)
+    return diff;
+  return strcmp(x->filename,y->filename);
+}
+
+
+/* Returns the number of files starting at d that have the same state
+   and digest as d, up to end */
+static unsigned long sameDigest(dupeFile *d, dupeFile *end) {
+
+  dupeFile *p = d + 1;
+
+  while (p < end && p->state == d->state &&
+	 !memcmp(p->digest,d->digest,MD5_HASH_LENGTH))
+    p++;
+
+  return p - d;
+}
+
+
+static void hashPrefix(dupeFile *d) {
+
+  static unsigned char buf[DUPES_PREFIX_SIZE];
+  size_t len;
+  FILE *f;
+  MD5_CTX md;
+
+  if ((f = fopen(d->filename,"rb")) == NULL) {
+    printError(d->filename);
+    d->state = DUPE_FAILED;
+    return;
+  }
+
+  len = fread(buf,1,DUPES_PREFIX_SIZE,f);
+  if (ferror(f)) {
+    printError(d->filename);
+    d->state = DUPE_FAILED;
+    fclose(f);
+    return;
+  }
+  fclose(f);
+
+  MD5Init(&md);
+  MD5Update(&md,buf,len);
+  MD5Final(d->digest,&md);
+  prefixes++;
+
+  /* If we got all of it, this is the hash of the whole file */
+  d->state = (d->size <= DUPES_PREFIX_SIZE) ? DUPE_WHOLE : DUPE_PREFIX;
+}
+
+
+/* Hashes all of the file the normal way, so the cache (-C) and the
+   hard link table get used */
+static void hashWhole(dupeFile *d) {
+
+  char result[DIGEST_STRING_LENGTH], *status;
+  struct stat info;
+
+  if (!knownHash(d->filename,&info,result)) {
+
+    if (!readerOpen(mainReader,d->filename)) {
+      d->state = DUPE_FAILED;
+      return;
+    }
+
+    if (openedHash(mainReader,&info,result))
+      status = result;
+    else {
+      status = hashFile(mainReader,result);
+      if (status != NULL) {
+	rememberHash(d->filename,&info,result);
+	wholes++;
+      }
+    }
+    readerClose(mainReader);
+
+    if (status == NULL) {
+      d->state = DUPE_FAILED;
+      return;
+    }
+  }
+
+  scanHexDigest(result,d->digest);
+  d->state = DUPE_WHOLE;
+}
+
+
+static void printGroup(dupeFile *d, unsigned long n) {
+
+  char result[2 * MD5_HASH_LENGTH + 1];
+  unsigned long i;
+
+  formatDigest(d->digest,result);
+  for (i = 0 ; i < n ; i++)
+    printf("%s  %s\n", result,d[i].filename);
+  printf("\n");
+
+  duplicates += n;
+  groups++;
+}
+
+
+/* Works out which of the files in group, which are all count files of
+   the same size, are duplicates and prints them */
+static void checkGroup(dupeFile *group, unsigned long count) {
+
+  dupeFile *end = group + count, *d;
+  unsigned long n, i;
+  MD5_CTX md;
+
+  candidates += count;
+
+  /* Empty files are all the same and there's nothing to read */
+  if (group->size == 0) {
+    MD5Init(&md);
+    MD5Final(group->digest,&md);
+    for (d = group ; d < end ; d++) {
+      memcpy(d->digest,group->digest,MD5_HASH_LENGTH);
+      d->state = DUPE_WHOLE;
+    }
+  }
+  else
+    for (d = group ; d < end ; d++)
+      hashPrefix(d);
+
+  qsort(group,count,sizeof(dupeFile),compareDigest);
+
+  /* Files whose prefix nobody else has can't be duplicates */
+  for (d = group ; d < end ; d += n)
+    if ((n = sameDigest(d,end)) > 1 && d->state == DUPE_PREFIX)
+      for (i = 0 ; i < n ; i++)
+	hashWhole(d + i);
+
+  qsort(group,count,sizeof(dupeFile),compareDigest);
+
+  for (d = group ; d < end ; d += n)
+    if ((n = sameDigest(d,end)) > 1 && d->state == DUPE_WHOLE)
+      printGroup(d,n);
+}
+
+
+/* Called when the walk is done */
+void dupesReport(void) {
+
+  unsigned long i, n;
+
+  qsort(files,fileCount,sizeof(dupeFile),compareSize);
+
+  for (i = 0 ; i < fileCount ; i += n) {
+    for (n = 1 ; i + n < fileCount && files[i + n].size == files[i].size ; n++)
+      ;
+    if (n > 1)
+      checkGroup(files + i,n);
+  }
+
+  arenaFree(&names);
+  free(files);
+  files = NULL;
+}
+
+
+void printDupesStats(void) {
+  fprintf(stderr,"%s: %lu files, %lu the same size as another, "
+	  "%lu prefixes and %lu whole files hashed\n",
+	  __progname,fileCount,candidates,prefixes,wholes);
+  fprintf(stderr,"%s: %lu duplicate files in %lu groups\n",
+	  __progname,duplicates,groups);
+}
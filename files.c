@@ -48,27 +48,40 @@
 
 
 bool isValidHash(char *buf) {
-  short pos = 0;
+  unsigned char digest[MD5_HASH_LENGTH];
 
-  if (strlen(buf) < HASH_STRING_LENGTH) 
+  if (strnlen(buf,HASH_STRING_LENGTH) < HASH_STRING_LENGTH) 
     return FALSE;
 
-  for (pos = 0 ; pos < HASH_STRING_LENGTH ; pos++) 
-    if (!isxdigit(buf[pos])) 
-      return FALSE;
-  return TRUE;
+  return scanHexDigest(buf,digest);
 }
 
 
-/* A plain hash file has 32 hash characters at the start of each line
-   followed by two spaces or tabs. */
-bool isPlainFile(char *buf) {
+/* Returns the length of the hash at the start of buf if it's the right
+   length for an MD5, SHA-1 or SHA-256 hash and is followed by two spaces,
+   or zero if it isn't. The text ends at end. */
+int plainHashLength(char *buf, char *end) {
 
-  if (!isValidHash(buf))
-    return FALSE;
+  char *p = buf;
+  size_t len;
+
+  while (p < end && isxdigit(*p))
+    p++;
+  len = p - buf;
+
+  if (len != 2 * MD5_HASH_LENGTH && len != 2 * SHA1_HASH_LENGTH &&
+      len != 2 * SHA256_HASH_LENGTH)
+    return 0;
+
+  return (end - p >= 2 && p[0] == ' ' && p[1] == ' ') ? len : 0;
+}
 
-  return (buf[HASH_STRING_LENGTH]     == 32 &&
-	  buf[HASH_STRING_LENGTH + 1] == 32);
+
+/* A plain hash file has a hash at the start of each line followed by
+   two spaces. The hash can be an MD5 (32 characters), or a SHA-1 or
+   SHA-256 from -c. */
+bool isPlainFile(char *buf) {
+  return (plainHashLength(buf,buf + strlen(buf)) > 0);
 }
 
 
@@ -95,6 +108,13 @@ int determineFileType(FILE *f) {
   if ((fgets(buf,MAX_STRING_LENGTH,f)) == NULL) 
     return FALSE;
 
+  return determineLineType(buf);
+}
+
+
+/* Works out the type of a hash file from its first line */
+int determineLineType(char *buf) {
+
   if (isHashkeeperFile(buf)) 
     return TYPE_HASHKEEPER;
 
@@ -165,36 +185,17 @@ bool findPlainHashinLine(char *buf) {
 /* Attempts to find a hash value after the nth quotation mark in buf */
 bool findHashAfterQuotes(char *buf, int n) {
 
-  int count = 0, pos = -1;
-
-  while (count < n) {
-
-    pos++;
-    if (buf[pos] == '"') {
-      count++;
-
-      /* We don't *need* to continue here, but by skipping the if
-	 statement that comes next, we should be faster.
-	 Yes, I'm that concerned about speed. */
-      continue;
-    }
+  char *end = buf + strlen(buf), *pos = scanNthChar(buf,end,'"',n);
 
-    if (buf[pos] == 0) 
-      return FALSE;
-  }
-
-  /* The current character is still the leading quote to the hash.
+  /* pos is still the leading quote to the hash.
      We advance one to get to the real start of the hash */
-  pos++;
+  if (pos == NULL || end - ++pos < HASH_STRING_LENGTH)
+    return FALSE;
   
   /* Now we just copy the hash value back to the begining of the line
      and re-terminate the string */   
-  for (count = 0 ; count < HASH_STRING_LENGTH ; count++) {
-      buf[count] = buf[pos];
-      pos++;
-  }
-  
-  buf[count] = 0;
+  memmove(buf,pos,HASH_STRING_LENGTH);
+  buf[HASH_STRING_LENGTH] = 0;
   return TRUE;
 }
 
@@ -256,4 +257,90 @@ bool findHashValueinLine(char *buf, int fileType) {
 
 
 
+/* Like findHashValueinLine, but decodes the hash straight into digest
+   instead of moving it to the start of the line. The line is len
+   characters long and doesn't have to be NUL terminated, so this works
+   on a hash file that's mapped into memory. */
+bool findDigestinLine(char *line, size_t len, int fileType,
+		      unsigned char *digest) {
+
+  char *end = line + len, *hash = line;
+
+  switch(fileType) {
+
+  case TYPE_PLAIN:
+  case TYPE_ILOOK:
+    break;
+
+  case TYPE_HASHKEEPER:
+    if ((hash = scanNthChar(line,end,'"',3)) != NULL)
+      hash++;
+    break;
 
+  case TYPE_NSRL:
+    if ((hash = scanNthChar(line,end,'"',9)) != NULL)
+      hash++;
+    break;
+
+  default:
+    return FALSE;
+  }
+
+  if (hash == NULL || end - hash < HASH_STRING_LENGTH)
+    return FALSE;
+
+  return scanHexDigest(hash,digest);
+}
+
+
+
+/* Reads the decimal number at p, which has to be followed by the end
+   of its field. Returns FALSE if there isn't one. */
+static bool parseSizeField(char *p, char *end, unsigned long long *size) {
+
+  char *start;
+
+  if (p < end && *p == '"')
+    p++;
+
+  start = p;
+  for (*size = 0 ; p < end && isdigit(*p) ; p++)
+    *size = *size * 10 + (*p - '0');
+
+  return (p > start &&
+	  (p == end || *p == ',' || *p == '"' || isspace(*p)));
+}
+
+
+/* Finds the size of the file in a line of a hash file, if it has one.
+   The line is len characters long, like for findDigestinLine. Plain
+   hash files don't have sizes. In NSRL and Hashkeeper files the size
+   is the field after the fourth quotation mark. In iLook files it's the
+   last field on the line. */
+bool findSizeinLine(char *line, size_t len, int fileType,
+		    unsigned long long *size) {
+
+  char *end = line + len, *pos;
+
+  switch(fileType) {
+
+  case TYPE_NSRL:
+  case TYPE_HASHKEEPER:
+    if ((pos = scanNthChar(line,end,'"',4)) == NULL || 
+	end - pos < 2 || pos[1] != ',')
+      return FALSE;
+    return parseSizeField(pos + 2,end,size);
+
+  case TYPE_ILOOK:
+    while (end > line && isspace(end[-1]))
+      end--;
+    for (pos = end ; pos > line && pos[-1] != ',' ; pos--)
+      ;
+    if (pos == line)
+      return FALSE;
+    return parseSizeField(pos,end,size);
+
+  default:
+    return FALSE;
+  }
+}
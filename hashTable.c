@@ -1,4 +1,3 @@
-
 /* MD5DEEP - hashTable.c
  *
  * By Jesse Kornblum
@@ -16,39 +15,65 @@
 #include "hashTable.h"
 
 
-/* These two functions are the "hash" functions for the hash table. 
-   Because the original implementation of this code was for storing
-   md5 hashes, I used the name "translate" to avoid confusion. */
+/* Converts the first HASH_STRING_LENGTH characters of n into a binary
+   digest. Returns FALSE if they aren't all hex. We only do this once for
+   every hash we load and once for every hash we compute. */
+int hashTableDecode(char *n, unsigned char *digest) {
+  return scanHexDigest(n,digest);
+}
 
 
-/* Convert a single hexadecimal character to decimal. If c is not a valid
-   hex character, returns 0. */
-int translateChar(char c) {
+/* The digests are already about as random as it gets, so the first few
+   bytes of each one make a fine index into the table */
+static unsigned long translate(hashTable *knownHashes, unsigned char *digest) {
+  unsigned long key;
+  memcpy(&key,digest,sizeof(key));
+  return key & (knownHashes->size - 1);
+}
 
-  /* If this is a digit */
-  if (c > 47 && c < 58) 
-    return (c - 48);
-  
-  c = toupper(c);
-  /* If this is a letter... 'A' should be equal to 10 */
-  if (c > 64 && c < 71) 
-    return (c - 55);
 
-  return 0;
-}
-    
-/* Translates a hex value into it's appropriate index in the array.
-   In reality, this just turns the first HASH_SIG_FIGS into decimal */
-unsigned long translate(char *n) {
- 
+static int isZero(unsigned char *digest) {
   int count;
-  unsigned long total = 0, power = 1;
-  for (count = HASH_SIG_FIGS - 1 ; count >= 0 ; count--) {
-    total += translateChar(n[count]) * power;
-    power *= 16;
+  for (count = 0 ; count < MD5_HASH_LENGTH ; count++)
+    if (digest[count])
+      return FALSE;
+  return TRUE;
+}
+
+
+/* Returns the slot where digest is, or the empty slot where it would go */
+static unsigned long findSlot(hashTable *knownHashes, unsigned char *digest) {
+
+  unsigned long key = translate(knownHashes,digest);
+
+  while (!isZero(knownHashes->slots[key]) &&
+	 memcmp(knownHashes->slots[key],digest,MD5_HASH_LENGTH))
+    key = (key + 1) & (knownHashes->size - 1);
+
+  return key;
+}
+
+
+/* Moves everything into a table with room for size slots */
+static int resize(hashTable *knownHashes, unsigned long size) {
+
+  unsigned char (*old)[MD5_HASH_LENGTH] = knownHashes->slots;
+  unsigned long oldSize = knownHashes->size, count;
+
+  knownHashes->slots = calloc(size,MD5_HASH_LENGTH);
+  if (knownHashes->slots == NULL) {
+    knownHashes->slots = old;
+    return FALSE;
   }
+  knownHashes->size = size;
 
-  return total;
+  for (count = 0 ; count < oldSize ; count++)
+    if (!isZero(old[count]))
+      memcpy(knownHashes->slots[findSlot(knownHashes,old[count])],
+	     old[count],MD5_HASH_LENGTH);
+
+  free(old);
+  return TRUE;
 }
 
 
@@ -56,116 +81,153 @@ unsigned long translate(char *n) {
 
 
 void hashTableInit(hashTable *knownHashes) {
-  unsigned long count;
-  for (count = 0 ; count < HASH_TABLE_SIZE ; count++) {
-    (*knownHashes)[count] = NULL;
-  }
+  knownHashes->slots = NULL;
+  knownHashes->size = 0;
+  knownHashes->count = 0;
+  knownHashes->haveZero = FALSE;
 }
 
 
-void hashTableAdd(hashTable *knownHashes, char *n) {
+/* Makes sure there is room for count more hashes without growing the
+   table again. Returns FALSE if we ran out of memory. */
+int hashTableReserve(hashTable *knownHashes, unsigned long count) {
 
-  unsigned long key = translate(n);
-  hashNode *new, *temp;
+  unsigned long size = knownHashes->size ? knownHashes->size : HASH_TABLE_MIN_SIZE;
+  unsigned long needed = knownHashes->count + count;
 
-  if ((*knownHashes)[key] == NULL) {
+  while (needed > size * HASH_TABLE_LOAD / 100)
+    size *= 2;
 
-    new = (hashNode*)malloc(sizeof(hashNode));    
-    new->data = strdup(n);
-    new->next = NULL;
+  if (size == knownHashes->size)
+    return TRUE;
+  return resize(knownHashes,size);
+}
+
+
+/* Returns FALSE if we ran out of memory */
+int hashTableAdd(hashTable *knownHashes, unsigned char *digest) {
 
-    (*knownHashes)[key] = new;
-    return;
+  unsigned long key;
+
+  if (isZero(digest)) {
+    knownHashes->haveZero = TRUE;
+    return TRUE;
   }
 
-  temp = (*knownHashes)[key];
+  if (!hashTableReserve(knownHashes,1))
+    return FALSE;
 
   /* If this value is already in the table, we don't need to add it again */
-  if (!strncasecmp(temp->data,n,HASH_STRING_LENGTH)) {
-    return;
+  key = findSlot(knownHashes,digest);
+  if (isZero(knownHashes->slots[key])) {
+    memcpy(knownHashes->slots[key],digest,MD5_HASH_LENGTH);
+    knownHashes->count++;
   }
 
-  while (temp->next != NULL) {
+  return TRUE;
+}
 
-    temp = temp->next;
 
-    if (!strncasecmp(temp->data,n,HASH_STRING_LENGTH)) {
-      return;
-    }
-  }
+int hashTableContains(hashTable *knownHashes, unsigned char *digest) {
+
+  if (isZero(digest))
+    return knownHashes->haveZero;
 
-  new = (hashNode*)malloc(sizeof(hashNode));    
-  new->data = strdup(n);
-  new->next = NULL;
+  if (knownHashes->size == 0)
+    return FALSE;
 
-  temp->next = new;
+  return !isZero(knownHashes->slots[findSlot(knownHashes,digest)]);
 }
 
 
 
-int hashTableContains(hashTable *knownHashes, char *n) {
+void hashTableFree(hashTable *knownHashes) {
+  free(knownHashes->slots);
+  hashTableInit(knownHashes);
+}
 
-  unsigned long key = translate(n);
-  hashNode *temp;
 
-  if ((*knownHashes)[key] == NULL) {
+/* Adds every hash in from to knownHashes. Returns FALSE if we ran out
+   of memory. */
+int hashTableMerge(hashTable *knownHashes, hashTable *from) {
+
+  unsigned long count;
+
+  if (from->haveZero)
+    knownHashes->haveZero = TRUE;
+
+  if (!hashTableReserve(knownHashes,from->count))
     return FALSE;
-  }
 
-  /* Just because we matched keys doesn't mean we've found a hit yet.
-     We still have to verify that we've found the real key. */
-  temp = (*knownHashes)[key];
+  for (count = 0 ; count < from->size ; count++)
+    if (!isZero(from->slots[count]) &&
+	!hashTableAdd(knownHashes,from->slots[count]))
+      return FALSE;
+
+  return TRUE;
+}
+
+
+/* Copies every hash in the table to digests, which must have room for
+   all of them. Returns the number of hashes copied. */
+unsigned long hashTableExport(hashTable *knownHashes,
+			      unsigned char (*digests)[MD5_HASH_LENGTH]) {
 
-  do {
-    if (!strncasecmp(temp->data,n,HASH_STRING_LENGTH)) 
-      return TRUE;
+  unsigned long count, total = 0;
 
-    temp = temp->next;
-  }  while (temp != NULL);
+  if (knownHashes->haveZero)
+    memset(digests[total++],0,MD5_HASH_LENGTH);
 
-  return FALSE;
+  for (count = 0 ; count < knownHashes->size ; count++)
+    if (!isZero(knownHashes->slots[count]))
+      memcpy(digests[total++],knownHashes->slots[count],MD5_HASH_LENGTH);
+
+  return total;
 }
 
 
 
-/* Displays the number of nodes at each depth of the hash table.
+/* Adds every hash in the table to the filter, straight from the slots */
+void hashTableFilter(hashTable *knownHashes, bloomFilter *b) {
+
+  unsigned char zero[MD5_HASH_LENGTH];
+  unsigned long count;
+
+  if (knownHashes->haveZero) {
+    memset(zero,0,MD5_HASH_LENGTH);
+    bloomAdd(b,zero);
+  }
+
+  for (count = 0 ; count < knownHashes->size ; count++)
+    if (!isZero(knownHashes->slots[count]))
+      bloomAdd(b,knownHashes->slots[count]);
+}
+
+
+/* Displays how far we have to probe to find the hashes in the table.
    Used for debugging/optimization only. */
 void hashTableEvaluate(hashTable *knownHashes) {
 
-  hashNode *ptr;
-  int temp = 0;
-  unsigned long count, depth[10];
+  unsigned long count, distance, depth[10];
 
   for (count = 0 ; count < 10 ; count++) {
     depth[count] = 0;
   }
 
-  for (count = 0 ; count < HASH_TABLE_SIZE ; count++) {
+  for (count = 0 ; count < knownHashes->size ; count++) {
 
-    if (knownHashes[count] == NULL) {
-      depth[0]++;
+    if (isZero(knownHashes->slots[count]))
       continue;
-    }
-
-    temp = 0;
-    ptr = (*knownHashes)[count];
-    while (ptr != NULL) {
-      temp++;
-      ptr = ptr->next;
-    }
 
-    depth[temp]++;
-  }
-  
-  if (temp > 10) {
-    printf ("Depth: %d  count: %ld\n",temp,count);
-    exit (-1);
+    distance = (count - translate(knownHashes,knownHashes->slots[count])) &
+      (knownHashes->size - 1);
+    depth[distance < 9 ? distance : 9]++;
   }
 
-  printf ("Hash table depth chart:\n");
+  printf ("Hash table: %ld hashes in %ld slots\n",
+	  knownHashes->count,knownHashes->size);
+  printf ("Probe distance chart:\n");
   for (count = 0; count < 10 ; count++) {
     printf ("%ld: %ld\n", count,depth[count]);
   }
 }
-    
-  
@@ -22,23 +22,54 @@
 
 #include <ctype.h>
 
-/* The HASH_TABLE_SIZE must be more than 16 to the power of HASH_SIG_FIGS */
-#define HASH_SIG_FIGS           5
-#define HASH_TABLE_SIZE   1048577
+/* The known hashes are kept as binary digests in one big array. We use
+   open addressing with linear probing, so a lookup usually touches a
+   single cache line. The size is always a power of two and the table
+   is never more than HASH_TABLE_LOAD percent full. An all zero slot is
+   empty, so the all zero hash is remembered separately. */
+#define HASH_TABLE_MIN_SIZE   16
+#define HASH_TABLE_LOAD       50
 
-typedef struct hashNode {
-  char *data;
-  struct hashNode *next;
-} hashNode;
-
-typedef hashNode *hashTable[HASH_TABLE_SIZE + 1];
+typedef struct hashTable {
+  unsigned char (*slots)[MD5_HASH_LENGTH];
+  unsigned long size, count;
+  bool haveZero;
+} hashTable;
 
 
 /* --- Everything below this line is public --- */
 
 void hashTableInit(hashTable *knownHashes);
-void hashTableAdd(hashTable *knownHashes, char *n);
-int hashTableContains(hashTable *knownHashes, char *n);
+int hashTableReserve(hashTable *knownHashes, unsigned long count);
+int hashTableAdd(hashTable *knownHashes, unsigned char *digest);
+int hashTableContains(hashTable *knownHashes, unsigned char *digest);
+void hashTableFree(hashTable *knownHashes);
+int hashTableMerge(hashTable *knownHashes, hashTable *from);
+unsigned long hashTableExport(hashTable *knownHashes,
+			      unsigned char (*digests)[MD5_HASH_LENGTH]);
+
+/* Converts a hex string into a binary digest */
+int hashTableDecode(char *n, unsigned char *digest);
+
+/* Bloom filter in front of the table (bloom.c) */
+typedef struct bloomFilter {
+  unsigned long long *blocks;
+  unsigned long count;
+  int k;
+} bloomFilter;
+
+int bloomInit(bloomFilter *b, unsigned long entries, double rate);
+void bloomAdd(bloomFilter *b, unsigned char *digest);
+int bloomMaybe(bloomFilter *b, unsigned char *digest);
+void hashTableFilter(hashTable *knownHashes, bloomFilter *b);
+
+/* Precompiled indexes of known hashes (index.c) */
+int isIndexFile(FILE *f);
+int indexLoad(char *filename);
+int indexContains(unsigned char *digest);
+int indexLoaded(void);
+int indexWrite(char *filename, hashTable *knownHashes,
+	       char **sources, int sourceCount);
 
 /* This function is for debugging */
 void hashTableEvaluate(hashTable *knownHashes);
@@ -0,0 +1,391 @@
+/* MD5DEEP - index.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+#include "hashTable.h"
+
+/* Known hash indexes (-I). Parsing a big hash set like the NSRL every
+   time we run takes minutes. Instead, the hashes can be loaded once and
+   written out as an index: a small header followed by every hash as a
+   16 byte binary digest, sorted. When an index is given to -m we map it
+   into memory and search it where it lies, so there's nothing to load
+   and every md5deep running on the machine shares the same pages.
+
+   The layout of an index is:
+
+     indexHeader                  (see below)
+     the names of the hash files  (each one followed by a zero byte)
+     zero bytes up to the next multiple of INDEX_ALIGNMENT
+     count digests                (sorted with memcmp)
+
+   The checksum in the header is the MD5 of the digests, so an index can
+   be checked with nothing more than tail and md5sum. Checking it means
+   reading every page of the index, which is what we're trying not to do,
+   so we only check it when asked to (-K). The numbers in the
+   header are written in the byte order of the machine that built it,
+   which we check with byteOrder. */
+
+#ifdef __UNIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#define INDEX_MAGIC        "MD5DIDX1"
+#define INDEX_VERSION      1
+#define INDEX_BYTE_ORDER   0x01020304
+#define INDEX_ALIGNMENT    16
+
+typedef struct indexHeader {
+  char magic[8];
+  u_int32_t version, byteOrder;
+  unsigned long long count, offset;
+  unsigned char checksum[MD5_HASH_LENGTH];
+  u_int32_t sources, sourceBytes;
+} indexHeader;
+
+typedef struct knownIndex {
+  char *filename;
+  unsigned char (*digests)[MD5_HASH_LENGTH];
+  unsigned char checksum[MD5_HASH_LENGTH];
+  unsigned long long count;
+  void *base;
+  size_t length;
+  struct knownIndex *next;
+} knownIndex;
+
+static knownIndex *indexes = NULL;
+
+int modeCheckIndex = FALSE;
+
+
+int isIndexFile(FILE *f) {
+
+  char magic[sizeof(INDEX_MAGIC) - 1];
+
+  rewind(f);
+  if (fread(magic,1,sizeof(magic),f) != sizeof(magic))
+    return FALSE;
+  return !memcmp(magic,INDEX_MAGIC,sizeof(magic));
+}
+
+
+/* Maps the whole index into memory. On Windows we just read it. */
+static void *mapIndex(char *filename, size_t *length) {
+
+  struct stat info;
+  void *base;
+
+#ifdef __UNIX
+  int fd;
+
+  if ((fd = open(filename,O_RDONLY)) < 0)
+    return NULL;
+
+  if (fstat(fd,&info) || info.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  base = mmap(NULL,info.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return NULL;
+
+#ifdef MADV_RANDOM
+  /* Lookups go all over the place. Reading ahead would be a waste. */
+  madvise(base,info.st_size,MADV_RANDOM);
+#endif
+
+#else
+  FILE *f;
+
+  if ((f = fopen(filename,"rb")) == NULL)
+    return NULL;
+
+  if (fstat(fileno(f),&info) || (base = malloc(info.st_size)) == NULL) {
+    fclose(f);
+    return NULL;
+  }
+
+  if (fread(base,1,info.st_size,f) != (size_t)info.st_size) {
+    free(base);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+#endif
+
+  *length = info.st_size;
+  return base;
+}
+
+
+static void unmapIndex(void *base, size_t length) {
+#ifdef __UNIX
+  munmap(base,length);
+#else
+  free(base);
+#endif
+}
+
+
+/* Adds the index in filename to the ones we search */
+int indexLoad(char *filename) {
+
+  knownIndex *x;
+  indexHeader *header;
+  size_t length;
+  void *base;
+
+  if ((base = mapIndex(filename,&length)) == NULL) {
+    printError(filename);
+    return FALSE;
+  }
+
+  header = (indexHeader *)base;
+  if (length < sizeof(indexHeader) ||
+      header->version != INDEX_VERSION ||
+      header->byteOrder != INDEX_BYTE_ORDER ||
+      header->offset % INDEX_ALIGNMENT ||
+      header->offset > length ||
+      (length - header->offset) / MD5_HASH_LENGTH < header->count) {
+    fprintf(stderr,"%s: %s: Invalid or incompatible index\n",
+	    __progname,filename);
+    unmapIndex(base,length);
+    return FALSE;
+  }
+
+  if ((x = (knownIndex *)malloc(sizeof(knownIndex))) == NULL ||
+      (x->filename = strdup(filename)) == NULL) {
+    free(x);
+    unmapIndex(base,length);
+    return FALSE;
+  }
+
+  memcpy(x->checksum,header->checksum,MD5_HASH_LENGTH);
+  x->base    = base;
+  x->length  = length;
+  x->count   = header->count;
+  x->digests = (unsigned char (*)[MD5_HASH_LENGTH])
+    ((unsigned char *)base + header->offset);
+  x->next    = indexes;
+  indexes    = x;
+  return TRUE;
+}
+
+
+/* Checks the digests in every index we've loaded against the checksum
+   in its header. Returns FALSE if any of them don't match. */
+int indexVerify(void) {
+
+  unsigned char sum[MD5_HASH_LENGTH], *p;
+  unsigned long long left;
+  unsigned len;
+  knownIndex *x;
+  MD5_CTX md;
+  int ok = TRUE;
+
+  for (x = indexes ; x != NULL ; x = x->next) {
+
+    /* MD5Update only takes so much at once */
+    MD5Init(&md);
+    p = (unsigned char *)x->digests;
+    for (left = x->count * MD5_HASH_LENGTH ; left > 0 ; left -= len) {
+      len = (left < ONE_MEGABYTE) ? left : ONE_MEGABYTE;
+      MD5Update(&md,p,len);
+      p += len;
+    }
+    MD5Final(sum,&md);
+
+    if (memcmp(sum,x->checksum,MD5_HASH_LENGTH)) {
+      fprintf(stderr,"%s: %s: Index is corrupt\n", __progname,x->filename);
+      ok = FALSE;
+    }
+  }
+
+  return ok;
+}
+
+
+/* The first eight bytes of a digest as a number. Comparing these is
+   the same as comparing the first eight bytes with memcmp. */
+static unsigned long long keyOf(unsigned char *digest) {
+  unsigned long long key = 0;
+  int count;
+  for (count = 0 ; count < 8 ; count++)
+    key = (key << 8) | digest[count];
+  return key;
+}
+
+
+/* The digests are spread evenly over all of the possible values, so
+   we can guess pretty well where one should be. After a few guesses
+   we fall back to a binary search in case the guessing isn't going
+   anywhere. Either way we only touch a handful of pages. */
+static int searchIndex(knownIndex *x, unsigned char *digest) {
+
+  long long low = 0, high = (long long)x->count - 1, middle;
+  unsigned long long key = keyOf(digest), lowKey, highKey;
+  int compare, guesses = 0;
+
+  while (low <= high) {
+
+    lowKey  = keyOf(x->digests[low]);
+    highKey = keyOf(x->digests[high]);
+    if (key < lowKey || key > highKey)
+      return FALSE;
+
+    if (guesses++ < 4 && highKey > lowKey)
+      middle = low + (long long)((long double)(key - lowKey) /
+				 (highKey - lowKey) * (high - low));
+    else
+      middle = low + (high - low) / 2;
+
+    compare = memcmp(x->digests[middle],digest,MD5_HASH_LENGTH);
+    if (compare == 0)
+      return TRUE;
+    if (compare < 0)
+      low = middle + 1;
+    else
+      high = middle - 1;
+  }
+
+  return FALSE;
+}
+
+
+int indexContains(unsigned char *digest) {
+  knownIndex *x;
+  for (x = indexes ; x != NULL ; x = x->next)
+    if (searchIndex(x,digest))
+      return TRUE;
+  return FALSE;
+}
+
+
+int indexLoaded(void) {
+  return indexes != NULL;
+}
+
+
+static int compareDigests(const void *a, const void *b) {
+  return memcmp(a,b,MD5_HASH_LENGTH);
+}
+
+
+/* Writes every hash in knownHashes and in the indexes we've loaded to
+   a new index. Sources are the names of the files they came from. */
+int indexWrite(char *filename, hashTable *knownHashes,
+	       char **sources, int sourceCount) {
+
+  unsigned char (*digests)[MD5_HASH_LENGTH], zero[INDEX_ALIGNMENT];
+  unsigned long long total, count, unique, i;
+  indexHeader header;
+  knownIndex *x;
+  MD5_CTX md;
+  FILE *f;
+  char *temp;
+  int s, ok;
+
+  total = knownHashes->count + (knownHashes->haveZero ? 1 : 0);
+  for (x = indexes ; x != NULL ; x = x->next)
+    total += x->count;
+
+  if ((digests = calloc(total ? total : 1,MD5_HASH_LENGTH)) == NULL) {
+    fprintf(stderr,"%s: Out of memory\n", __progname);
+    return FALSE;
+  }
+
+  count = hashTableExport(knownHashes,digests);
+  for (x = indexes ; x != NULL ; x = x->next) {
+    memcpy(digests[count],x->digests,x->count * MD5_HASH_LENGTH);
+    count += x->count;
+  }
+
+  qsort(digests,count,MD5_HASH_LENGTH,compareDigests);
+
+  /* An index we loaded may have some of the same hashes */
+  for (i = 0, unique = 0 ; i < count ; i++)
+    if (unique == 0 || memcmp(digests[unique - 1],digests[i],MD5_HASH_LENGTH))
+      memcpy(digests[unique++],digests[i],MD5_HASH_LENGTH);
+
+  memset(&header,0,sizeof(header));
+  memset(zero,0,sizeof(zero));
+  memcpy(header.magic,INDEX_MAGIC,sizeof(header.magic));
+  header.version   = INDEX_VERSION;
+  header.byteOrder = INDEX_BYTE_ORDER;
+  header.count     = unique;
+  header.sources   = sourceCount;
+  for (s = 0 ; s < sourceCount ; s++)
+    header.sourceBytes += strlen(sources[s]) + 1;
+  header.offset = sizeof(header) + header.sourceBytes;
+  header.offset = (header.offset + INDEX_ALIGNMENT - 1) /
+    INDEX_ALIGNMENT * INDEX_ALIGNMENT;
+
+  MD5Init(&md);
+  for (i = 0 ; i < unique ; i++)
+    MD5Update(&md,digests[i],MD5_HASH_LENGTH);
+  MD5Final(header.checksum,&md);
+
+  /* Other copies of md5deep may have the old index mapped. If we
+     rewrote it where it is, they'd crash when they touched the part we
+     cut off. Instead we write a new file next to it and swap it in,
+     which leaves them with the old one until they're done with it. */
+  if ((temp = (char *)malloc(strlen(filename) + 5)) == NULL) {
+    fprintf(stderr,"%s: Out of memory\n", __progname);
+    free(digests);
+    return FALSE;
+  }
+  sprintf(temp,"%s.new",filename);
+
+  if ((f = fopen(temp,"wb")) == NULL) {
+    printError(temp);
+    free(digests);
+    free(temp);
+    return FALSE;
+  }
+
+  fwrite(&header,sizeof(header),1,f);
+  for (s = 0 ; s < sourceCount ; s++)
+    fwrite(sources[s],strlen(sources[s]) + 1,1,f);
+  fwrite(zero,header.offset - sizeof(header) - header.sourceBytes,1,f);
+  fwrite(digests,MD5_HASH_LENGTH,unique,f);
+  free(digests);
+
+  /* The new index has to be on the disk before it takes the old one's
+     name, or a crash could leave us with neither */
+  ok = (fflush(f) == 0 && !ferror(f));
+#ifdef __UNIX
+  ok = ok && fsync(fileno(f)) == 0;
+#endif
+  ok = (fclose(f) == 0) && ok;
+
+#ifdef __WIN32
+  /* Windows won't rename over a file that's there */
+  if (ok)
+    unlink(filename);
+#endif
+
+  if (!ok || rename(temp,filename)) {
+    printError(temp);
+    unlink(temp);
+    free(temp);
+    return FALSE;
+  }
+  free(temp);
+
+  if (!modeSilent)
+    fprintf(stderr,"%s: Wrote %llu hashes to %s\n",
+	    __progname,unique,filename);
+  return TRUE;
+}
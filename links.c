@@ -0,0 +1,203 @@
+/* MD5DEEP - links.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* Hard links. Backup trees made with rsnapshot and the like are mostly
+   hard links to the same few files, and there's no sense reading the
+   same inode over and over again. When we hash a file that has more
+   than one link, we remember its device, inode and hash. When we come
+   to another link to it, we print the hash we remembered.
+
+   We also remember how many links we haven't seen yet. When we've seen
+   them all, the entry is thrown away, so on a tree that holds all of
+   the links to its files the table only ever holds the files we're in
+   the middle of. For trees that don't, there's a limit on the size of
+   the table. Once it's full, we stop adding to it, and the files we
+   couldn't fit in just get hashed again.
+
+   The hashing threads all share the table, so it has a lock. */
+
+#ifdef __UNIX
+
+#include <pthread.h>
+
+#define LINK_MIN_SIZE      1024
+
+/* At 40 bytes each, this is about 160MB when the table is full */
+#define LINK_MAX_ENTRIES   (4UL * 1024 * 1024)
+
+typedef struct linkEntry {
+  unsigned long long dev, ino;
+  unsigned char digest[MD5_HASH_LENGTH];
+  unsigned long remaining;
+} linkEntry;
+
+static linkEntry *links = NULL;
+static unsigned long linkSize = 0, linkCount = 0;
+static pthread_mutex_t linkLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long linkHits = 0;
+
+
+static unsigned long linkKey(unsigned long long dev, unsigned long long ino) {
+  unsigned long long key = ((dev * 0x9e3779b97f4a7c15ULL) ^ ino) *
+    0xff51afd7ed558ccdULL;
+  return (unsigned long)(key ^ (key >> 32)) & (linkSize - 1);
+}
+
+
+/* Returns the slot for dev and ino, which is empty if they aren't in
+   the table. An inode number is never zero. */
+static unsigned long findLink(unsigned long long dev, unsigned long long ino) {
+
+  unsigned long key = linkKey(dev,ino);
+
+  while (links[key].ino != 0 &&
+	 (links[key].dev != dev || links[key].ino != ino))
+    key = (key + 1) & (linkSize - 1);
+
+  return key;
+}
+
+
+/* Empties slot and moves up any entries after it that would no longer
+   be found with it empty */
+static void removeLink(unsigned long slot) {
+
+  unsigned long next = slot, home;
+
+  for (;;) {
+    links[slot].ino = 0;
+
+    for (;;) {
+      next = (next + 1) & (linkSize - 1);
+      if (links[next].ino == 0)
+	return;
+
+      /* The entry at next can move to slot if slot is between where
+	 it wants to be and where it is now */
+      home = linkKey(links[next].dev,links[next].ino);
+      if (((next - home) & (linkSize - 1)) >= ((next - slot) & (linkSize - 1)))
+	break;
+    }
+
+    links[slot] = links[next];
+    slot = next;
+  }
+}
+
+
+static int growLinks(void) {
+
+  linkEntry *old = links;
+  unsigned long oldSize = linkSize, count;
+
+  linkSize = linkSize ? linkSize * 2 : LINK_MIN_SIZE;
+  if ((links = (linkEntry *)calloc(linkSize,sizeof(linkEntry))) == NULL) {
+    links = old;
+    linkSize = oldSize;
+    return FALSE;
+  }
+
+  for (count = 0 ; count < oldSize ; count++)
+    if (old[count].ino != 0)
+      links[findLink(old[count].dev,old[count].ino)] = old[count];
+
+  free(old);
+  return TRUE;
+}
+
+
+/* If the file described by info is another link to one we've already
+   hashed, puts its hash in result and returns TRUE */
+int linkLookup(struct stat *info, char *result) {
+
+  unsigned long slot;
+  int found = FALSE;
+
+  if (info->st_nlink < 2)
+    return FALSE;
+
+  pthread_mutex_lock(&linkLock);
+
+  if (linkCount > 0) {
+    slot = findLink(info->st_dev,info->st_ino);
+    if (links[slot].ino != 0) {
+      formatDigest(links[slot].digest,result);
+      found = TRUE;
+      linkHits++;
+
+      if (--links[slot].remaining == 0) {
+	removeLink(slot);
+	linkCount--;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&linkLock);
+  return found;
+}
+
+
+/* Remembers the hash of the file described by info, which we just
+   hashed, if it has other links */
+void linkStore(struct stat *info, char *result) {
+
+  unsigned char digest[MD5_HASH_LENGTH];
+  unsigned long slot;
+
+  if (info->st_nlink < 2 || !scanHexDigest(result,digest))
+    return;
+
+  pthread_mutex_lock(&linkLock);
+
+  if (linkCount < LINK_MAX_ENTRIES &&
+      ((linkCount + 1) * 2 <= linkSize || growLinks())) {
+
+    slot = findLink(info->st_dev,info->st_ino);
+
+    /* Two links to the same file may have been hashed at once */
+    if (links[slot].ino == 0) {
+      links[slot].dev = info->st_dev;
+      links[slot].ino = info->st_ino;
+      links[slot].remaining = info->st_nlink - 1;
+      memcpy(links[slot].digest,digest,MD5_HASH_LENGTH);
+      linkCount++;
+    }
+  }
+
+  pthread_mutex_unlock(&linkLock);
+}
+
+
+void printLinkStats(void) {
+  fprintf(stderr,"%s: %lu files were hard links to files already hashed\n",
+	  __progname,linkHits);
+}
+
+#else
+
+/* Windows doesn't give us anything to tell hard links apart with */
+
+int linkLookup(struct stat *info, char *result) {
+  return FALSE;
+}
+
+void linkStore(struct stat *info, char *result) {
+}
+
+void printLinkStats(void) {
+}
+
+#endif /* ifdef __UNIX */
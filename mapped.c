@@ -0,0 +1,229 @@
+/* MD5DEEP - mapped.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* Memory mapped reading (-M). Instead of reading a regular file into
+   our buffer, we map it and hand the hashing code pointers straight
+   into the page cache. We never map more than one window of the file at
+   a time so that huge files don't eat all of our address space. The
+   window is always a multiple of the block size, so the hashing code
+   still gets whole blocks until the end of the file.
+
+   If somebody truncates a file while we have it mapped, touching the
+   pages past the new end of the file gets us a SIGBUS. Our handler
+   looks for the reader that owns the faulting address, maps zeros over
+   the rest of its window so the hashing code can carry on, and marks
+   the reader as failed. The error gets reported the next time anybody
+   asks the reader for anything. Signal handlers run in the thread that
+   faulted, so each thread keeps its own list of readers. */
+
+#ifdef __UNIX
+
+#include <signal.h>
+#include <sys/mman.h>
+
+#define MAP_WINDOW        (64 * ONE_MEGABYTE)
+/* Each thread has at most one reader per multi-buffer lane */
+#define MAX_MAPPED_READERS   32
+
+int modeMmap = FALSE;
+
+static __thread fileReader *threadReaders[MAX_MAPPED_READERS];
+static bool handlerInstalled = FALSE;
+
+
+static void busHandler(int sig, siginfo_t *info, void *context) {
+
+  unsigned char *addr = (unsigned char *)info->si_addr, *page;
+  fileReader *r;
+  int i;
+
+  for (i = 0 ; i < MAX_MAPPED_READERS ; i++) {
+
+    r = threadReaders[i];
+    if (r == NULL || r->map == NULL ||
+	addr < r->map || addr >= r->map + r->mapLen)
+      continue;
+
+    page = r->map + ((addr - r->map) / r->pageSize) * r->pageSize;
+    mmap(page,r->map + r->mapLen - page,PROT_READ,
+	 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,-1,0);
+    r->faulted = TRUE;
+    return;
+  }
+
+  /* This wasn't one of ours. Let it crash the way it would have. */
+  signal(SIGBUS,SIG_DFL);
+}
+
+
+static unsigned long gcd(unsigned long a, unsigned long b) {
+  unsigned long t;
+  while (b) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+
+/* Called from readerInit in the thread that will use the reader */
+void mappedRegister(fileReader *r) {
+
+  struct sigaction sa;
+  unsigned long per;
+  int i;
+
+  /* The first reader is set up by main before any threads start */
+  if (!handlerInstalled) {
+    memset(&sa,0,sizeof(sa));
+    sa.sa_sigaction = busHandler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS,&sa,NULL);
+    handlerInstalled = TRUE;
+  }
+
+  /* The window has to be a multiple of both the page size, so we can
+     map at its offset, and the block size. */
+  r->pageSize = sysconf(_SC_PAGESIZE);
+  per = r->pageSize / gcd(r->size,r->pageSize);
+  r->window = (MAP_WINDOW / (r->size * per)) * r->size * per;
+  if (r->window == 0)
+    r->window = r->size * per;
+
+  for (i = 0 ; i < MAX_MAPPED_READERS ; i++) {
+    if (threadReaders[i] == NULL) {
+      threadReaders[i] = r;
+      return;
+    }
+  }
+}
+
+
+void mappedUnregister(fileReader *r) {
+  int i;
+  for (i = 0 ; i < MAX_MAPPED_READERS ; i++)
+    if (threadReaders[i] == r)
+      threadReaders[i] = NULL;
+}
+
+
+static void unmapWindow(fileReader *r) {
+  if (r->map != NULL)
+    munmap(r->map,r->mapLen);
+  r->map = NULL;
+  r->mapLen = 0;
+}
+
+
+/* Decides whether to map the file that was just opened. We only map
+   regular files that have something in them. If the user asked us to
+   stay out of the file cache, we don't map anything. */
+int mappedOpen(fileReader *r) {
+
+  struct stat info;
+
+  r->mapped = FALSE;
+  r->faulted = FALSE;
+  r->reported = FALSE;
+  r->map = NULL;
+  r->mapLen = 0;
+
+  if (modeDirect)
+    return FALSE;
+
+  if (fstat(r->fd,&info) || !S_ISREG(info.st_mode) || info.st_size == 0)
+    return FALSE;
+
+  r->fileSize = info.st_size;
+  r->mapStart = 0;
+  r->mapped = TRUE;
+  return TRUE;
+}
+
+
+void mappedClose(fileReader *r) {
+  unmapWindow(r);
+  r->mapped = FALSE;
+}
+
+
+/* If the file was truncated out from under us, reports it and returns
+   TRUE. Anything we hashed after that point was made up. */
+int mappedFailed(fileReader *r) {
+
+  if (!r->faulted)
+    return FALSE;
+
+  if (!r->reported) {
+    errno = EIO;
+    printError(r->filename);
+    r->reported = TRUE;
+  }
+  return TRUE;
+}
+
+
+/* Works just like readerNext, but hands out pointers into the mapping */
+long mappedNext(fileReader *r, unsigned char **data) {
+
+  unsigned long long remaining;
+  long len;
+
+  /* The caller will report the error */
+  if (r->faulted) {
+    r->reported = TRUE;
+    errno = EIO;
+    return -1;
+  }
+
+  if (r->offset >= r->fileSize)
+    return 0;
+
+  /* Move on to the next window */
+  if (r->map == NULL || r->offset >= r->mapStart + r->mapLen) {
+
+    unmapWindow(r);
+    r->mapStart = r->offset;
+    remaining = r->fileSize - r->mapStart;
+    r->mapLen = remaining < r->window ? remaining : r->window;
+
+    r->map = mmap(NULL,r->mapLen,PROT_READ,MAP_SHARED,r->fd,r->mapStart);
+    if (r->map == MAP_FAILED) {
+      r->map = NULL;
+      r->mapLen = 0;
+      return -1;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(r->map,r->mapLen,MADV_SEQUENTIAL);
+#endif
+
+#ifdef POSIX_FADV_WILLNEED
+    /* Get the kernel started on the window after this one */
+    posix_fadvise(r->fd,r->mapStart + r->mapLen,r->window,
+		  POSIX_FADV_WILLNEED);
+#endif
+  }
+
+  *data = r->map + (r->offset - r->mapStart);
+  remaining = r->mapStart + r->mapLen - r->offset;
+  len = remaining < r->size ? remaining : r->size;
+
+  return len;
+}
+
+#endif /* ifdef __UNIX */
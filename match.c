@@ -16,67 +16,619 @@
 #include "md5deep.h"
 #include "hashTable.h"
 
-hashTable knownHashes;
+/* The known hashes. There's a table for each kind of hash, so that the
+   MD5 of a file is only ever compared with known MD5 hashes, and the
+   same for SHA-1 and SHA-256. A table holds 128 bits of every hash,
+   which for SHA-1 and SHA-256 hashes is the first 128 bits. */
+#define KIND_MD5      0
+#define KIND_SHA1     1
+#define KIND_SHA256   2
+#define HASH_KINDS    3
+
+hashTable knownHashes[HASH_KINDS];
 bool tableInitialized = FALSE;
 
-int loadMatchFile(char *filename) {
+/* The filters in front of knownHashes, and how often they saved us
+   from looking in a table. The hashing threads all count at once. */
+static bloomFilter filter[HASH_KINDS];
+double filterRate = 0.01;
+static unsigned long lookups = 0, filtered = 0;
 
-  unsigned long lineNumber = 0;
-  char buf[MAX_STRING_LENGTH + 1];
+#ifdef __GNUC__
+#define COUNT(x)   __sync_fetch_and_add(&(x),1)
+#else
+#define COUNT(x)   (x)++
+#endif
+
+/* The sizes of the known files. NSRL, Hashkeeper and iLook files give
+   the size of every file along with its hash, and a file can't match
+   unless some known file has the same size. Most files on a disk have
+   a size that isn't in the set, and we don't have to read those at all.
+   If even one known hash came without a size, we can't rule anything
+   out and we don't use the sizes. */
+typedef struct sizeList {
+  unsigned long long *size;
+  unsigned long count, allocated;
+  bool incomplete;
+} sizeList;
+
+static sizeList knownSizes;
+static bool useSizes = FALSE;
+static unsigned long sizeSkipped = 0;
+
+/* The names of all of the files we've loaded, for -I */
+static char **sources = NULL;
+static int sourceCount = 0;
+
+/* Adds digest to table */
+static void addKnownHash(hashTable *table, unsigned char *digest) {
+  if (!hashTableAdd(table,digest)) {
+    fprintf(stderr,"%s: Out of memory\n", __progname);
+    exit (1);
+  }
+}
+
+
+static int compareSizes(const void *a, const void *b) {
+  unsigned long long x = *(unsigned long long *)a, y = *(unsigned long long *)b;
+  return (x > y) - (x < y);
+}
+
+
+/* Sorts the sizes in list and throws away the duplicates */
+static void sortSizes(sizeList *list) {
+
+  unsigned long i, n = 0;
+
+  qsort(list->size,list->count,sizeof(unsigned long long),compareSizes);
+  for (i = 0 ; i < list->count ; i++)
+    if (n == 0 || list->size[i] != list->size[n - 1])
+      list->size[n++] = list->size[i];
+  list->count = n;
+}
+
+
+/* There are far fewer sizes than files, so when the list fills up we
+   throw away the duplicates before we think about making it bigger */
+static void addSize(sizeList *list, unsigned long long size) {
+
+  if (list->incomplete)
+    return;
+
+  if (list->count == list->allocated) {
+    sortSizes(list);
+    if (list->count * 2 >= list->allocated) {
+      list->allocated = list->allocated ? list->allocated * 2 : 1024;
+      list->size = (unsigned long long *)
+	realloc(list->size,list->allocated * sizeof(unsigned long long));
+      if (list->size == NULL) {
+	fprintf(stderr,"%s: Out of memory\n", __progname);
+	exit (1);
+      }
+    }
+  }
+
+  list->size[list->count++] = size;
+}
+
+
+static void noSizes(sizeList *list) {
+  list->incomplete = TRUE;
+  free(list->size);
+  list->size = NULL;
+  list->count = list->allocated = 0;
+}
+
+
+/* Adds the sizes in from to list and frees from */
+static void mergeSizes(sizeList *list, sizeList *from) {
+
+  unsigned long i;
+
+  if (from->incomplete)
+    noSizes(list);
+  for (i = 0 ; i < from->count ; i++)
+    addSize(list,from->size[i]);
+  noSizes(from);
+}
+
+
+/* Tells what kind of hash starts at h from how many hex digits it has.
+   Anything that isn't as long as a SHA-1 or SHA-256 hash is an MD5. */
+static int hashKind(char *h, char *end) {
+
+  char *p = h;
+
+  while (p < end && isxdigit(*p))
+    p++;
+
+  if (p - h == 2 * SHA1_HASH_LENGTH)
+    return KIND_SHA1;
+  if (p - h == 2 * SHA256_HASH_LENGTH)
+    return KIND_SHA256;
+  return KIND_MD5;
+}
+
+
+/* Returns the table in tables for the first hash on a line. Plain
+   files can start with any kind of hash, but the others only have MD5
+   hashes where findDigestinLine looks. */
+static hashTable *lineTable(hashTable *tables, char *line, char *end,
+			    int fileType) {
+  return &tables[fileType == TYPE_PLAIN ? hashKind(line,end) : KIND_MD5];
+}
+
+
+/* Finds the hash in one line of a hash file and adds it to the table
+   in tables for its kind, and its size to sizes. The line is len
+   characters long. Returns FALSE if the line is improperly formatted. */
+static int parseHashLine(hashTable *tables, sizeList *sizes, char *line,
+			 size_t len, int fileType) {
+
+  unsigned char digest[MD5_HASH_LENGTH];
+  unsigned long long size;
+  char *end = line + len;
+  int n;
+
+  if (!findDigestinLine(line,len,fileType,digest))
+    return FALSE;
+  addKnownHash(lineTable(tables,line,end,fileType),digest);
+
+  if (!sizes->incomplete) {
+    if (findSizeinLine(line,len,fileType,&size))
+      addSize(sizes,size);
+    else
+      noSizes(sizes);
+  }
+
+  /* Output from tree mode (-T) has the tree hash in a second column,
+     and output from -c can have a hash in each of several columns.
+     We know about those hashes too. */
+  if (fileType == TYPE_PLAIN)
+    while ((n = plainHashLength(line,end)) > 0) {
+      line += n + 2;
+      if (plainHashLength(line,end) > 0 && scanHexDigest(line,digest))
+	addKnownHash(&tables[hashKind(line,end)],digest);
+    }
+
+  /* The NSRL has the SHA-1 of every file in the first column */
+  if (fileType == TYPE_NSRL && len > 2 * SHA1_HASH_LENGTH + 1 &&
+      line[0] == '"' && scanHexDigest(line + 1,digest))
+    addKnownHash(&tables[KIND_SHA1],digest);
+
+  return TRUE;
+}
+
+
+/* Blank lines don't count as improperly formatted */
+static int isBlankLine(char *buf, size_t len) {
+  while (len > 0 && isspace(buf[len - 1]))
+    len--;
+  return len == 0;
+}
+
+
+/* We report the first few bad lines in each part of a hash file and
+   just count the rest */
+#define MAX_BAD_LINES   10
+
+static void reportBadLine(char *filename, unsigned long lineNumber,
+			  char *line, size_t len) {
+  if (modeSilent)
+    return;
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    len--;
+  fprintf(stderr,"%s: %s: Improperly formatted line %lu. Skipped.\n",
+	  __progname,filename,lineNumber);
+  fprintf(stderr,"The offending line was:\n%.*s\n",
+	  (int)(len > MAX_STRING_LENGTH ? MAX_STRING_LENGTH : len),line);
+}
+
+
+static void reportBadTotal(char *filename, unsigned long bad) {
+  if (bad > MAX_BAD_LINES && !modeSilent)
+    fprintf(stderr,"%s: %s: Skipped %lu improperly formatted lines\n",
+	    __progname,filename,bad);
+}
+
+
+#ifdef __UNIX
+
+/* On *nix we map the hash file and split it at line boundaries into
+   one chunk per processor. Each chunk is parsed by its own thread into
+   its own tables, which are merged into knownHashes at the end. Apart
+   from the tables the threads don't share anything, so there is
+   no locking. The lines are parsed right where they are in the map. */
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Files smaller than this per thread aren't worth splitting */
+#define MIN_CHUNK_SIZE   ONE_MEGABYTE
+
+typedef struct loadChunk {
+  char *start, *end;
   int fileType;
-  FILE *f;
+  hashTable table[HASH_KINDS];
+  sizeList sizes;
+  unsigned long lines, bad;
+  unsigned long badNumber[MAX_BAD_LINES];
+  char *badLine[MAX_BAD_LINES];
+  size_t badLength[MAX_BAD_LINES];
+  pthread_t thread;
+} loadChunk;
 
-  /* We only need to initialize the table the first time through here.
-     Otherwise, we'd erase all of the previous entries! */
-  if (!tableInitialized) {
-    hashTableInit(&knownHashes);
-    tableInitialized = TRUE;
+
+static void *loadChunkThread(void *arg) {
+
+  loadChunk *c = (loadChunk *)arg;
+  char *p = c->start, *eol;
+  size_t len;
+  int k;
+
+  for (k = 0 ; k < HASH_KINDS ; k++)
+    hashTableInit(&c->table[k]);
+
+  /* See loadSerial for why we do this */
+  if (p < c->end && (eol = (char *)memchr(p,'\n',c->end - p)) != NULL)
+    hashTableReserve(lineTable(c->table,p,eol,c->fileType),
+		     (c->end - c->start) / (eol - p + 1));
+
+  while (p < c->end) {
+
+    if ((eol = (char *)memchr(p,'\n',c->end - p)) == NULL)
+      eol = c->end;
+    else
+      eol++;
+    len = eol - p;
+    c->lines++;
+
+    if (!parseHashLine(c->table,&c->sizes,p,len,c->fileType) &&
+	!isBlankLine(p,len)) {
+      if (c->bad < MAX_BAD_LINES) {
+	c->badNumber[c->bad] = c->lines;
+	c->badLine[c->bad]   = p;
+	c->badLength[c->bad] = len;
+      }
+      c->bad++;
+    }
+
+    p = eol;
   }
 
-  if ((f = fopen(filename,"r")) == NULL) {
-    printError(filename);
+  return NULL;
+}
+
+
+/* Returns TRUE if we loaded the file, FALSE on an error, and -1 if
+   it couldn't be mapped, in which case the caller reads it instead */
+static int loadMapped(char *filename, FILE *f) {
+
+  loadChunk *chunks;
+  struct stat info;
+  char *data, *p, *end, buf[MAX_STRING_LENGTH + 1];
+  unsigned long lineNumber = 0, bad = 0;
+  long n, i, j, cpus;
+  size_t len;
+  int fileType, k;
+
+  if (fstat(fileno(f),&info) || info.st_size == 0)
+    return -1;
+
+  data = mmap(NULL,info.st_size,PROT_READ,MAP_PRIVATE,fileno(f),0);
+  if (data == MAP_FAILED)
+    return -1;
+  end = data + info.st_size;
+
+#ifdef MADV_SEQUENTIAL
+  madvise(data,info.st_size,MADV_SEQUENTIAL);
+#endif
+
+  len = info.st_size < MAX_STRING_LENGTH ? info.st_size : MAX_STRING_LENGTH;
+  memcpy(buf,data,len);
+  buf[len] = 0;
+  fileType = determineLineType(buf);
+
+  if (fileType == TYPE_UNKNOWN) {
+    fprintf(stderr,"%s: %s: Unknown type of hash file\n",
+	    __progname,filename);
+    munmap(data,info.st_size);
+    return FALSE;
+  }
+
+  /* We skip the first line in every file type except plain files.
+     All other file types have a header line that we need to ignore. */
+  p = data;
+  if (fileType != TYPE_PLAIN) {
+    if ((p = (char *)memchr(data,'\n',info.st_size)) == NULL)
+      p = end;
+    else
+      p++;
+    lineNumber++;
+  }
+
+  if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    cpus = 1;
+  n = (end - p) / MIN_CHUNK_SIZE + 1;
+  if (n > cpus)
+    n = cpus;
+
+  if ((chunks = (loadChunk *)calloc(n,sizeof(loadChunk))) == NULL) {
+    munmap(data,info.st_size);
+    return -1;
+  }
+
+  /* Each chunk ends just after a newline, so no line is split. If a
+     line is longer than a whole chunk, the next chunk may be empty. */
+  for (i = 0 ; i < n ; i++) {
+    chunks[i].fileType = fileType;
+    chunks[i].start = i ? chunks[i - 1].end : p;
+    chunks[i].end = p + (end - p) / n * (i + 1);
+    if (i == n - 1 || chunks[i].end < chunks[i].start)
+      chunks[i].end = (i == n - 1) ? end : chunks[i].start;
+    while (chunks[i].end < end && chunks[i].end[-1] != '\n')
+      chunks[i].end++;
+  }
+
+  /* If we can't start a thread, we do its chunk ourselves */
+  for (i = 1 ; i < n ; i++)
+    if (pthread_create(&chunks[i].thread,NULL,loadChunkThread,&chunks[i]))
+      chunks[i].thread = 0;
+  loadChunkThread(&chunks[0]);
+
+  for (i = 0 ; i < n ; i++) {
+
+    if (i > 0) {
+      if (chunks[i].thread)
+	pthread_join(chunks[i].thread,NULL);
+      else
+	loadChunkThread(&chunks[i]);
+    }
+
+    for (j = 0 ; j < chunks[i].bad && j < MAX_BAD_LINES ; j++)
+      reportBadLine(filename,lineNumber + chunks[i].badNumber[j],
+		    chunks[i].badLine[j],chunks[i].badLength[j]);
+    lineNumber += chunks[i].lines;
+    bad += chunks[i].bad;
+
+    for (k = 0 ; k < HASH_KINDS ; k++) {
+      if (!hashTableMerge(&knownHashes[k],&chunks[i].table[k])) {
+	fprintf(stderr,"%s: Out of memory\n", __progname);
+	exit (1);
+      }
+      hashTableFree(&chunks[i].table[k]);
+    }
+    mergeSizes(&knownSizes,&chunks[i].sizes);
+  }
+
+  reportBadTotal(filename,bad);
+  free(chunks);
+  munmap(data,info.st_size);
+  return TRUE;
+}
+
+#endif /* ifdef __UNIX */
+
+
+/* Reads the hash file one line at a time */
+static int loadSerial(char *filename, FILE *f) {
+
+  unsigned long lineNumber = 0, bad = 0;
+  char buf[MAX_STRING_LENGTH + 1];
+  int fileType, c;
+  bool reserved = FALSE, tooLong, more;
+  struct stat info;
+  size_t len;
+
+  /* We can't go back to the start of a pipe, so we hang on to the first
+     line once we've used it to work out the type of file */
+  rewind(f);
+  if (fgets(buf,MAX_STRING_LENGTH,f) == NULL)
+    return TRUE;
+  fileType = determineLineType(buf);
+
+  if (fileType == TYPE_UNKNOWN) {
+    fprintf(stderr,"%s: %s: Unknown type of hash file\n",
+	    __progname,filename);
     return FALSE;
   }
 
-  fileType = determineFileType(f);
-  
   /* We skip the first line in every file type except plain files. 
      All other file types have a header line that we need to ignore. */
-  if (fileType != TYPE_PLAIN) 
+  more = TRUE;
+  if (fileType != TYPE_PLAIN) {
     lineNumber++;
-  else 
-    rewind(f);
+    more = (fgets(buf,MAX_STRING_LENGTH,f) != NULL);
+  }
   
-  while (fgets(buf,MAX_STRING_LENGTH,f)) {
+  for ( ; more ; more = (fgets(buf,MAX_STRING_LENGTH,f) != NULL)) {
 
     lineNumber++;
+    len = strlen(buf);
 
-    if (findHashValueinLine(buf,fileType) != TRUE) {
+    /* Rather than growing the table over and over again for a big
+       set of hashes, we guess how many there are from the size of the
+       file and the length of the first line. If we guess low, the
+       table grows on its own. */
+    if (!reserved) {
+      if (!fstat(fileno(f),&info) && len > 0)
+	hashTableReserve(lineTable(knownHashes,buf,buf + len,fileType),
+			 info.st_size / len);
+      reserved = TRUE;
+    }
+
+    /* If the line didn't fit, throw away the rest of it */
+    tooLong = (len == MAX_STRING_LENGTH - 1 && buf[len - 1] != '\n');
+    if (tooLong)
+      while ((c = fgetc(f)) != EOF && c != '\n')
+	;
+
+    if ((tooLong || !parseHashLine(knownHashes,&knownSizes,buf,len,fileType)) &&
+	!isBlankLine(buf,len)) {
+      if (bad++ < MAX_BAD_LINES)
+	reportBadLine(filename,lineNumber,buf,len);
+    }
+  }
+
+  reportBadTotal(filename,bad);
+  return TRUE;
+}
 
-      fprintf(stderr,"%s: %s: Improperly formatted file at line %ld\n",
-	      __progname,filename,lineNumber);
-      fprintf(stderr,"The offending line was:\n%s\n", buf);
-      return FALSE;
 
-    } else {
+int loadMatchFile(char *filename) {
 
-      hashTableAdd(&knownHashes,buf);
+  int status = -1, k;
+  struct stat info;
+  FILE *f;
 
-    }
+  /* We only need to initialize the tables the first time through here.
+     Otherwise, we'd erase all of the previous entries! */
+  if (!tableInitialized) {
+    for (k = 0 ; k < HASH_KINDS ; k++)
+      hashTableInit(&knownHashes[k]);
+    tableInitialized = TRUE;
   }
 
+  if ((f = fopen(filename,"r")) == NULL) {
+    printError(filename);
+    return FALSE;
+  }
+
+  sources = (char **)realloc(sources,(sourceCount + 1) * sizeof(char *));
+  if (sources != NULL)
+    sources[sourceCount++] = filename;
+
+  /* Indexes made with -I get searched where they lie. Only a regular
+     file can be one. Looking for the magic in a pipe would eat the
+     start of it, since there's no going back. */
+  if (!fstat(fileno(f),&info) && S_ISREG(info.st_mode) && isIndexFile(f)) {
+    fclose(f);
+    noSizes(&knownSizes);
+    return indexLoad(filename);
+  }
+
+#ifdef __UNIX
+  status = loadMapped(filename,f);
+#endif
+  if (status < 0)
+    status = loadSerial(filename,f);
+
   fclose(f);
 
 #ifdef __DEBUG
-  hashTableEvaluate(&knownHashes);
+  for (k = 0 ; k < HASH_KINDS ; k++)
+    hashTableEvaluate(&knownHashes[k]);
 #endif
 
-  return TRUE;
+  return status;
+}
+
+
+
+/* Called once all of the known hashes have been loaded. We need to
+   know how many there are to size the filters. If we can't get the
+   memory for one, we just look everything up in its table. */
+void buildMatchFilter(void) {
+
+  int k;
+
+  for (k = 0 ; k < HASH_KINDS ; k++)
+    filter[k].count = 0;
+  if (!tableInitialized)
+    return;
+
+  if (!knownSizes.incomplete && knownSizes.count > 0) {
+    sortSizes(&knownSizes);
+    useSizes = TRUE;
+  }
+
+  for (k = 0 ; k < HASH_KINDS ; k++)
+    if (knownHashes[k].count > 0 &&
+	bloomInit(&filter[k],knownHashes[k].count + 1,filterRate))
+      hashTableFilter(&knownHashes[k],&filter[k]);
 }
 
 
+static int isKnownDigest(char *h) {
+
+  unsigned char digest[MD5_HASH_LENGTH];
+  int kind;
+
+  if (!hashTableDecode(h,digest))
+    return FALSE;
+  kind = hashKind(h,h + strlen(h));
+
+  COUNT(lookups);
+
+  if (!bloomMaybe(&filter[kind],digest))
+    COUNT(filtered);
+  else if (hashTableContains(&knownHashes[kind],digest))
+    return TRUE;
+
+  /* Indexes only have MD5 hashes */
+  return (kind == KIND_MD5 && indexContains(digest));
+}
+
 
+/* h is the result for a file, which has one hash for each digest in
+   the set (-c) separated by two spaces. The file is known if any of
+   them are. */
 int isKnownHash(char *h) {
-  return (hashTableContains(&knownHashes,h));
+
+  for (;;) {
+    if (isKnownDigest(h))
+      return TRUE;
+    if ((h = strstr(h,"  ")) == NULL)
+      return FALSE;
+    h += 2;
+  }
+}
+
+
+/* Returns FALSE if no known file is size bytes long, in which case a
+   file of that size can't match and we don't have to read it */
+int isKnownSize(unsigned long long size) {
+
+  if (!useSizes)
+    return TRUE;
+
+  if (bsearch(&size,knownSizes.size,knownSizes.count,
+	      sizeof(unsigned long long),compareSizes) != NULL)
+    return TRUE;
+
+  COUNT(sizeSkipped);
+  return FALSE;
+}
+
+
+/* Returns TRUE if isKnownSize can rule out any files at all */
+int sizesLoaded(void) {
+  return useSizes;
+}
+
+
+void printMatchStats(void) {
+  fprintf(stderr,"%s: %lu known hash lookups, %lu ruled out by the filter\n",
+	  __progname,lookups,filtered);
+  if (useSizes)
+    fprintf(stderr,"%s: %lu different known file sizes, %lu files skipped "
+	    "because of their size\n",__progname,knownSizes.count,sizeSkipped);
 }
 
+
+/* Writes all of the known hashes we've loaded to an index */
+int buildMatchIndex(char *filename) {
+
+  if (!tableInitialized) {
+    fprintf(stderr,"%s: No known hashes to put in the index. Use -m.\n",
+	    __progname);
+    return FALSE;
+  }
+
+  if ((knownHashes[KIND_SHA1].count || knownHashes[KIND_SHA256].count) &&
+      !modeSilent)
+    fprintf(stderr,"%s: Only MD5 hashes go in an index. The SHA-1 and "
+	    "SHA-256 hashes were left out.\n", __progname);
+
+  return indexWrite(filename,&knownHashes[KIND_MD5],sources,sourceCount);
+}
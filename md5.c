@@ -32,27 +32,34 @@
 #include <string.h>		/* for memcpy() */
 #include "md5deep.h"
 
-#ifndef HIGHFIRST
-#define byteReverse(buf, len)	/* Nothing */
-#else
-void byteReverse(unsigned char *buf, unsigned longs);
-
-#ifndef ASM_MD5
 /*
- * Note: this code is harmless on little-endian machines.
+ * The transform reads its message words straight out of the caller's
+ * buffer, so there's no need to copy whole blocks into ctx->in first.
+ * GETLE32 loads a little-endian word from a possibly unaligned address.
+ * On little-endian hosts that is a plain load, which memcpy lets the
+ * compiler do without any alignment worries. Everywhere else (and on
+ * any host where we can't tell the byte order) we build the word a byte
+ * at a time, which is correct no matter what the byte order is.
  */
-void byteReverse(unsigned char *buf, unsigned longs)
+#ifndef HIGHFIRST
+static u_int32_t getLE32(unsigned char const *p)
 {
     u_int32_t t;
-    do {
-	t = (u_int32_t) ((unsigned) buf[3] << 8 | buf[2]) << 16 |
-	    ((unsigned) buf[1] << 8 | buf[0]);
-	*(u_int32_t *) buf = t;
-	buf += 4;
-    } while (--longs);
+    memcpy(&t, p, 4);
+    return t;
 }
+#define GETLE32(p)	getLE32(p)
+#else
+#define GETLE32(p) \
+	((u_int32_t) ((unsigned) (p)[3] << 8 | (p)[2]) << 16 | \
+	 ((unsigned) (p)[1] << 8 | (p)[0]))
 #endif
-#endif
+
+#define PUTLE32(p, v) \
+	( (p)[0] = (unsigned char) (v),  \
+	  (p)[1] = (unsigned char) ((v) >> 8),  \
+	  (p)[2] = (unsigned char) ((v) >> 16), \
+	  (p)[3] = (unsigned char) ((v) >> 24) )
 
 /*
  * Start MD5 accumulation.  Set bit count to 0 and buffer to mysterious
@@ -97,19 +104,17 @@ void MD5Update(struct MD5Context *ctx, unsigned char const *buf, unsigned len)
 	    return;
 	}
 	memcpy(p, buf, t);
-	byteReverse(ctx->in, 16);
-	MD5Transform(ctx->buf, (u_int32_t *) ctx->in);
+	MD5TransformBlocks(ctx->buf, ctx->in, 1);
 	buf += t;
 	len -= t;
     }
-    /* Process data in 64-byte chunks */
-
-    while (len >= 64) {
-	memcpy(ctx->in, buf, 64);
-	byteReverse(ctx->in, 16);
-	MD5Transform(ctx->buf, (u_int32_t *) ctx->in);
-	buf += 64;
-	len -= 64;
+
+    /* Process data in 64-byte chunks, straight from the caller's buffer */
+
+    if (len >= 64) {
+	MD5TransformBlocks(ctx->buf, buf, len >> 6);
+	buf += len & ~63;
+	len &= 63;
     }
 
     /* Handle any remaining bytes of data. */
@@ -141,8 +146,7 @@ void MD5Final(unsigned char digest[16], struct MD5Context *ctx)
     if (count < 8) {
 	/* Two lots of padding:  Pad the first block to 64 bytes */
 	memset(p, 0, count);
-	byteReverse(ctx->in, 16);
-	MD5Transform(ctx->buf, (u_int32_t *) ctx->in);
+	MD5TransformBlocks(ctx->buf, ctx->in, 1);
 
 	/* Now fill the next block with 56 bytes */
 	memset(ctx->in, 0, 56);
@@ -150,16 +154,17 @@ void MD5Final(unsigned char digest[16], struct MD5Context *ctx)
 	/* Pad block to 56 bytes */
 	memset(p, 0, count - 8);
     }
-    byteReverse(ctx->in, 14);
 
     /* Append length in bits and transform */
-    ((u_int32_t *) ctx->in)[14] = ctx->bits[0];
-    ((u_int32_t *) ctx->in)[15] = ctx->bits[1];
-
-    MD5Transform(ctx->buf, (u_int32_t *) ctx->in);
-    byteReverse((unsigned char *) ctx->buf, 4);
-    memcpy(digest, ctx->buf, 16);
-    memset(ctx, 0, sizeof(ctx));	/* In case it's sensitive */
+    PUTLE32(ctx->in + 56, ctx->bits[0]);
+    PUTLE32(ctx->in + 60, ctx->bits[1]);
+
+    MD5TransformBlocks(ctx->buf, ctx->in, 1);
+    PUTLE32(digest, ctx->buf[0]);
+    PUTLE32(digest + 4, ctx->buf[1]);
+    PUTLE32(digest + 8, ctx->buf[2]);
+    PUTLE32(digest + 12, ctx->buf[3]);
+    memset(ctx, 0, sizeof(*ctx));	/* In case it's sensitive */
 }
 
 #ifndef ASM_MD5
@@ -181,162 +186,188 @@ void MD5Final(unsigned char digest[16], struct MD5Context *ctx)
 	( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
 #endif
 
+/* Message word i of the current block */
+#define X(i)	GETLE32(data + 4 * (i))
+
 /*
  * The core of the MD5 algorithm, this alters an existing MD5 hash to
- * reflect the addition of 16 longwords of new data.  MD5Update blocks
- * the data and converts bytes into longwords for this routine.
+ * reflect the addition of blocks * 64 bytes of new data. The data is
+ * read directly from the buffer; it doesn't have to be aligned.
+ * Every round is written out in full with its constant, so there are
+ * no tables to look up and no loop counters in the way.
  */
-void MD5Transform(u_int32_t buf[4], u_int32_t const in[16])
+void MD5TransformBlocks(u_int32_t buf[4], unsigned char const *data,
+			unsigned blocks)
 {
     register u_int32_t a, b, c, d;
 
-    a = buf[0];
-    b = buf[1];
-    c = buf[2];
-    d = buf[3];
+    for (; blocks; blocks--, data += 64) {
+	a = buf[0];
+	b = buf[1];
+	c = buf[2];
+	d = buf[3];
 
 #ifdef __PUREC__	/* PureC Weirdness... (GG) */
-    MD5STEP(F1(b,c,d), a, b, c, d, in[0] + 0xd76aa478L, 7);
-    MD5STEP(F1(a,b,c), d, a, b, c, in[1] + 0xe8c7b756L, 12);
-    MD5STEP(F1(d,a,b), c, d, a, b, in[2] + 0x242070dbL, 17);
-    MD5STEP(F1(c,d,a), b, c, d, a, in[3] + 0xc1bdceeeL, 22);
-    MD5STEP(F1(b,c,d), a, b, c, d, in[4] + 0xf57c0fafL, 7);
-    MD5STEP(F1(a,b,c), d, a, b, c, in[5] + 0x4787c62aL, 12);
-    MD5STEP(F1(d,a,b), c, d, a, b, in[6] + 0xa8304613L, 17);
-    MD5STEP(F1(c,d,a), b, c, d, a, in[7] + 0xfd469501L, 22);
-    MD5STEP(F1(b,c,d), a, b, c, d, in[8] + 0x698098d8L, 7);
-    MD5STEP(F1(a,b,c), d, a, b, c, in[9] + 0x8b44f7afL, 12);
-    MD5STEP(F1(d,a,b), c, d, a, b, in[10] + 0xffff5bb1L, 17);
-    MD5STEP(F1(c,d,a), b, c, d, a, in[11] + 0x895cd7beL, 22);
-    MD5STEP(F1(b,c,d), a, b, c, d, in[12] + 0x6b901122L, 7);
-    MD5STEP(F1(a,b,c), d, a, b, c, in[13] + 0xfd987193L, 12);
-    MD5STEP(F1(d,a,b), c, d, a, b, in[14] + 0xa679438eL, 17);
-    MD5STEP(F1(c,d,a), b, c, d, a, in[15] + 0x49b40821L, 22);
-
-    MD5STEP(F2(b,c,d), a, b, c, d, in[1] + 0xf61e2562L, 5);
-    MD5STEP(F2(a,b,c), d, a, b, c, in[6] + 0xc040b340L, 9);
-    MD5STEP(F2(d,a,b), c, d, a, b, in[11] + 0x265e5a51L, 14);
-    MD5STEP(F2(c,d,a), b, c, d, a, in[0] + 0xe9b6c7aaL, 20);
-    MD5STEP(F2(b,c,d), a, b, c, d, in[5] + 0xd62f105dL, 5);
-    MD5STEP(F2(a,b,c), d, a, b, c, in[10] + 0x02441453L, 9);
-    MD5STEP(F2(d,a,b), c, d, a, b, in[15] + 0xd8a1e681L, 14);
-    MD5STEP(F2(c,d,a), b, c, d, a, in[4] + 0xe7d3fbc8L, 20);
-    MD5STEP(F2(b,c,d), a, b, c, d, in[9] + 0x21e1cde6L, 5);
-    MD5STEP(F2(a,b,c), d, a, b, c, in[14] + 0xc33707d6L, 9);
-    MD5STEP(F2(d,a,b), c, d, a, b, in[3] + 0xf4d50d87L, 14);
-    MD5STEP(F2(c,d,a), b, c, d, a, in[8] + 0x455a14edL, 20);
-    MD5STEP(F2(b,c,d), a, b, c, d, in[13] + 0xa9e3e905L, 5);
-    MD5STEP(F2(a,b,c), d, a, b, c, in[2] + 0xfcefa3f8L, 9);
-    MD5STEP(F2(d,a,b), c, d, a, b, in[7] + 0x676f02d9L, 14);
-    MD5STEP(F2(c,d,a), b, c, d, a, in[12] + 0x8d2a4c8aL, 20);
-
-    MD5STEP(F3(b,c,d), a, b, c, d, in[5] + 0xfffa3942L, 4);
-    MD5STEP(F3(a,b,c), d, a, b, c, in[8] + 0x8771f681L, 11);
-    MD5STEP(F3(d,a,b), c, d, a, b, in[11] + 0x6d9d6122L, 16);
-    MD5STEP(F3(c,d,a), b, c, d, a, in[14] + 0xfde5380cL, 23);
-    MD5STEP(F3(b,c,d), a, b, c, d, in[1] + 0xa4beea44L, 4);
-    MD5STEP(F3(a,b,c), d, a, b, c, in[4] + 0x4bdecfa9L, 11);
-    MD5STEP(F3(d,a,b), c, d, a, b, in[7] + 0xf6bb4b60L, 16);
-    MD5STEP(F3(c,d,a), b, c, d, a, in[10] + 0xbebfbc70L, 23);
-    MD5STEP(F3(b,c,d), a, b, c, d, in[13] + 0x289b7ec6L, 4);
-    MD5STEP(F3(a,b,c), d, a, b, c, in[0] + 0xeaa127faL, 11);
-    MD5STEP(F3(d,a,b), c, d, a, b, in[3] + 0xd4ef3085L, 16);
-    MD5STEP(F3(c,d,a), b, c, d, a, in[6] + 0x04881d05L, 23);
-    MD5STEP(F3(b,c,d), a, b, c, d, in[9] + 0xd9d4d039L, 4);
-    MD5STEP(F3(a,b,c), d, a, b, c, in[12] + 0xe6db99e5L, 11);
-    MD5STEP(F3(d,a,b), c, d, a, b, in[15] + 0x1fa27cf8L, 16);
-    MD5STEP(F3(c,d,a), b, c, d, a, in[2] + 0xc4ac5665L, 23);
-
-    MD5STEP(F4(b,c,d), a, b, c, d, in[0] + 0xf4292244L, 6);
-    MD5STEP(F4(a,b,c), d, a, b, c, in[7] + 0x432aff97L, 10);
-    MD5STEP(F4(d,a,b), c, d, a, b, in[14] + 0xab9423a7L, 15);
-    MD5STEP(F4(c,d,a), b, c, d, a, in[5] + 0xfc93a039L, 21);
-    MD5STEP(F4(b,c,d), a, b, c, d, in[12] + 0x655b59c3L, 6);
-    MD5STEP(F4(a,b,c), d, a, b, c, in[3] + 0x8f0ccc92L, 10);
-    MD5STEP(F4(d,a,b), c, d, a, b, in[10] + 0xffeff47dL, 15);
-    MD5STEP(F4(c,d,a), b, c, d, a, in[1] + 0x85845dd1L, 21);
-    MD5STEP(F4(b,c,d), a, b, c, d, in[8] + 0x6fa87e4fL, 6);
-    MD5STEP(F4(a,b,c), d, a, b, c, in[15] + 0xfe2ce6e0L, 10);
-    MD5STEP(F4(d,a,b), c, d, a, b, in[6] + 0xa3014314L, 15);
-    MD5STEP(F4(c,d,a), b, c, d, a, in[13] + 0x4e0811a1L, 21);
-    MD5STEP(F4(b,c,d), a, b, c, d, in[4] + 0xf7537e82L, 6);
-    MD5STEP(F4(a,b,c), d, a, b, c, in[11] + 0xbd3af235L, 10);
-    MD5STEP(F4(d,a,b), c, d, a, b, in[2] + 0x2ad7d2bbL, 15);
-    MD5STEP(F4(c,d,a), b, c, d, a, in[9] + 0xeb86d391L, 21);
+	MD5STEP(F1(b,c,d), a, b, c, d, X(0) + 0xd76aa478L, 7);
+	MD5STEP(F1(a,b,c), d, a, b, c, X(1) + 0xe8c7b756L, 12);
+	MD5STEP(F1(d,a,b), c, d, a, b, X(2) + 0x242070dbL, 17);
+	MD5STEP(F1(c,d,a), b, c, d, a, X(3) + 0xc1bdceeeL, 22);
+	MD5STEP(F1(b,c,d), a, b, c, d, X(4) + 0xf57c0fafL, 7);
+	MD5STEP(F1(a,b,c), d, a, b, c, X(5) + 0x4787c62aL, 12);
+	MD5STEP(F1(d,a,b), c, d, a, b, X(6) + 0xa8304613L, 17);
+	MD5STEP(F1(c,d,a), b, c, d, a, X(7) + 0xfd469501L, 22);
+	MD5STEP(F1(b,c,d), a, b, c, d, X(8) + 0x698098d8L, 7);
+	MD5STEP(F1(a,b,c), d, a, b, c, X(9) + 0x8b44f7afL, 12);
+	MD5STEP(F1(d,a,b), c, d, a, b, X(10) + 0xffff5bb1L, 17);
+	MD5STEP(F1(c,d,a), b, c, d, a, X(11) + 0x895cd7beL, 22);
+	MD5STEP(F1(b,c,d), a, b, c, d, X(12) + 0x6b901122L, 7);
+	MD5STEP(F1(a,b,c), d, a, b, c, X(13) + 0xfd987193L, 12);
+	MD5STEP(F1(d,a,b), c, d, a, b, X(14) + 0xa679438eL, 17);
+	MD5STEP(F1(c,d,a), b, c, d, a, X(15) + 0x49b40821L, 22);
+
+	MD5STEP(F2(b,c,d), a, b, c, d, X(1) + 0xf61e2562L, 5);
+	MD5STEP(F2(a,b,c), d, a, b, c, X(6) + 0xc040b340L, 9);
+	MD5STEP(F2(d,a,b), c, d, a, b, X(11) + 0x265e5a51L, 14);
+	MD5STEP(F2(c,d,a), b, c, d, a, X(0) + 0xe9b6c7aaL, 20);
+	MD5STEP(F2(b,c,d), a, b, c, d, X(5) + 0xd62f105dL, 5);
+	MD5STEP(F2(a,b,c), d, a, b, c, X(10) + 0x02441453L, 9);
+	MD5STEP(F2(d,a,b), c, d, a, b, X(15) + 0xd8a1e681L, 14);
+	MD5STEP(F2(c,d,a), b, c, d, a, X(4) + 0xe7d3fbc8L, 20);
+	MD5STEP(F2(b,c,d), a, b, c, d, X(9) + 0x21e1cde6L, 5);
+	MD5STEP(F2(a,b,c), d, a, b, c, X(14) + 0xc33707d6L, 9);
+	MD5STEP(F2(d,a,b), c, d, a, b, X(3) + 0xf4d50d87L, 14);
+	MD5STEP(F2(c,d,a), b, c, d, a, X(8) + 0x455a14edL, 20);
+	MD5STEP(F2(b,c,d), a, b, c, d, X(13) + 0xa9e3e905L, 5);
+	MD5STEP(F2(a,b,c), d, a, b, c, X(2) + 0xfcefa3f8L, 9);
+	MD5STEP(F2(d,a,b), c, d, a, b, X(7) + 0x676f02d9L, 14);
+	MD5STEP(F2(c,d,a), b, c, d, a, X(12) + 0x8d2a4c8aL, 20);
+
+	MD5STEP(F3(b,c,d), a, b, c, d, X(5) + 0xfffa3942L, 4);
+	MD5STEP(F3(a,b,c), d, a, b, c, X(8) + 0x8771f681L, 11);
+	MD5STEP(F3(d,a,b), c, d, a, b, X(11) + 0x6d9d6122L, 16);
+	MD5STEP(F3(c,d,a), b, c, d, a, X(14) + 0xfde5380cL, 23);
+	MD5STEP(F3(b,c,d), a, b, c, d, X(1) + 0xa4beea44L, 4);
+	MD5STEP(F3(a,b,c), d, a, b, c, X(4) + 0x4bdecfa9L, 11);
+	MD5STEP(F3(d,a,b), c, d, a, b, X(7) + 0xf6bb4b60L, 16);
+	MD5STEP(F3(c,d,a), b, c, d, a, X(10) + 0xbebfbc70L, 23);
+	MD5STEP(F3(b,c,d), a, b, c, d, X(13) + 0x289b7ec6L, 4);
+	MD5STEP(F3(a,b,c), d, a, b, c, X(0) + 0xeaa127faL, 11);
+	MD5STEP(F3(d,a,b), c, d, a, b, X(3) + 0xd4ef3085L, 16);
+	MD5STEP(F3(c,d,a), b, c, d, a, X(6) + 0x04881d05L, 23);
+	MD5STEP(F3(b,c,d), a, b, c, d, X(9) + 0xd9d4d039L, 4);
+	MD5STEP(F3(a,b,c), d, a, b, c, X(12) + 0xe6db99e5L, 11);
+	MD5STEP(F3(d,a,b), c, d, a, b, X(15) + 0x1fa27cf8L, 16);
+	MD5STEP(F3(c,d,a), b, c, d, a, X(2) + 0xc4ac5665L, 23);
+
+	MD5STEP(F4(b,c,d), a, b, c, d, X(0) + 0xf4292244L, 6);
+	MD5STEP(F4(a,b,c), d, a, b, c, X(7) + 0x432aff97L, 10);
+	MD5STEP(F4(d,a,b), c, d, a, b, X(14) + 0xab9423a7L, 15);
+	MD5STEP(F4(c,d,a), b, c, d, a, X(5) + 0xfc93a039L, 21);
+	MD5STEP(F4(b,c,d), a, b, c, d, X(12) + 0x655b59c3L, 6);
+	MD5STEP(F4(a,b,c), d, a, b, c, X(3) + 0x8f0ccc92L, 10);
+	MD5STEP(F4(d,a,b), c, d, a, b, X(10) + 0xffeff47dL, 15);
+	MD5STEP(F4(c,d,a), b, c, d, a, X(1) + 0x85845dd1L, 21);
+	MD5STEP(F4(b,c,d), a, b, c, d, X(8) + 0x6fa87e4fL, 6);
+	MD5STEP(F4(a,b,c), d, a, b, c, X(15) + 0xfe2ce6e0L, 10);
+	MD5STEP(F4(d,a,b), c, d, a, b, X(6) + 0xa3014314L, 15);
+	MD5STEP(F4(c,d,a), b, c, d, a, X(13) + 0x4e0811a1L, 21);
+	MD5STEP(F4(b,c,d), a, b, c, d, X(4) + 0xf7537e82L, 6);
+	MD5STEP(F4(a,b,c), d, a, b, c, X(11) + 0xbd3af235L, 10);
+	MD5STEP(F4(d,a,b), c, d, a, b, X(2) + 0x2ad7d2bbL, 15);
+	MD5STEP(F4(c,d,a), b, c, d, a, X(9) + 0xeb86d391L, 21);
 #else
-    MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
-    MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
-    MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
-    MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
-    MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
-    MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
-    MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
-    MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
-    MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
-    MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
-    MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-    MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-    MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
-    MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-    MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-    MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-    MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-    MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-    MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-    MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-    MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-    MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-    MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-    MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-    MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-    MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-    MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-    MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-    MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-    MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-    MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-    MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-    MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
-    MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
-    MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-    MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-    MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
-    MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
-    MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
-    MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-    MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
-    MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
-    MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
-    MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
-    MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
-    MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-    MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-    MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
-
-    MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
-    MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
-    MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-    MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
-    MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
-    MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
-    MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-    MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
-    MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
-    MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-    MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
-    MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-    MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
-    MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-    MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
-    MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+	MD5STEP(F1, a, b, c, d, X(0) + 0xd76aa478, 7);
+	MD5STEP(F1, d, a, b, c, X(1) + 0xe8c7b756, 12);
+	MD5STEP(F1, c, d, a, b, X(2) + 0x242070db, 17);
+	MD5STEP(F1, b, c, d, a, X(3) + 0xc1bdceee, 22);
+	MD5STEP(F1, a, b, c, d, X(4) + 0xf57c0faf, 7);
+	MD5STEP(F1, d, a, b, c, X(5) + 0x4787c62a, 12);
+	MD5STEP(F1, c, d, a, b, X(6) + 0xa8304613, 17);
+	MD5STEP(F1, b, c, d, a, X(7) + 0xfd469501, 22);
+	MD5STEP(F1, a, b, c, d, X(8) + 0x698098d8, 7);
+	MD5STEP(F1, d, a, b, c, X(9) + 0x8b44f7af, 12);
+	MD5STEP(F1, c, d, a, b, X(10) + 0xffff5bb1, 17);
+	MD5STEP(F1, b, c, d, a, X(11) + 0x895cd7be, 22);
+	MD5STEP(F1, a, b, c, d, X(12) + 0x6b901122, 7);
+	MD5STEP(F1, d, a, b, c, X(13) + 0xfd987193, 12);
+	MD5STEP(F1, c, d, a, b, X(14) + 0xa679438e, 17);
+	MD5STEP(F1, b, c, d, a, X(15) + 0x49b40821, 22);
+
+	MD5STEP(F2, a, b, c, d, X(1) + 0xf61e2562, 5);
+	MD5STEP(F2, d, a, b, c, X(6) + 0xc040b340, 9);
+	MD5STEP(F2, c, d, a, b, X(11) + 0x265e5a51, 14);
+	MD5STEP(F2, b, c, d, a, X(0) + 0xe9b6c7aa, 20);
+	MD5STEP(F2, a, b, c, d, X(5) + 0xd62f105d, 5);
+	MD5STEP(F2, d, a, b, c, X(10) + 0x02441453, 9);
+	MD5STEP(F2, c, d, a, b, X(15) + 0xd8a1e681, 14);
+	MD5STEP(F2, b, c, d, a, X(4) + 0xe7d3fbc8, 20);
+	MD5STEP(F2, a, b, c, d, X(9) + 0x21e1cde6, 5);
+	MD5STEP(F2, d, a, b, c, X(14) + 0xc33707d6, 9);
+	MD5STEP(F2, c, d, a, b, X(3) + 0xf4d50d87, 14);
+	MD5STEP(F2, b, c, d, a, X(8) + 0x455a14ed, 20);
+	MD5STEP(F2, a, b, c, d, X(13) + 0xa9e3e905, 5);
+	MD5STEP(F2, d, a, b, c, X(2) + 0xfcefa3f8, 9);
+	MD5STEP(F2, c, d, a, b, X(7) + 0x676f02d9, 14);
+	MD5STEP(F2, b, c, d, a, X(12) + 0x8d2a4c8a, 20);
+
+	MD5STEP(F3, a, b, c, d, X(5) + 0xfffa3942, 4);
+	MD5STEP(F3, d, a, b, c, X(8) + 0x8771f681, 11);
+	MD5STEP(F3, c, d, a, b, X(11) + 0x6d9d6122, 16);
+	MD5STEP(F3, b, c, d, a, X(14) + 0xfde5380c, 23);
+	MD5STEP(F3, a, b, c, d, X(1) + 0xa4beea44, 4);
+	MD5STEP(F3, d, a, b, c, X(4) + 0x4bdecfa9, 11);
+	MD5STEP(F3, c, d, a, b, X(7) + 0xf6bb4b60, 16);
+	MD5STEP(F3, b, c, d, a, X(10) + 0xbebfbc70, 23);
+	MD5STEP(F3, a, b, c, d, X(13) + 0x289b7ec6, 4);
+	MD5STEP(F3, d, a, b, c, X(0) + 0xeaa127fa, 11);
+	MD5STEP(F3, c, d, a, b, X(3) + 0xd4ef3085, 16);
+	MD5STEP(F3, b, c, d, a, X(6) + 0x04881d05, 23);
+	MD5STEP(F3, a, b, c, d, X(9) + 0xd9d4d039, 4);
+	MD5STEP(F3, d, a, b, c, X(12) + 0xe6db99e5, 11);
+	MD5STEP(F3, c, d, a, b, X(15) + 0x1fa27cf8, 16);
+	MD5STEP(F3, b, c, d, a, X(2) + 0xc4ac5665, 23);
+
+	MD5STEP(F4, a, b, c, d, X(0) + 0xf4292244, 6);
+	MD5STEP(F4, d, a, b, c, X(7) + 0x432aff97, 10);
+	MD5STEP(F4, c, d, a, b, X(14) + 0xab9423a7, 15);
+	MD5STEP(F4, b, c, d, a, X(5) + 0xfc93a039, 21);
+	MD5STEP(F4, a, b, c, d, X(12) + 0x655b59c3, 6);
+	MD5STEP(F4, d, a, b, c, X(3) + 0x8f0ccc92, 10);
+	MD5STEP(F4, c, d, a, b, X(10) + 0xffeff47d, 15);
+	MD5STEP(F4, b, c, d, a, X(1) + 0x85845dd1, 21);
+	MD5STEP(F4, a, b, c, d, X(8) + 0x6fa87e4f, 6);
+	MD5STEP(F4, d, a, b, c, X(15) + 0xfe2ce6e0, 10);
+	MD5STEP(F4, c, d, a, b, X(6) + 0xa3014314, 15);
+	MD5STEP(F4, b, c, d, a, X(13) + 0x4e0811a1, 21);
+	MD5STEP(F4, a, b, c, d, X(4) + 0xf7537e82, 6);
+	MD5STEP(F4, d, a, b, c, X(11) + 0xbd3af235, 10);
+	MD5STEP(F4, c, d, a, b, X(2) + 0x2ad7d2bb, 15);
+	MD5STEP(F4, b, c, d, a, X(9) + 0xeb86d391, 21);
 #endif
 
-    buf[0] += a;
-    buf[1] += b;
-    buf[2] += c;
-    buf[3] += d;
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+    }
+}
+
+/*
+ * The original interface: one block that has already been converted
+ * into 16 longwords in host byte order.
+ */
+void MD5Transform(u_int32_t buf[4], u_int32_t const in[16])
+{
+#ifdef HIGHFIRST
+    unsigned char block[64];
+    int i;
+
+    for (i = 0; i < 16; i++)
+	PUTLE32(block + 4 * i, in[i]);
+    MD5TransformBlocks(buf, block, 1);
+#else
+    MD5TransformBlocks(buf, (unsigned char const *) in, 1);
+#endif
 }
 
 #endif
@@ -0,0 +1,80 @@
+/* MD5DEEP - md5bench.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/* A microbenchmark for the MD5 code. It isn't part of md5deep itself.
+   Build it with "make bench" and run it with no arguments. It hashes
+   the same buffer over and over, both from an aligned address and from
+   an odd one, and reports the speed of MD5Update in MB/s and, on x86,
+   in cycles per byte. */
+
+#include "md5deep.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#define BENCH_BUFFER   (ONE_MEGABYTE)
+#define BENCH_ROUNDS   256
+
+
+void bench(char *name, unsigned char *buf) {
+
+  struct MD5Context md;
+  unsigned char sum[MD5_HASH_LENGTH];
+  clock_t start, stop;
+  double seconds, megs = (double)BENCH_BUFFER * BENCH_ROUNDS / ONE_MEGABYTE;
+  int i;
+#ifdef HAVE_RDTSC
+  unsigned long long cycles;
+#endif
+
+  MD5Init(&md);
+  start = clock();
+#ifdef HAVE_RDTSC
+  cycles = __rdtsc();
+#endif
+
+  for (i = 0 ; i < BENCH_ROUNDS ; i++)
+    MD5Update(&md,buf,BENCH_BUFFER);
+
+#ifdef HAVE_RDTSC
+  cycles = __rdtsc() - cycles;
+#endif
+  stop = clock();
+  MD5Final(sum,&md);
+
+  seconds = (double)(stop - start) / CLOCKS_PER_SEC;
+  printf("%-10s %8.1f MB/s", name, megs / seconds);
+#ifdef HAVE_RDTSC
+  printf("  %5.2f cycles/byte",
+	 (double)cycles / ((double)BENCH_BUFFER * BENCH_ROUNDS));
+#endif
+  printf("\n");
+}
+
+
+int main(int argc, char **argv) {
+
+  unsigned char *buf = (unsigned char *)malloc(BENCH_BUFFER + 64);
+  int i;
+
+  for (i = 0 ; i < BENCH_BUFFER + 64 ; i++)
+    buf[i] = (unsigned char)(i * 7 + 3);
+
+  bench("aligned",buf);
+  bench("unaligned",buf + 1);
+
+  free(buf);
+  return 0;
+}
@@ -14,10 +14,31 @@
    
 #include "md5deep.h"
 
+#ifdef __UNIX
+#include <sys/resource.h>
+#endif
+
 int modeMatch = FALSE;
 int modeSilent = FALSE;
 int modeEstimate = FALSE;
 int modeRecursive = FALSE;
+int modeOrdered = FALSE;
+int modeMultiBuffer = FALSE;
+int modeStats = FALSE;
+
+/* The number of hashing threads. When this is one, we hash each file
+   as soon as we find it, just like we always have. */
+int threadCount = 1;
+
+/* If this is set, we write the known hashes to an index and exit */
+char *indexFilename = NULL;
+
+/* The hash cache, if we're using one */
+char *cacheFilename = NULL;
+
+/* All of the mode variables above are only written while we parse the
+   command line. After that they are read only, which is why the
+   hashing threads can look at them without any locking. */
 
 
 void printError(char *fn) {
@@ -35,15 +56,36 @@ void usage() {
   author();
   fprintf (stderr,"\n");
   fprintf (stderr,
-	   "Usage: %s [-v] [-V] [-h] [-m <filename>] [-resbt] [FILES] \n",
+	   "Usage: %s [-v] [-V] [-h] [-m <filename>] [-I <filename>] [-C <filename>] [-y <fraction>] [-j <num>] [-W <num>] [-p <size>] [-T <size>] [-B <size>] [-F <rate>] [-c <list>] [-dresOPGKULDAMSbt] [FILES] \n",
 	   __progname);
 
   fprintf (stderr,"-v  - display version number and exit\n");
   fprintf (stderr,"-V  - display copyright information and exit\n");
   fprintf (stderr,"-h  - display this help message and exit\n");
   fprintf (stderr,"-m  - enables matching mode. See README/man page for details\n");
+  fprintf (stderr,"-I  - write the hashes from -m to an index file and exit\n");
+  fprintf (stderr,"-K  - check the checksums of the index files given to -m\n");
+  fprintf (stderr,"-F  - false positive rate of the known hash filter. Default 0.01\n");
+  fprintf (stderr,"-C  - keep the hashes of unchanged files in a cache file\n");
+  fprintf (stderr,"-y  - with -C, rehash this fraction of the cached files\n");
+  fprintf (stderr,"-c  - compute the digests in list, from md5, sha1 and sha256\n");
+  fprintf (stderr,"-d  - print groups of files that are duplicates of each other\n");
+  fprintf (stderr,"-S  - print statistics when done\n");
   fprintf (stderr,"-r  - enables recursive mode. All subdirectories are traversed\n");
   fprintf (stderr,"-e  - compute estimated time remaining for each file\n");
+  fprintf (stderr,"-j  - use num threads to hash files\n");
+  fprintf (stderr,"-W  - with -r and -j, walk directories with num threads\n");
+  fprintf (stderr,"-O  - with -j, print results in the same order as one thread\n");
+  fprintf (stderr,"-G  - with -j or -L, give each disk its own queue of files\n");
+  fprintf (stderr,"-P  - with -r, hash the files in each directory in disk order\n");
+  fprintf (stderr,"-p  - also hash each piece of size bytes of every file\n");
+  fprintf (stderr,"-T  - also compute a tree hash with leaves of size bytes\n");
+  fprintf (stderr,"-U  - read small files in batches using io_uring\n");
+  fprintf (stderr,"-L  - hash several files at once in each thread using SIMD\n");
+  fprintf (stderr,"-B  - read files size bytes at a time. Accepts k and m suffixes\n");
+  fprintf (stderr,"-D  - bypass the operating system's file cache where possible\n");
+  fprintf (stderr,"-A  - read ahead of the hashing so that they overlap\n");
+  fprintf (stderr,"-M  - memory map regular files instead of reading them\n");
   fprintf (stderr,"-s  - enables silent mode. Suppress all error messages\n");
   fprintf (stderr,"-b  - ignored. Present for compatibility with md5sum\n");
   fprintf (stderr,"-t  - ignored. Present for compatibility with md5sum\n");
@@ -80,65 +122,6 @@ void setProgramName() {
 #endif  /* ifdef __WIN32 */
 
 
-/* Return the size, in bytes of an open file stream. On error, return -1 */
-unsigned long long measureOpenFile(FILE *f){
-
-#ifdef __LINUX
-  int descriptor = 0;
-  struct stat *info;
-
-  /* I don't know why, but if you don't initialize this value you'll
-     get wildly innacurate results when you try to run this function */
-  unsigned long long numsectors = 0;
-#endif
-
-  unsigned long long total = 0, original = ftello(f);
-
-  if ((fseeko(f,0,SEEK_END)))
-    return -1;
-  total = ftello(f);
-  if ((fseeko(f,original,SEEK_SET)))
-    return -1;
-
-#ifdef __LINUX
-
-  /* Block devices, like /dev/hda, don't return a normal filesize.
-     If we are working with a block device, we have to ask the operating
-     system to tell us the true size of the device. 
-     
-     The following only works on Linux as far as I know. If you know
-     how to port this code to another operating system, please contact
-     the current maintainer of this program! */
-
-  descriptor = fileno(f);
-  info = (struct stat*)malloc(sizeof(struct stat));
-
-  /* I'd prefer not to use fstat as it will follow symbolic links. We don't
-     follow symbolic links. That being said, all symbolic links *should*
-     have been caught before we got here. */
-
-  fstat(descriptor,info);
-  if (S_ISBLK(info->st_mode)) {
-    if (ioctl(descriptor, BLKGETSIZE, &numsectors)){
-#ifdef __DEBUG
-      perror("BLKGETSIZE failed");
-#endif
-    } else {
-
-      /* We're going to assume that this device has 512 byte sectors.
-	 Eventually we should add a way to get the real number of sectors
-	 from the device. */
-      total = numsectors * 512;
-    }
-  }
-  
-  free(info);
-#endif /* ifdef __LINUX */
-  
-  return (total - original);
-}
-
-
 void updateDisplay(time_t start, time_t now, 
 		   unsigned long long bytesRead,
 		   unsigned long long totalBytes) {
@@ -190,20 +173,37 @@ void updateDisplay(time_t start, time_t now,
 
 
 
-char *MD5File(FILE *fp) {
+/* Writes a digest out as a hex string in result, which must hold at
+   least 2 * MD5_HASH_LENGTH + 1 characters. */
+void formatDigest(unsigned char sum[MD5_HASH_LENGTH], char *result) {
+
+  static char hex[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0; i < MD5_HASH_LENGTH; i++) {
+    result[2 * i] = hex[(sum[i] >> 4) & 0xf];
+    result[2 * i + 1] = hex[sum[i] & 0xf];
+  }
+  result[2 * MD5_HASH_LENGTH] = 0;
+}
+
+
+/* Computes the digests in the set (-c) of the file open in r and stores
+   them as a hex string in result, which must hold at least
+   DIGEST_STRING_LENGTH characters. We don't use a static buffer here as
+   this may be called from several hashing threads at once. Returns
+   result, or NULL on a read error. */
+char *hashFile(fileReader *r, char *result) {
 
   time_t start,now,last = 0;
   unsigned long long total = 0,fileSize = 0;
-  MD5_CTX md;
-  unsigned char sum[MD5_HASH_LENGTH];
-  unsigned char buf[BUFSIZ];
-  static char result[2 * MD5_HASH_LENGTH + 1];
-  static char hex[] = "0123456789abcdef";
-  int     i,buflen;
+  digestSet set;
+  unsigned char *buf;
+  long    buflen;
   bool estimateThisFile = FALSE;
 
   if (modeEstimate) {
-    fileSize = measureOpenFile(fp);
+    fileSize = measureOpenFile(r);
 
     /* If were are unable to compute the file size, we can't very well
        estimate how long it's going to take us, now can we! That being
@@ -214,19 +214,19 @@ char *MD5File(FILE *fp) {
     }
   }
 
-  MD5Init(&md);
+  digestInit(&set,r);
 
   if (estimateThisFile) {
     time(&start);
     last = start;
   }
  
-  while ((buflen = fread(buf, 1, BUFSIZ, fp)) > 0) {
+  while ((buflen = readerNext(r, &buf)) > 0) {
 
-    MD5Update(&md, buf, buflen);
+    digestUpdate(&set, buf, buflen);
 
     if (estimateThisFile) {
-       total += BUFSIZ;
+       total += buflen;
        time(&now);
 
        /* We only update the on-screen display if it's taking us more
@@ -242,31 +242,288 @@ char *MD5File(FILE *fp) {
   if (estimateThisFile)   
     fprintf(stderr,"\r                                                   \r");
 
-  MD5Final(sum, &md);
-  
-  for (i = 0; i < MD5_HASH_LENGTH; i++) {
-    result[2 * i] = hex[(sum[i] >> 4) & 0xf];
-    result[2 * i + 1] = hex[sum[i] & 0xf];
-  }
+  digestFinal(&set, result);
+
+  if (buflen < 0 || readerFailed(r))
+    return NULL;
+
   return (result);
 }
 
 
-void md5(char *filename) {
-  FILE *f;
-  if ((f = fopen(filename,"rb")) == NULL) {
-    printError(filename);
+/* We only stat a file before we open it when the cache (-C) or the
+   known file sizes (-m) might tell us we don't have to open it at all.
+   Otherwise it's cheaper to ask the file once it's open (openedHash). */
+static int statFirst(void) {
+  return ((cacheFilename != NULL && digestMask == DIGEST_MD5) ||
+	  (modeMatch && sizesLoaded()));
+}
+
+
+/* When dirfd is NO_DIRECTORY we find files by their whole path, and
+   name is the same as filename. Otherwise name is the file's name in
+   the directory the walk has open on dirfd. */
+#define NO_DIRECTORY -1
+
+static int statFile(int dirfd, char *name, char *filename,
+		    struct stat *info) {
+#ifdef __UNIX
+  if (dirfd != NO_DIRECTORY)
+    return fstatat(dirfd,name,info,0);
+#endif
+  return stat(filename,info);
+}
+
+
+static int openFile(fileReader *r, int dirfd, char *name, char *filename) {
+#ifdef __UNIX
+  if (dirfd != NO_DIRECTORY)
+    return readerOpenAt(r,dirfd,name,filename);
+#endif
+  return readerOpen(r,filename);
+}
+
+
+static char *knownHashAt(int dirfd, char *name, char *filename,
+			 struct stat *info, char *result) {
+
+  if (!statFirst() || statFile(dirfd,name,filename,info)) {
+    info->st_nlink = 0;
+    return NULL;
+  }
+
+  return lookupHash(info,result);
+}
+
+
+/* Before we read a file, we see if we already know its hash, either
+   because it's another link to a file we've hashed or because it's in
+   the cache (-C). Fills in info for rememberHash, or sets info->st_nlink
+   to zero if we didn't or couldn't stat the file. Returns result if we
+   know the hash, or NULL if we have to read the file. */
+char *knownHash(char *filename, struct stat *info, char *result) {
+  return knownHashAt(NO_DIRECTORY,filename,filename,info,result);
+}
+
+
+/* The part of knownHash that's left once we have info, for callers
+   that got it some other way */
+char *lookupHash(struct stat *info, char *result) {
+
+  /* The cache and the hard link table only hold MD5 hashes */
+  if (digestMask != DIGEST_MD5)
+    return NULL;
+
+  if (linkLookup(info,result) || cacheLookup(info,result))
+    return result;
+  return NULL;
+}
+
+
+/* Called once we've opened the file with r if knownHash didn't stat
+   it. Fills in info from the open file and returns result if that
+   tells us the hash after all, which happens for hard links. */
+char *openedHash(fileReader *r, struct stat *info, char *result) {
+
+  if (info->st_nlink > 0)
+    return NULL;
+
+  if (!readerStat(r,info)) {
+    info->st_nlink = 0;
+    return NULL;
+  }
+
+  return lookupHash(info,result);
+}
+
+
+/* In matching mode a file can't match if no known file has its size.
+   Returns TRUE if we can skip the file described by info, which came
+   from knownHash, without reading it. Only regular files have sizes we
+   can trust. Block devices, FIFOs and the files in /proc say they're
+   some other size than what we'd read, often zero. */
+int cannotMatch(struct stat *info) {
+  return (modeMatch && info->st_nlink > 0 && S_ISREG(info->st_mode) &&
+	  !isKnownSize(info->st_size));
+}
+
+
+/* Called after we've hashed filename, with the info from knownHash */
+void rememberHash(char *filename, struct stat *info, char *result) {
+  if (digestMask != DIGEST_MD5)
     return;
+  linkStore(info,result);
+  cacheStore(filename,info,result);
+}
+
+
+/* The rest of hashFileToLine once we know we don't already have the
+   hash of filename. Info is whatever we know about the file. */
+static char *readFileToLine(fileReader *r, int dirfd, char *name,
+			    char *filename, struct stat *info) {
+
+  char result[DIGEST_STRING_LENGTH];
+  char *status;
+
+  if (cannotMatch(info))
+    return NULL;
+
+  if (!openFile(r,dirfd,name,filename))
+    return NULL;
+
+  if (openedHash(r,info,result)) {
+    readerClose(r);
+    return makeOutputLine(filename,result);
   }
 
+  status = hashFile(r,result);
+  readerClose(r);
+
+  if (status == NULL)
+    return NULL;
+
+  rememberHash(filename,info,result);
+  return makeOutputLine(filename,result);
+}
+
+
+/* Hashes filename and returns the line we should display for it, or
+   NULL if there's nothing to display. The whole line is built before
+   anything gets printed so that output from several hashing threads
+   can't get mixed together. We read the file with r, which belongs to
+   the calling thread. The caller must free the result. */
+char *hashFileToLine(fileReader *r, char *filename) {
+
+  char result[DIGEST_STRING_LENGTH];
+  struct stat info;
+
+  if (knownHash(filename,&info,result))
+    return makeOutputLine(filename,result);
+
+  return readFileToLine(r,NO_DIRECTORY,filename,filename,&info);
+}
+
+
+/* Works like hashFileToLine for the file called name in the directory
+   the walk has open on dirfd. Filename is its whole path. */
+char *hashFileAtToLine(fileReader *r, int dirfd, char *name, char *filename) {
+
+  char result[DIGEST_STRING_LENGTH];
+  struct stat info;
+
+  if (knownHashAt(dirfd,name,filename,&info,result))
+    return makeOutputLine(filename,result);
+
+  return readFileToLine(r,dirfd,name,filename,&info);
+}
+
+
+/* Works like hashFileToLine for callers that have already stat'ed
+   filename into info. A link count of zero means they didn't, or
+   couldn't, and we start from scratch. */
+char *hashStatToLine(fileReader *r, char *filename, struct stat *info) {
+
+  char result[DIGEST_STRING_LENGTH];
+
+  if (info->st_nlink == 0)
+    return hashFileToLine(r,filename);
+
+  if (lookupHash(info,result))
+    return makeOutputLine(filename,result);
+
+  return readFileToLine(r,NO_DIRECTORY,filename,filename,info);
+}
+
+
+/* Returns the line to display for filename given its hash, or NULL
+   if there's nothing to display. The caller must free the result. */
+char *makeOutputLine(char *filename, char *result) {
+
+  char *line = NULL;
+
   if (modeMatch) { 
-    if (isKnownHash(MD5File(f))) {
-      printf ("%s\n", filename);
-    } 
+    if (isKnownHash(result)) 
+      asprintf(&line,"%s\n", filename);
   } else {
-    printf("%s  %s\n",MD5File(f),filename);
+    asprintf(&line,"%s  %s\n",result,filename);
+  }
+
+  return line;
+}
+
+
+/* The reader we use when we're hashing files ourselves instead
+   of handing them to the hashing threads */
+fileReader *mainReader = NULL;
+
+/* Duplicate mode only needs the size of each file until the walk is
+   done. See NO_DIRECTORY for dirfd and name. */
+static void addDupe(int dirfd, char *name, char *filename) {
+
+  struct stat info;
+
+  if (statFile(dirfd,name,filename,&info))
+    printError(filename);
+  else
+    dupesAdd(filename,info.st_size);
+}
+
+
+void md5(char *filename) {
+
+  char *line;
+
+  if (modeDupes) {
+    addDupe(NO_DIRECTORY,filename,filename);
+    return;
+  }
+
+  if (piecewiseSize || treeLeafSize) {
+    piecewiseFile(mainReader,filename);
+    return;
+  }
+
+  if (threadCount > 1 || modeMultiBuffer) {
+    threadsSubmit(filename);
+    return;
+  }
+
+  if (modeBatch) {
+    batchAdd(filename);
+    return;
+  }
+
+  if ((line = hashFileToLine(mainReader,filename)) != NULL) {
+    fputs(line,stdout);
+    free(line);
+  }
+}
+
+
+/* Works like md5 for the file called name in the directory the walk
+   has open on dirfd. We only open the file through dirfd when we hash
+   it right here. Everything else gets to the file after the walk has
+   moved on and closed the directory, so it goes by the whole path.
+   Duplicate mode can still get the size through dirfd. */
+void md5At(int dirfd, char *name, char *filename) {
+
+  char *line;
+
+  if (modeDupes) {
+    addDupe(dirfd,name,filename);
+    return;
+  }
+
+  if (piecewiseSize || treeLeafSize || threadCount > 1 ||
+      modeMultiBuffer || modeBatch) {
+    md5(filename);
+    return;
+  }
+
+  if ((line = hashFileAtToLine(mainReader,dirfd,name,filename)) != NULL) {
+    fputs(line,stdout);
+    free(line);
   }
-  fclose(f);
 }
 
 
@@ -279,63 +536,75 @@ int isDirectory (char *f) {
 }
 
 
-int examineFile(char *fn) { 
-
-  /* By default we "fail open." That is, any file type we can't
-     identify as something we *shouldn't* process is something that 
-     we must process */
-  int status = FILE_REGULAR;
-  struct stat *info = (struct stat*)malloc(sizeof(struct stat));
-  if (lstat(fn,info)) {
-    printError(fn);
-    free(info);
-    return FILE_ERROR;
-  }
+/* By default we "fail open." That is, any file type we can't
+   identify as something we *shouldn't* process is something that 
+   we must process */
+int fileStatus(mode_t mode) {
 
   /* These POSIX macros are defined on the stat(2) man page */
-  if (S_ISDIR(info->st_mode)) {
-    status = FILE_DIRECTORY;
-  }
+  if (S_ISDIR(mode))
+    return FILE_DIRECTORY;
 
   /* There are no symbolic links on Windows */
 #ifndef __WIN32
-  if (S_ISLNK(info->st_mode)) {
-    status = FILE_SYMLINK;
-  }
+  if (S_ISLNK(mode))
+    return FILE_SYMLINK;
 #endif
-  
-  free(info);
-  return status;
+
+  return FILE_REGULAR;
+}
+
+
+int examineFile(char *fn) { 
+
+  struct stat info;
+
+  if (lstat(fn,&info)) {
+    printError(fn);
+    return FILE_ERROR;
+  }
+
+  return fileStatus(info.st_mode);
 }
 
 
 
-/* Returns TRUE if the directory is either "." or ".."
-   The strlen calls are necessary to avoid flagging ".foo" et al. */
+/* Returns TRUE if the directory is either "." or ".." */
 int isSpecialDirectory (char *d) {
-  return ((!strncmp(d,".",1) && (strlen(d) == 1)) ||
-	  (!strncmp(d,"..",2) && (strlen(d) == 2)));
+  return (d[0] == '.' && (d[1] == 0 || (d[1] == '.' && d[2] == 0)));
 }
 
-void processFile(char *path,char *dir);
+
+#ifndef __UNIX
+
+/* On *nix the tree is walked by walk.c */
+
+void processFile(arena *names,char *path,char *dir);
 
 void processDirectory(char *fn) {
 
   DIR *currentDir;
   struct dirent *entry;
+  arena names;
 
   if ((currentDir = opendir(fn)) == NULL) {
     printError(fn);
     return;
   }    
   
-  while ((entry = readdir(currentDir)) != NULL) 
-    processFile(fn,entry->d_name);
+  /* We only need the full name of each entry until we're done with it,
+     so they all come out of one arena that starts over every time */
+  arenaInit(&names);
+  while ((entry = readdir(currentDir)) != NULL) {
+    processFile(&names,fn,entry->d_name);
+    arenaReset(&names);
+  }
+  arenaFree(&names);
   closedir(currentDir);
 }
 
 
-void processFile(char *path,char *dir) {
+void processFile(arena *names,char *path,char *dir) {
 
   int status;
   char *fn;
@@ -360,7 +629,7 @@ void processFile(char *path,char *dir) {
 
   /* We have to add two extra characters to the current string lengths
      in order to hold the '/' we insert and the terminator character */
-  fn = (char *)malloc(sizeof(char) * (strlen(path) + strlen(dir) + 2));
+  fn = (char *)arenaAlloc(names,strlen(path) + strlen(dir) + 2);
   sprintf(fn,"%s%c%s",path,DIR_TRAIL_CHAR,dir);
   
   status = examineFile(fn);
@@ -399,11 +668,10 @@ void processFile(char *path,char *dir) {
       fprintf (stderr,
 	       "%s: %s: Unknown file type. Ignored.\n", __progname, fn);
   }
-
-  free(fn);
-  return;
 }
 
+#endif /* ifndef __UNIX */
+
 
 void addMatchingFile(char *fn) {
   if (!loadMatchFile(fn)) {
@@ -425,14 +693,172 @@ void processCommandLine(int argc, char **argv) {
         #define MD5DEEP_GETOPT_END (-1)
     #endif
 #endif
-  while ((i=getopt(argc,argv,"m:serhvVbt")) != MD5DEEP_GETOPT_END) {
+  while ((i=getopt(argc,argv,"m:I:C:y:F:j:W:p:T:B:c:dserOPGKULDAMShvVbt")) != MD5DEEP_GETOPT_END) {
     switch (i) {
 
+    case 'j':
+      threadCount = atoi(optarg);
+      if (threadCount < 1) {
+	fprintf(stderr,"%s: Invalid number of threads: %s\n",
+		__progname,optarg);
+	exit (1);
+      }
+      break;
+
+    case 'W':
+#ifdef __UNIX
+      walkThreads = atoi(optarg);
+      if (walkThreads < 1) {
+	fprintf(stderr,"%s: Invalid number of threads: %s\n",
+		__progname,optarg);
+	exit (1);
+      }
+#else
+      if (!modeSilent)
+	fprintf(stderr,"%s: -W is not supported by this build. Ignored.\n",
+		__progname);
+#endif
+      break;
+
+    case 'O':
+      modeOrdered = TRUE;
+      break;
+
+    case 'P':
+#ifdef __UNIX
+      modePhysical = TRUE;
+#else
+      if (!modeSilent)
+	fprintf(stderr,"%s: -P is not supported by this build. Ignored.\n",
+		__progname);
+#endif
+      break;
+
+    case 'p':
+      if ((piecewiseSize = parseSize(optarg)) == 0) {
+	fprintf(stderr,"%s: Invalid piece size: %s\n", __progname,optarg);
+	exit (1);
+      }
+      break;
+
+    case 'T':
+      if ((treeLeafSize = parseSize(optarg)) == 0) {
+	fprintf(stderr,"%s: Invalid leaf size: %s\n", __progname,optarg);
+	exit (1);
+      }
+      break;
+
+    case 'B':
+      if ((readBlockSize = parseBlockSize(optarg)) == 0) {
+	fprintf(stderr,"%s: Invalid block size: %s\n", __progname,optarg);
+	exit (1);
+      }
+      break;
+
+    case 'D':
+      modeDirect = TRUE;
+      break;
+
+    case 'U':
+      modeBatch = TRUE;
+      break;
+
+    case 'G':
+#ifdef __UNIX
+      modeDevices = TRUE;
+#else
+      if (!modeSilent)
+	fprintf(stderr,"%s: -G is not supported by this build. Ignored.\n",
+		__progname);
+#endif
+      break;
+
+    case 'M':
+#ifdef __UNIX
+      modeMmap = TRUE;
+#else
+      if (!modeSilent)
+	fprintf(stderr,"%s: -M is not supported by this build. Ignored.\n",
+		__progname);
+#endif
+      break;
+
+    case 'A':
+#ifdef __UNIX
+      modePipeline = TRUE;
+#else
+      if (!modeSilent)
+	fprintf(stderr,"%s: -A is not supported by this build. Ignored.\n",
+		__progname);
+#endif
+      break;
+
+    case 'L':
+#ifdef MD5_MULTI_BUFFER
+      modeMultiBuffer = TRUE;
+#else
+      if (!modeSilent)
+	fprintf(stderr,"%s: -L is not supported by this build. Ignored.\n",
+		__progname);
+#endif
+      break;
+
     case 'm':
       modeMatch = TRUE;
       addMatchingFile(optarg);
       break;
 
+    case 'I':
+      indexFilename = optarg;
+      break;
+
+    case 'K':
+      modeCheckIndex = TRUE;
+      break;
+
+    case 'C':
+#ifdef __UNIX
+      cacheFilename = optarg;
+#else
+      if (!modeSilent)
+	fprintf(stderr,"%s: -C is not supported by this build. Ignored.\n",
+		__progname);
+#endif
+      break;
+
+    case 'y':
+      cacheVerifyRate = atof(optarg);
+      if (cacheVerifyRate <= 0 || cacheVerifyRate > 1) {
+	fprintf(stderr,"%s: Invalid fraction of files to recheck: %s\n",
+		__progname,optarg);
+	exit (1);
+      }
+      break;
+
+    case 'F':
+      filterRate = atof(optarg);
+      if (filterRate <= 0 || filterRate >= 1) {
+	fprintf(stderr,"%s: Invalid false positive rate: %s\n",
+		__progname,optarg);
+	exit (1);
+      }
+      break;
+
+    case 'c':
+      if ((digestMask = parseDigestList(optarg)) == 0) {
+	fprintf(stderr,"%s: Invalid list of digests: %s\n", __progname,optarg);
+	exit (1);
+      }
+      break;
+
+    case 'd':
+      modeDupes = TRUE;
+      break;
+
+    case 'S':
+      modeStats = TRUE;
+      break;
+
     case 's':
       modeSilent = TRUE;
       break;
@@ -468,6 +894,84 @@ void processCommandLine(int argc, char **argv) {
 
     }
   }
+
+  if (piecewiseSize && treeLeafSize) {
+    fprintf(stderr,"%s: -p and -T can't be used together\n", __progname);
+    exit (1);
+  }
+
+  if (modeDupes && (modeMatch || piecewiseSize || treeLeafSize)) {
+    fprintf(stderr,"%s: -d can't be used with -m, -p or -T\n", __progname);
+    exit (1);
+  }
+
+  /* Only the plain hashing knows about the other digests */
+  if (digestMask != DIGEST_MD5) {
+    if (modeDupes || piecewiseSize || treeLeafSize) {
+      fprintf(stderr,"%s: -c can't be used with -d, -p or -T\n", __progname);
+      exit (1);
+    }
+    if (modeMultiBuffer && !modeSilent)
+      fprintf(stderr,"%s: -L only computes MD5. Ignored.\n", __progname);
+    modeMultiBuffer = FALSE;
+    if (cacheFilename != NULL && !modeSilent)
+      fprintf(stderr,"%s: -C only keeps MD5 hashes. Ignored.\n", __progname);
+    cacheFilename = NULL;
+  }
+
+  /* In piecewise and tree modes we hash one file at a time and the
+     threads work on the pieces of that file instead */
+  if (piecewiseSize || treeLeafSize) {
+    if (modeMultiBuffer && !modeSilent)
+      fprintf(stderr,"%s: -L can't be used with -p or -T. Ignored.\n",
+	      __progname);
+    modeMultiBuffer = FALSE;
+    piecewiseThreads = threadCount;
+    threadCount = 1;
+  }
+
+  /* Several walkers find files in no particular order, and they can
+     only hand them to the hashing threads */
+  if (walkThreads > 1 && (modeOrdered || (threadCount == 1 && !modeMultiBuffer))) {
+    if (!modeSilent)
+      fprintf(stderr,"%s: -W needs -j or -L and can't be used with -O. "
+	      "Ignored.\n", __progname);
+    walkThreads = 1;
+  }
+
+  /* The disks are only read from at the same time by the hashing
+     threads */
+  if (modeDevices && threadCount == 1 && !modeMultiBuffer) {
+    if (!modeSilent)
+      fprintf(stderr,"%s: -G needs -j or -L. Ignored.\n", __progname);
+    modeDevices = FALSE;
+  }
+
+  /* We can only put the files from a directory back in order if we
+     hash them ourselves. Otherwise -O keeps the disk order. */
+  if (modePhysical && modeOrdered && !modeSilent &&
+      (threadCount > 1 || modeMultiBuffer || piecewiseSize || treeLeafSize))
+    fprintf(stderr,"%s: -O with -P prints files in disk order when used "
+	    "with -j, -L, -p or -T\n", __progname);
+
+  /* The batches are read by the main thread, and they don't bypass the
+     file cache */
+  if (modeBatch && (threadCount > 1 || modeMultiBuffer || piecewiseSize ||
+		    treeLeafSize || modeDupes || modeDirect)) {
+    if (!modeSilent)
+      fprintf(stderr,"%s: -U can't be used with -j, -L, -p, -T, -d or -D. "
+	      "Ignored.\n", __progname);
+    modeBatch = FALSE;
+  }
+
+  /* The progress display takes over the current line of stderr. If
+     several threads tried to use it at once, it would be unreadable. */
+  if (modeEstimate && (threadCount > 1 || modeMultiBuffer)) {
+    if (!modeSilent)
+      fprintf(stderr,"%s: -e can't be used with -j or -L. Ignored.\n",
+	      __progname);
+    modeEstimate = FALSE;
+  }
 }
 
 
@@ -518,6 +1022,25 @@ void processInput(char *arg, char *fn) {
   
 
 
+/* Tells the user the most memory we had at any one time */
+void printMemoryStats(void) {
+#ifdef __UNIX
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF,&usage))
+    return;
+
+  /* Everybody else counts in kilobytes */
+#ifdef __APPLE__
+  usage.ru_maxrss /= 1024;
+#endif
+
+  fprintf(stderr,"%s: At most %ld KB of memory was in use\n",
+	  __progname,(long)usage.ru_maxrss);
+#endif
+}
+
+
 int main(int argc, char **argv) {
 
   char *fn = (char*)malloc(sizeof(char)* PATH_MAX);
@@ -528,6 +1051,41 @@ int main(int argc, char **argv) {
 
   processCommandLine(argc,argv);
 
+  if (modeCheckIndex && !indexVerify())
+    exit (1);
+
+  if (indexFilename != NULL)
+    return !buildMatchIndex(indexFilename);
+
+  if (modeMatch)
+    buildMatchFilter();
+
+  if (cacheFilename != NULL && !cacheOpen(cacheFilename)) {
+    if (!modeSilent)
+      fprintf(stderr,"%s: Unable to use the hash cache\n", __progname);
+  }
+
+  if ((mainReader = readerInit()) == NULL) {
+    fprintf(stderr,"%s: Out of memory\n", __progname);
+    exit (1);
+  }
+
+  if ((threadCount > 1 || modeMultiBuffer) && !threadsInit(threadCount)) {
+    if (!modeSilent)
+      fprintf(stderr,"%s: Unable to start hashing threads. "
+	      "Using one thread.\n", __progname);
+    threadCount = 1;
+    modeMultiBuffer = FALSE;
+    walkThreads = 1;
+  }
+
+  if (modeBatch && !batchInit()) {
+    if (!modeSilent)
+      fprintf(stderr,"%s: Unable to use io_uring. Reading files one at a "
+	      "time.\n", __progname);
+    modeBatch = FALSE;
+  }
+
   /* Anything left on the command line at this point is a file
      or directory we're supposed to process */
   argv += optind;
@@ -541,6 +1099,32 @@ int main(int argc, char **argv) {
     argv++;
   }
 
+  if (modeBatch)
+    batchFinish();
+  threadsFinish();
+
+  if (modeDupes)
+    dupesReport();
+
+  cacheClose();
+
+  if (modeStats && modeMatch)
+    printMatchStats();
+  if (modeStats && cacheFilename != NULL)
+    printCacheStats();
+  if (modeStats && modeDupes)
+    printDupesStats();
+  if (modeStats && modeDevices)
+    printDeviceStats();
+  if (modeStats && modeBatch)
+    printBatchStats();
+  if (modeStats) {
+    printLinkStats();
+    printSparseStats();
+    printMemoryStats();
+  }
+
+  readerFree(mainReader);
   free(fn);
   return 0;
 }
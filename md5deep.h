@@ -42,6 +42,13 @@
 #define FALSE  0
 #define ONE_MEGABYTE  1048576
 
+/* How much of a file we read at once. Can be changed with -B */
+#define DEFAULT_BLOCK_SIZE   ONE_MEGABYTE
+#define MAX_BLOCK_SIZE       (64 * ONE_MEGABYTE)
+
+/* O_DIRECT needs buffers, offsets, and lengths lined up to this */
+#define DIRECT_ALIGNMENT     4096
+
 /* Strings have to be long enough to handle inputs from matched hashing files.
    The NSRL is already larger than 256 bytes. We go longer to be safer. */
 #define MAX_STRING_LENGTH    768
@@ -134,18 +141,204 @@ int asprintf(char **strp, const char *fmt, ...);
 
 
 
+/* Mode flags from md5deep.c. These are only changed while we parse
+   the command line. */
+extern int modeMatch, modeSilent, modeEstimate, modeRecursive, modeOrdered;
+extern int modeMultiBuffer, modeStats;
+extern int threadCount;
+
+
+/* Reading input files (reader.c). */
+typedef struct fileReader {
+  char *filename;
+  unsigned char *buf;
+  unsigned long size;
+  unsigned long long offset;
+#ifdef __UNIX
+  int fd;
+  bool direct;
+  struct readerPipeline *pipe;
+
+  /* Used for memory mapped files (mapped.c) */
+  bool mapped, reported;
+  volatile bool faulted;
+  unsigned char *map;
+  unsigned long long mapStart, mapLen, fileSize;
+  unsigned long window, pageSize;
+
+  /* Used for sparse files (sparse.c) */
+  bool sparse;
+  unsigned long long dataStart, holeStart, holeBytes;
+#else
+  FILE *f;
+#endif
+} fileReader;
+
+extern unsigned long readBlockSize;
+extern int modeDirect;
+
+unsigned long long parseSize(char *arg);
+unsigned long parseBlockSize(char *arg);
+fileReader *readerInit(void);
+void readerFree(fileReader *r);
+int readerOpen(fileReader *r, char *filename);
+int readerOpenAt(fileReader *r, int dirfd, char *name, char *filename);
+void readerClose(fileReader *r);
+int readerStat(fileReader *r, struct stat *info);
+long readerNext(fileReader *r, unsigned char **data);
+int readerFailed(fileReader *r);
+unsigned long long measureOpenFile(fileReader *r);
+
+
+/* Pipelined reading (pipeline.c). Only called by reader.c */
+extern int modePipeline;
+
+int pipelineInit(fileReader *r);
+void pipelineFree(fileReader *r);
+void pipelineStart(fileReader *r);
+void pipelineStop(fileReader *r);
+long pipelineNext(fileReader *r, unsigned char **data);
+
+
+/* Memory mapped reading (mapped.c). Only called by reader.c */
+extern int modeMmap;
+
+void mappedRegister(fileReader *r);
+void mappedUnregister(fileReader *r);
+int mappedOpen(fileReader *r);
+void mappedClose(fileReader *r);
+int mappedFailed(fileReader *r);
+long mappedNext(fileReader *r, unsigned char **data);
+
+
+/* Reading around the holes in sparse files (sparse.c). Only called by
+   reader.c, except for the statistics. */
+int sparseOpen(fileReader *r);
+void sparseClose(fileReader *r);
+long sparseNext(fileReader *r, unsigned char **data);
+void printSparseStats(void);
+
+
 /* Functions from md5deep.c */
 void printError(char *fn);
+void formatDigest(unsigned char sum[16], char *result);
+char *hashFile(fileReader *r, char *result);
+char *hashFileToLine(fileReader *r, char *filename);
+char *hashStatToLine(fileReader *r, char *filename, struct stat *info);
+char *hashFileAtToLine(fileReader *r, int dirfd, char *name, char *filename);
+char *makeOutputLine(char *filename, char *result);
+char *knownHash(char *filename, struct stat *info, char *result);
+char *lookupHash(struct stat *info, char *result);
+char *openedHash(fileReader *r, struct stat *info, char *result);
+int cannotMatch(struct stat *info);
+void rememberHash(char *filename, struct stat *info, char *result);
+void md5(char *filename);
+void md5At(int dirfd, char *name, char *filename);
+int fileStatus(mode_t mode);
+int isSpecialDirectory(char *d);
+void processDirectory(char *fn);
+void printMemoryStats(void);
+
+
+/* Directory walking (walk.c) */
+extern int walkThreads, modePhysical;
+extern fileReader *mainReader;
+
+
+/* Piecewise and tree hashing (piecewise.c) */
+extern unsigned long long piecewiseSize, treeLeafSize;
+extern int piecewiseThreads;
+
+void piecewiseFile(fileReader *r, char *filename);
+
+
+/* Functions for the hashing threads (threads.c) */
+extern int modeDevices;
+
+int threadsInit(int count);
+void threadsSubmit(char *filename);
+void threadsFinish(void);
+void printDeviceStats(void);
 
 
 /* Functions from matching (match.c) */
 int loadMatchFile(char *fn);
 int isKnownHash(char *h);
+int isKnownSize(unsigned long long size);
+int sizesLoaded(void);
+int buildMatchIndex(char *filename);
+void buildMatchFilter(void);
+void printMatchStats(void);
+extern double filterRate;
+
+
+/* Known hash indexes (index.c) */
+extern int modeCheckIndex;
+
+int indexVerify(void);
+
+
+/* Duplicate mode (dupes.c) */
+extern int modeDupes;
+
+void dupesAdd(char *filename, unsigned long long size);
+void dupesReport(void);
+void printDupesStats(void);
+
+
+/* Small file batches (batch.c) */
+extern int modeBatch;
+
+int batchInit(void);
+void batchAdd(char *filename);
+void batchFinish(void);
+void printBatchStats(void);
+
+
+/* Functions for the hash cache (cache.c) */
+int cacheOpen(char *filename);
+char *cacheLookup(struct stat *info, char *result);
+void cacheStore(char *filename, struct stat *info, char *result);
+void cacheClose(void);
+void printCacheStats(void);
+extern double cacheVerifyRate;
+
+
+/* Hard links (links.c) */
+int linkLookup(struct stat *info, char *result);
+void linkStore(struct stat *info, char *result);
+void printLinkStats(void);
+
+
+/* Arenas for lots of little strings that go away together (arena.c) */
+typedef struct arena {
+  struct arenaChunk *chunks;
+  char *next;
+  size_t left;
+} arena;
+
+void arenaInit(arena *a);
+void *arenaAlloc(arena *a, size_t len);
+char *arenaStrdup(arena *a, char *s);
+void arenaReset(arena *a);
+void arenaFree(arena *a);
 
 
 /* Functions for file evaluation (files.c) */
 int determineFileType(FILE *f);
+int determineLineType(char *buf);
+bool isPlainFile(char *buf);
+int plainHashLength(char *buf, char *end);
 bool findHashValueinLine(char *buf, int fileType);
+bool findDigestinLine(char *line, size_t len, int fileType,
+		      unsigned char *digest);
+bool findSizeinLine(char *line, size_t len, int fileType,
+		    unsigned long long *size);
+
+
+/* Scanning kernels for hash files (scan.c) */
+char *scanNthChar(char *buf, char *end, char c, int n);
+int scanHexDigest(char *buf, unsigned char *digest);
 
 
 
@@ -168,6 +361,8 @@ void MD5Update(struct MD5Context *context, unsigned char const *buf,
 	       unsigned len);
 void MD5Final(unsigned char digest[16], struct MD5Context *context);
 void MD5Transform(u_int32_t buf[4], u_int32_t const in[16]);
+void MD5TransformBlocks(u_int32_t buf[4], unsigned char const *data,
+			unsigned blocks);
 
 /*
  * This is needed to make RSAREF happy on some MS-DOS compilers.
@@ -175,6 +370,81 @@ void MD5Transform(u_int32_t buf[4], u_int32_t const in[16]);
 typedef struct MD5Context MD5_CTX;
 
 
+/* Multi-buffer MD5 (md5mb.c) needs the GCC vector extensions. The number
+   of lanes follows the widest vector unit the compiler was told about. */
+#ifdef __GNUC__
+#define MD5_MULTI_BUFFER
+
+#if defined(__AVX512F__)
+#define MD5_LANES   16
+#elif defined(__AVX2__)
+#define MD5_LANES    8
+#else
+#define MD5_LANES    4
+#endif
+
+typedef struct MD5MultiContext MD5MultiContext;
+
+MD5MultiContext *MD5MultiInit(void);
+void MD5MultiFree(MD5MultiContext *mb);
+int MD5MultiActive(MD5MultiContext *mb);
+int MD5MultiStart(MD5MultiContext *mb, char *filename, struct stat *info,
+		  void *tag);
+void MD5MultiCancel(MD5MultiContext *mb, void *tag);
+void *MD5MultiStep(MD5MultiContext *mb, char *result);
+
+#endif /* ifdef __GNUC__ */
+
+
+/* SHA-1 (sha1.c) and SHA-256 (sha256.c) */
+#define SHA1_HASH_LENGTH     20
+#define SHA256_HASH_LENGTH   32
+
+typedef struct SHA1Context {
+  u_int32_t state[5];
+  unsigned long long count;
+  unsigned char in[64];
+} SHA1_CTX;
+
+typedef struct SHA256Context {
+  u_int32_t state[8];
+  unsigned long long count;
+  unsigned char in[64];
+} SHA256_CTX;
+
+void SHA1Init(SHA1_CTX *ctx);
+void SHA1Update(SHA1_CTX *ctx, unsigned char const *buf, unsigned long len);
+void SHA1Final(unsigned char digest[SHA1_HASH_LENGTH], SHA1_CTX *ctx);
+void SHA256Init(SHA256_CTX *ctx);
+void SHA256Update(SHA256_CTX *ctx, unsigned char const *buf,
+		  unsigned long len);
+void SHA256Final(unsigned char digest[SHA256_HASH_LENGTH], SHA256_CTX *ctx);
+
+
+/* The set of digests we compute for each file (digest.c). The result
+   for a file has each digest in the set in hex, in this order,
+   separated by two spaces. The default is just MD5. */
+#define DIGEST_MD5      1
+#define DIGEST_SHA1     2
+#define DIGEST_SHA256   4
+
+#define DIGEST_STRING_LENGTH  (2 * (MD5_HASH_LENGTH + SHA1_HASH_LENGTH + \
+				    SHA256_HASH_LENGTH) + 5)
+
+typedef struct digestSet {
+  MD5_CTX md5;
+  SHA1_CTX sha1;
+  SHA256_CTX sha256;
+  struct digestHelpers *helpers;
+} digestSet;
+
+extern int digestMask;
+
+int parseDigestList(char *arg);
+void digestInit(digestSet *d, fileReader *r);
+void digestUpdate(digestSet *d, unsigned char *buf, unsigned long len);
+void digestFinal(digestSet *d, char *result);
+
 
 #endif /* __MD5DEEP_H */
 
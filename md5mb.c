@@ -0,0 +1,322 @@
+/* MD5DEEP - md5mb.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* Multi-buffer MD5. MD5 is serial within one stream of data, but there's
+   nothing stopping us from hashing several unrelated files at once. We
+   keep MD5_LANES files open and run the MD5 rounds for all of them
+   together, one file per lane of a vector register. The vector width
+   is chosen by the compiler flags: plain x86-64 gets SSE2 and 4 lanes,
+   -mavx2 gets 8 lanes and -mavx512f gets 16. See md5deep.h.
+
+   Each lane keeps a normal MD5Context. The vector code only ever
+   processes whole 64 byte blocks, so when a file ends we just hand the
+   last partial block to MD5Update and MD5Final like any other file.
+   Every lane has its own fileReader. They always hand us whole blocks
+   of readBlockSize bytes, which is a multiple of 64, until the end of
+   the file. */
+
+#ifdef MD5_MULTI_BUFFER
+
+typedef u_int32_t md5vec __attribute__ ((vector_size (MD5_LANES * 4)));
+
+typedef struct md5Lane {
+  fileReader *r;
+  void *tag;
+  bool active, atEOF;
+  struct MD5Context ctx;
+  unsigned char *data;
+  unsigned long len, pos;
+} md5Lane;
+
+struct MD5MultiContext {
+  md5Lane lane[MD5_LANES];
+};
+
+
+/* The per-step constants, message word index, and rotation for each of
+   the 64 steps of MD5. These are the same values that are written out
+   by hand in MD5Transform */
+static const u_int32_t T[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+  0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+  0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+  0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+  0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+  0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char W[64] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+  5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+  0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9
+};
+
+static const unsigned char S[4][4] = {
+  { 7, 12, 17, 22 },
+  { 5,  9, 14, 20 },
+  { 4, 11, 16, 23 },
+  { 6, 10, 15, 21 }
+};
+
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+/* The same step as MD5STEP in md5.c. All of the table lookups are
+   by constant index, so the compiler turns them into immediates. */
+#define MD5VSTEP(f, w, x, y, z, i, s) \
+	( w += f(x, y, z) + in[W[i]] + T[i],  w = w<<s | w>>(32-s),  w += x )
+
+#define MD5ROUND(f, i, r) \
+  MD5VSTEP(f, a, b, c, d, i,     S[r][0]); \
+  MD5VSTEP(f, d, a, b, c, i + 1, S[r][1]); \
+  MD5VSTEP(f, c, d, a, b, i + 2, S[r][2]); \
+  MD5VSTEP(f, b, c, d, a, i + 3, S[r][3])
+
+#define GETLE32(p) \
+  ((u_int32_t)(p)[0]         | (u_int32_t)(p)[1] << 8 | \
+   (u_int32_t)(p)[2] << 16   | (u_int32_t)(p)[3] << 24)
+
+
+/* Runs MD5Transform on one block from each of the lanes at once. Block
+   l of data is the block for lane l. Lanes that aren't active still get
+   computed, but nobody looks at the result. */
+static void MD5TransformLanes(md5vec state[4], unsigned char *data[MD5_LANES]) {
+
+  md5vec in[16], a, b, c, d;
+  int i, l;
+
+  for (i = 0 ; i < 16 ; i++)
+    for (l = 0 ; l < MD5_LANES ; l++)
+      in[i][l] = GETLE32(data[l] + 4 * i);
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+
+  MD5ROUND(F1,  0, 0);  MD5ROUND(F1,  4, 0);
+  MD5ROUND(F1,  8, 0);  MD5ROUND(F1, 12, 0);
+  MD5ROUND(F2, 16, 1);  MD5ROUND(F2, 20, 1);
+  MD5ROUND(F2, 24, 1);  MD5ROUND(F2, 28, 1);
+  MD5ROUND(F3, 32, 2);  MD5ROUND(F3, 36, 2);
+  MD5ROUND(F3, 40, 2);  MD5ROUND(F3, 44, 2);
+  MD5ROUND(F4, 48, 3);  MD5ROUND(F4, 52, 3);
+  MD5ROUND(F4, 56, 3);  MD5ROUND(F4, 60, 3);
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+
+void MD5MultiFree(MD5MultiContext *mb) {
+  int l;
+  for (l = 0 ; l < MD5_LANES ; l++)
+    readerFree(mb->lane[l].r);
+  free(mb);
+}
+
+
+MD5MultiContext *MD5MultiInit(void) {
+
+  int l;
+  MD5MultiContext *mb = (MD5MultiContext *)calloc(1,sizeof(MD5MultiContext));
+  if (mb == NULL)
+    return NULL;
+
+  for (l = 0 ; l < MD5_LANES ; l++) {
+    if ((mb->lane[l].r = readerInit()) == NULL) {
+      MD5MultiFree(mb);
+      return NULL;
+    }
+  }
+
+  return mb;
+}
+
+
+int MD5MultiActive(MD5MultiContext *mb) {
+  int l, count = 0;
+  for (l = 0 ; l < MD5_LANES ; l++)
+    if (mb->lane[l].active)
+      count++;
+  return count;
+}
+
+
+/* Starts hashing filename in a free lane. The caller must have checked
+   that MD5MultiActive is less than MD5_LANES. Tag is handed back by
+   MD5MultiStep when the file is done. Info is what the caller knows
+   about the file from knownHash. Returns FALSE if we couldn't open
+   the file. */
+int MD5MultiStart(MD5MultiContext *mb, char *filename, struct stat *info,
+		  void *tag) {
+
+  int l;
+  for (l = 0 ; l < MD5_LANES ; l++)
+    if (!mb->lane[l].active)
+      break;
+
+  if (!readerOpen(mb->lane[l].r,filename))
+    return FALSE;
+
+  /* If the caller didn't stat the file, info comes from the open file
+     so that it can be remembered once it's hashed */
+  if (info->st_nlink == 0 && !readerStat(mb->lane[l].r,info))
+    info->st_nlink = 0;
+
+  mb->lane[l].tag    = tag;
+  mb->lane[l].active = TRUE;
+  mb->lane[l].atEOF  = FALSE;
+  mb->lane[l].len    = 0;
+  mb->lane[l].pos    = 0;
+  MD5Init(&mb->lane[l].ctx);
+  return TRUE;
+}
+
+
+/* Stops hashing the file that was started with tag */
+void MD5MultiCancel(MD5MultiContext *mb, void *tag) {
+  int l;
+  for (l = 0 ; l < MD5_LANES ; l++)
+    if (mb->lane[l].active && mb->lane[l].tag == tag) {
+      readerClose(mb->lane[l].r);
+      mb->lane[l].active = FALSE;
+    }
+}
+
+
+/* Hashes the files in the lanes until one of them is done. The hash
+   of that file goes in result, which must hold 2 * MD5_HASH_LENGTH + 1
+   characters, and we return the tag it was started with. If there was
+   an error reading the file, result is set to the empty string.
+   Returns NULL if there aren't any active lanes. */
+void *MD5MultiStep(MD5MultiContext *mb, char *result) {
+
+  md5vec state[4];
+  unsigned char *data[MD5_LANES], sum[MD5_HASH_LENGTH];
+  unsigned long blocks, count, avail;
+  long got;
+  md5Lane *lane;
+  u_int32_t t;
+  int l, i, active, only = 0;
+
+  for (;;) {
+
+    active = 0;
+    blocks = ULONG_MAX;
+
+    for (l = 0 ; l < MD5_LANES ; l++) {
+
+      lane = &mb->lane[l];
+      if (!lane->active)
+	continue;
+
+      if (lane->pos == lane->len && !lane->atEOF) {
+	got = readerNext(lane->r,&lane->data);
+	lane->pos = 0;
+	lane->len = got < 0 ? 0 : got;
+	if (lane->len < lane->r->size)
+	  lane->atEOF = TRUE;
+
+	if (got < 0) {
+	  /* The reader has already printed an error */
+	  result[0] = 0;
+	  readerClose(lane->r);
+	  lane->active = FALSE;
+	  return lane->tag;
+	}
+      }
+
+      avail = lane->len - lane->pos;
+
+      /* Whatever is left of this file fits inside one block.
+	 We can finish it off without the vector code. */
+      if (lane->atEOF && avail < 64) {
+	MD5Update(&lane->ctx,lane->data + lane->pos,avail);
+	MD5Final(sum,&lane->ctx);
+	formatDigest(sum,result);
+	if (readerFailed(lane->r))
+	  result[0] = 0;
+	readerClose(lane->r);
+	lane->active = FALSE;
+	return lane->tag;
+      }
+
+      if (avail / 64 < blocks)
+	blocks = avail / 64;
+      only = l;
+      active++;
+    }
+
+    if (active == 0)
+      return NULL;
+
+    /* There's no point in running all of the lanes for one file */
+    if (active == 1) {
+      lane = &mb->lane[only];
+      MD5Update(&lane->ctx,lane->data + lane->pos,blocks * 64);
+      lane->pos += blocks * 64;
+      continue;
+    }
+
+    for (i = 0 ; i < 4 ; i++)
+      for (l = 0 ; l < MD5_LANES ; l++)
+	state[i][l] = mb->lane[l].ctx.buf[i];
+
+    /* Idle lanes just follow along on the data of an active one so
+       that we never read outside of a buffer */
+    for (count = 0 ; count < blocks ; count++) {
+      for (l = 0 ; l < MD5_LANES ; l++) {
+	lane = mb->lane[l].active ? &mb->lane[l] : &mb->lane[only];
+	data[l] = lane->data + lane->pos + count * 64;
+      }
+      MD5TransformLanes(state,data);
+    }
+
+    for (l = 0 ; l < MD5_LANES ; l++) {
+
+      lane = &mb->lane[l];
+      if (!lane->active)
+	continue;
+
+      for (i = 0 ; i < 4 ; i++)
+	lane->ctx.buf[i] = state[i][l];
+      lane->pos += blocks * 64;
+
+      /* Update the bit count the same way MD5Update would have */
+      t = lane->ctx.bits[0];
+      if ((lane->ctx.bits[0] = t + ((u_int32_t)blocks << 9)) < t)
+	lane->ctx.bits[1]++;
+      lane->ctx.bits[1] += blocks >> 23;
+    }
+  }
+}
+
+#endif /* ifdef MD5_MULTI_BUFFER */
@@ -0,0 +1,506 @@
+/* MD5DEEP - piecewise.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* Piecewise hashing (-p). We print the MD5 of every piecewiseSize bytes
+   of the file, with the range of offsets it covers, followed by the MD5
+   of the whole file as usual. If part of a big disk image is acquired
+   again later, it can be checked against the pieces.
+
+   Tree hashing (-T). The file is split into leaves of treeLeafSize
+   bytes and the leaves are combined into a tree digest, which is
+   printed in a second column after the normal MD5. Unlike the MD5 of
+   the whole file, every leaf can be hashed at the same time. The tree
+   is the one from RFC 6962 with MD5 in place of SHA-256:
+
+     leaf     = MD5(0x00 || leaf data)
+     node     = MD5(0x01 || left child || right child)
+     tree(n)  = the tree of the first k leaves on the left and the
+		rest of the leaves on the right, where k is the largest
+		power of two smaller than n. The tree of one leaf is the
+		leaf. The tree of an empty file is the MD5 of nothing.
+
+   On *nix the pieces are hashed by a team of threads, one per -j, that
+   each grab the next piece nobody has started on and read it with
+   pread. While they do that the calling thread reads the file from the
+   start with its own reader to get the hash of the whole file. That
+   way one huge file can keep every processor busy. The pieces are
+   handed on in order as they finish. As with threads.c, we never let
+   the team get more than PIECES_PER_THREAD times the number of threads
+   ahead of the oldest piece that hasn't been handed on yet.
+
+   Everywhere else, or if we can't tell how big the file is, we do the
+   pieces and the whole file in one pass with the reader. */
+
+#ifdef __UNIX
+#include <pthread.h>
+#include <fcntl.h>
+
+#define PIECES_PER_THREAD   4
+#endif
+
+/* Enough levels for 2^64 leaves */
+#define MAX_TREE_DEPTH     64
+
+unsigned long long piecewiseSize = 0;
+unsigned long long treeLeafSize = 0;
+int piecewiseThreads = 1;
+
+
+/* Where the finished pieces of a file go. When building a tree, the
+   nodes we haven't been able to combine yet are kept on a stack. Each
+   one is the root of a complete tree with leaves[i] leaves, and they
+   get smaller towards the top. */
+typedef struct pieceSink {
+  char *filename;
+  bool failed;
+  int depth;
+  unsigned char node[MAX_TREE_DEPTH][MD5_HASH_LENGTH];
+  unsigned long long leaves[MAX_TREE_DEPTH];
+} pieceSink;
+
+
+static unsigned long long pieceSize(void) {
+  return treeLeafSize ? treeLeafSize : piecewiseSize;
+}
+
+
+static void startPiece(MD5_CTX *md) {
+  static unsigned char leafPrefix = 0;
+  MD5Init(md);
+  if (treeLeafSize)
+    MD5Update(md,&leafPrefix,1);
+}
+
+
+/* Replaces the top two nodes on the stack with their parent */
+static void combineNodes(pieceSink *sink) {
+
+  static unsigned char nodePrefix = 1;
+  unsigned char *left  = sink->node[sink->depth - 2];
+  unsigned char *right = sink->node[sink->depth - 1];
+  MD5_CTX md;
+
+  MD5Init(&md);
+  MD5Update(&md,&nodePrefix,1);
+  MD5Update(&md,left,MD5_HASH_LENGTH);
+  MD5Update(&md,right,MD5_HASH_LENGTH);
+  MD5Final(left,&md);
+
+  sink->leaves[sink->depth - 2] += sink->leaves[sink->depth - 1];
+  sink->depth--;
+}
+
+
+/* Prints the line for one piece. The piece is len bytes starting at
+   start. In matching mode we only print the piece if it's known. */
+static void printPiece(char *filename, char *result,
+		       unsigned long long start, unsigned long long len) {
+
+  char *name, *line;
+
+  if (asprintf(&name,"%s offset %llu-%llu",filename,start,start + len - 1) < 0)
+    return;
+
+  if ((line = makeOutputLine(name,result)) != NULL) {
+    fputs(line,stdout);
+    free(line);
+  }
+  free(name);
+}
+
+
+/* Called for every piece of the file in order. Sum is NULL if the
+   piece couldn't be read, in which case the error has been reported. */
+static void pieceDone(pieceSink *sink, unsigned long long n,
+		      unsigned long long len, unsigned char *sum) {
+
+  char result[2 * MD5_HASH_LENGTH + 1];
+
+  if (sum == NULL) {
+    sink->failed = TRUE;
+    return;
+  }
+
+  if (!treeLeafSize) {
+    formatDigest(sum,result);
+    printPiece(sink->filename,result,n * piecewiseSize,len);
+    return;
+  }
+
+  memcpy(sink->node[sink->depth],sum,MD5_HASH_LENGTH);
+  sink->leaves[sink->depth] = 1;
+  sink->depth++;
+
+  while (sink->depth >= 2 &&
+	 sink->leaves[sink->depth - 2] == sink->leaves[sink->depth - 1])
+    combineNodes(sink);
+}
+
+
+/* Writes the tree digest into tree once all of the leaves are in */
+static void finishTree(pieceSink *sink, char *tree) {
+
+  unsigned char sum[MD5_HASH_LENGTH];
+  MD5_CTX md;
+
+  if (sink->depth == 0) {
+    MD5Init(&md);
+    MD5Final(sum,&md);
+    formatDigest(sum,tree);
+    return;
+  }
+
+  while (sink->depth >= 2)
+    combineNodes(sink);
+  formatDigest(sink->node[0],tree);
+}
+
+
+/* Returns the line to display for a file in tree mode. In matching
+   mode the file is known if either of its hashes is. */
+static char *makeTreeLine(char *filename, char *result, char *tree) {
+
+  char *line = NULL;
+
+  if (modeMatch) {
+    if (isKnownHash(result) || isKnownHash(tree))
+      asprintf(&line,"%s\n",filename);
+  } else {
+    asprintf(&line,"%s  %s  %s\n",result,tree,filename);
+  }
+
+  return line;
+}
+
+
+/* Hashes the pieces and the whole file in one pass */
+static char *piecewiseSerial(fileReader *r, pieceSink *sink, char *result) {
+
+  MD5_CTX whole, piece;
+  unsigned char sum[MD5_HASH_LENGTH], *buf;
+  unsigned long long n = 0, used = 0, take, size = pieceSize();
+  long len;
+
+  MD5Init(&whole);
+  startPiece(&piece);
+
+  while ((len = readerNext(r,&buf)) > 0) {
+
+    MD5Update(&whole,buf,len);
+
+    while (len > 0) {
+      take = size - used;
+      if (take > (unsigned long long)len)
+	take = len;
+
+      MD5Update(&piece,buf,take);
+      used += take;
+      buf  += take;
+      len  -= take;
+
+      if (used == size) {
+	MD5Final(sum,&piece);
+	pieceDone(sink,n++,used,sum);
+	used = 0;
+	startPiece(&piece);
+      }
+    }
+  }
+
+  if (len < 0 || readerFailed(r))
+    return NULL;
+
+  if (used > 0) {
+    MD5Final(sum,&piece);
+    pieceDone(sink,n,used,sum);
+  }
+
+  MD5Final(sum,&whole);
+  formatDigest(sum,result);
+  return result;
+}
+
+
+#ifdef __UNIX
+
+typedef struct pieceJob {
+
+  pieceSink *sink;
+  int fd;
+  unsigned long long fileSize, size, count;
+
+  /* The next piece nobody has started and the next one to hand on.
+     Slot (piece % window) holds a finished piece until then. */
+  unsigned long long next, finished;
+  unsigned long window;
+  unsigned char (*sums)[MD5_HASH_LENGTH];
+  bool *done, *ok;
+
+  struct pieceWorker *team;
+  int teamSize, started;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} pieceJob;
+
+typedef struct pieceWorker {
+  pieceJob *job;
+  pthread_t thread;
+  unsigned char *buf;
+} pieceWorker;
+
+
+static unsigned long long pieceLength(pieceJob *job, unsigned long long n) {
+  unsigned long long start = n * job->size;
+  if (job->fileSize - start < job->size)
+    return job->fileSize - start;
+  return job->size;
+}
+
+
+/* Hashes piece n into sum. Returns FALSE on a read error. */
+static int hashPiece(pieceJob *job, unsigned char *buf,
+		     unsigned long long n, unsigned char *sum) {
+
+  unsigned long long offset = n * job->size;
+  unsigned long long end = offset + pieceLength(job,n);
+  unsigned long want;
+  ssize_t count;
+  MD5_CTX md;
+
+  startPiece(&md);
+
+  while (offset < end) {
+
+    want = readBlockSize;
+    if (end - offset < want)
+      want = end - offset;
+
+    if ((count = pread(job->fd,buf,want,offset)) < 0) {
+      if (errno == EINTR)
+	continue;
+      return FALSE;
+    }
+
+    /* The file got shorter while we were hashing it */
+    if (count == 0) {
+      errno = EIO;
+      return FALSE;
+    }
+
+    MD5Update(&md,buf,count);
+    offset += count;
+  }
+
+  MD5Final(sum,&md);
+  return TRUE;
+}
+
+
+/* Hands on every piece at the front of the window that is done.
+   Must be called with the lock held. */
+static void finishedPieces(pieceJob *job) {
+
+  unsigned long slot;
+
+  while (job->finished < job->count &&
+	 job->done[slot = job->finished % job->window]) {
+
+    pieceDone(job->sink,job->finished,pieceLength(job,job->finished),
+	      job->ok[slot] ? job->sums[slot] : NULL);
+
+    job->done[slot] = FALSE;
+    job->finished++;
+  }
+}
+
+
+static void *pieceThread(void *arg) {
+
+  pieceWorker *me = (pieceWorker *)arg;
+  pieceJob *job = me->job;
+  unsigned char sum[MD5_HASH_LENGTH];
+  unsigned long long n;
+  unsigned long slot;
+  bool ok;
+
+  pthread_mutex_lock(&job->lock);
+
+  for (;;) {
+
+    while (job->next < job->count && job->next >= job->finished + job->window)
+      pthread_cond_wait(&job->changed,&job->lock);
+    if (job->next >= job->count)
+      break;
+
+    n = job->next++;
+    pthread_mutex_unlock(&job->lock);
+
+    if (!(ok = hashPiece(job,me->buf,n,sum)))
+      printError(job->sink->filename);
+
+    pthread_mutex_lock(&job->lock);
+    slot = n % job->window;
+    memcpy(job->sums[slot],sum,MD5_HASH_LENGTH);
+    job->ok[slot] = ok;
+    job->done[slot] = TRUE;
+    finishedPieces(job);
+    pthread_cond_broadcast(&job->changed);
+  }
+
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+
+static void freeJob(pieceJob *job) {
+  int i;
+  if (job->team != NULL)
+    for (i = 0 ; i < job->teamSize ; i++)
+      free(job->team[i].buf);
+  free(job->team);
+  free(job->sums);
+  free(job->done);
+  free(job->ok);
+  if (job->fd >= 0)
+    close(job->fd);
+}
+
+
+/* Gets the team going on the pieces of the file. Returns FALSE if we
+   couldn't, in which case nothing has been started. */
+static int startPieces(pieceJob *job, pieceSink *sink,
+		       unsigned long long fileSize) {
+
+  int i;
+
+  memset(job,0,sizeof(*job));
+  job->sink     = sink;
+  job->fileSize = fileSize;
+  job->size     = pieceSize();
+  job->count    = (fileSize + job->size - 1) / job->size;
+  job->teamSize = piecewiseThreads;
+  job->window   = piecewiseThreads * PIECES_PER_THREAD;
+
+  /* The team reads with its own descriptor so that it doesn't get in
+     the way of the reader, whatever that happens to be doing */
+  if ((job->fd = open(sink->filename,O_RDONLY)) < 0)
+    return FALSE;
+
+  job->team = (pieceWorker *)calloc(job->teamSize,sizeof(pieceWorker));
+  job->sums = calloc(job->window,sizeof(*job->sums));
+  job->done = (bool *)calloc(job->window,sizeof(bool));
+  job->ok   = (bool *)calloc(job->window,sizeof(bool));
+  if (job->team == NULL || job->sums == NULL ||
+      job->done == NULL || job->ok == NULL) {
+    freeJob(job);
+    return FALSE;
+  }
+
+  for (i = 0 ; i < job->teamSize ; i++) {
+    job->team[i].job = job;
+    if ((job->team[i].buf = (unsigned char *)malloc(readBlockSize)) == NULL) {
+      freeJob(job);
+      return FALSE;
+    }
+  }
+
+  pthread_mutex_init(&job->lock,NULL);
+  pthread_cond_init(&job->changed,NULL);
+
+  /* If we can't start all of them, the ones we did start will just
+     have to do all of the work */
+  for (i = 0 ; i < job->teamSize ; i++) {
+    if (pthread_create(&job->team[i].thread,NULL,pieceThread,&job->team[i]))
+      break;
+    job->started++;
+  }
+
+  if (job->started == 0) {
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->changed);
+    freeJob(job);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+static void finishPieces(pieceJob *job) {
+
+  int i;
+
+  for (i = 0 ; i < job->started ; i++)
+    pthread_join(job->team[i].thread,NULL);
+
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->changed);
+  freeJob(job);
+}
+
+#endif /* ifdef __UNIX */
+
+
+/* Hashes filename piecewise or as a tree with r and prints the results */
+void piecewiseFile(fileReader *r, char *filename) {
+
+  char result[DIGEST_STRING_LENGTH], tree[2 * MD5_HASH_LENGTH + 1];
+  char *line, *status;
+  unsigned long long fileSize;
+  pieceSink sink;
+
+#ifdef __UNIX
+  pieceJob job;
+#endif
+
+  if (!readerOpen(r,filename))
+    return;
+
+  sink.filename = filename;
+  sink.failed = FALSE;
+  sink.depth = 0;
+
+  fileSize = measureOpenFile(r);
+
+#ifdef __UNIX
+  if (fileSize != (unsigned long long)-1 &&
+      startPieces(&job,&sink,fileSize)) {
+    status = hashFile(r,result);
+    finishPieces(&job);
+  } else
+#endif
+    status = piecewiseSerial(r,&sink,result);
+
+  readerClose(r);
+
+  if (status == NULL)
+    return;
+
+  /* A tree with a missing leaf is no good to anybody */
+  if (treeLeafSize) {
+    if (sink.failed)
+      return;
+    finishTree(&sink,tree);
+    line = makeTreeLine(filename,result,tree);
+  } else {
+    line = makeOutputLine(filename,result);
+  }
+
+  if (line != NULL) {
+    fputs(line,stdout);
+    free(line);
+  }
+}
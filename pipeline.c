@@ -0,0 +1,397 @@
+/* MD5DEEP - pipeline.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+#include "uring.h"
+
+/* Pipelined reading (-A). When we read a file one block at a time, the
+   disk sits idle while we hash and the processor sits idle while we
+   read. Here each reader has a ring of PIPELINE_DEPTH buffers. As soon
+   as a file is opened we start reading the first few blocks into them.
+   Every time the hashing code asks for the next block, the buffer it
+   was using before goes back into the ring to read the block after the
+   last one we asked for. That way reads are always in progress while
+   we hash.
+
+   The reads are done with io_uring when the kernel has it. Otherwise
+   each reader gets a helper thread that fills the buffers with pread.
+
+   Block k of the file always goes in buffer k % PIPELINE_DEPTH and
+   buffers are refilled in order, so the helper thread can just work
+   its way around the ring. */
+
+#ifdef __UNIX
+
+#include <pthread.h>
+#include <fcntl.h>
+
+#define PIPELINE_DEPTH   4
+
+int modePipeline = FALSE;
+
+struct readerPipeline {
+
+  unsigned char *buf[PIPELINE_DEPTH];
+  unsigned long long offset[PIPELINE_DEPTH];
+  long len[PIPELINE_DEPTH];
+  bool requested[PIPELINE_DEPTH], ready[PIPELINE_DEPTH];
+
+  /* The buffer we'll hand out next, the one we handed out last time,
+     and the offset of the next block nobody has asked for yet */
+  int head, last;
+  unsigned long long nextOffset;
+  int inFlight;
+  bool stopped;
+
+#ifdef HAVE_IO_URING
+  bool useUring;
+  uring ring;
+  struct iovec iov[PIPELINE_DEPTH];
+#endif
+
+  /* Used by the helper thread. The lock protects everything above
+     when the helper thread is running. */
+  pthread_t helper;
+  bool haveHelper, quit;
+  int fd, helperNext;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+
+/* Fills the rest of a buffer that came back short. Some filesystems
+   give us short reads before the end of the file, and we promise the
+   hashing code whole blocks. */
+static long fillBlock(fileReader *r, int fd, unsigned char *buf,
+		      unsigned long long offset, long got) {
+
+  ssize_t count;
+
+  while (got >= 0 && got < (long)r->size) {
+
+    count = pread(fd,buf + got,r->size - got,offset + got);
+
+    if (count < 0) {
+      if (errno == EINTR)
+	continue;
+
+#ifdef O_DIRECT
+      /* See readFully in reader.c */
+      if (errno == EINVAL && r->direct) {
+	fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) & ~O_DIRECT);
+	r->direct = FALSE;
+	continue;
+      }
+#endif
+      return -errno;
+    }
+
+    if (count == 0)
+      break;
+    got += count;
+
+    if (r->direct && (got % DIRECT_ALIGNMENT))
+      break;
+  }
+
+  return got;
+}
+
+
+static void *helperThread(void *arg) {
+
+  fileReader *r = (fileReader *)arg;
+  struct readerPipeline *p = r->pipe;
+  unsigned long long offset;
+  unsigned char *buf;
+  int slot, fd;
+  long got;
+
+  pthread_mutex_lock(&p->lock);
+
+  for (;;) {
+
+    while (!p->quit && !p->requested[p->helperNext])
+      pthread_cond_wait(&p->changed,&p->lock);
+    if (p->quit)
+      break;
+
+    slot   = p->helperNext;
+    fd     = p->fd;
+    buf    = p->buf[slot];
+    offset = p->offset[slot];
+    pthread_mutex_unlock(&p->lock);
+
+    got = fillBlock(r,fd,buf,offset,0);
+
+    pthread_mutex_lock(&p->lock);
+    p->len[slot] = got;
+    p->requested[slot] = FALSE;
+    p->ready[slot] = TRUE;
+    p->inFlight--;
+    p->helperNext = (slot + 1) % PIPELINE_DEPTH;
+    pthread_cond_broadcast(&p->changed);
+  }
+
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+
+/* Starts reading the block at nextOffset into buffer slot */
+static void request(fileReader *r, int slot) {
+
+  struct readerPipeline *p = r->pipe;
+  unsigned long long offset = p->nextOffset;
+
+#ifdef HAVE_IO_URING
+  struct io_uring_sqe *sqe;
+#endif
+
+  p->nextOffset += r->size;
+
+#ifdef HAVE_IO_URING
+  if (p->useUring) {
+    p->offset[slot] = offset;
+    p->ready[slot] = FALSE;
+    p->inFlight++;
+
+    /* There's always room as we never have more than PIPELINE_DEPTH
+       reads going at once */
+    sqe = uringGetSqe(&p->ring);
+    sqe->opcode    = IORING_OP_READV;
+    sqe->fd        = r->fd;
+    sqe->addr      = (unsigned long)&p->iov[slot];
+    sqe->len       = 1;
+    sqe->off       = p->offset[slot];
+    sqe->user_data = slot;
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&p->lock);
+  p->offset[slot] = offset;
+  p->ready[slot] = FALSE;
+  p->inFlight++;
+  p->requested[slot] = TRUE;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+
+
+#ifdef HAVE_IO_URING
+/* Collects completed reads. If wait is TRUE, we wait for at least one. */
+static void reap(fileReader *r, bool wait) {
+
+  struct readerPipeline *p = r->pipe;
+  struct io_uring_cqe *cqe;
+  int slot;
+
+  uringSubmit(&p->ring,wait ? 1 : 0);
+
+  while ((cqe = uringPeek(&p->ring)) != NULL) {
+
+    slot = cqe->user_data;
+    p->len[slot] = cqe->res;
+    uringSeen(&p->ring);
+
+    /* Short reads and O_DIRECT trouble get sorted out the slow way */
+    if (p->len[slot] >= 0 || p->len[slot] == -EINVAL)
+      p->len[slot] = fillBlock(r,r->fd,p->buf[slot],p->offset[slot],
+			       p->len[slot] < 0 ? 0 : p->len[slot]);
+
+    p->ready[slot] = TRUE;
+    p->inFlight--;
+  }
+}
+#endif
+
+
+/* Waits until buffer slot has been filled */
+static void waitFor(fileReader *r, int slot) {
+
+  struct readerPipeline *p = r->pipe;
+
+#ifdef HAVE_IO_URING
+  if (p->useUring) {
+    reap(r,FALSE);
+    while (!p->ready[slot])
+      reap(r,TRUE);
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&p->lock);
+  while (!p->ready[slot])
+    pthread_cond_wait(&p->changed,&p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+
+int pipelineInit(fileReader *r) {
+
+  struct readerPipeline *p;
+  int i;
+
+  if ((p = (struct readerPipeline *)calloc(1,sizeof(*p))) == NULL)
+    return FALSE;
+  r->pipe = p;
+
+  for (i = 0 ; i < PIPELINE_DEPTH ; i++) {
+    if (posix_memalign((void **)&p->buf[i],DIRECT_ALIGNMENT,r->size)) {
+      p->buf[i] = NULL;
+      pipelineFree(r);
+      return FALSE;
+    }
+  }
+
+#ifdef HAVE_IO_URING
+  if (uringInit(&p->ring,PIPELINE_DEPTH)) {
+    p->useUring = TRUE;
+    for (i = 0 ; i < PIPELINE_DEPTH ; i++) {
+      p->iov[i].iov_base = p->buf[i];
+      p->iov[i].iov_len  = r->size;
+    }
+    return TRUE;
+  }
+#endif
+
+  pthread_mutex_init(&p->lock,NULL);
+  pthread_cond_init(&p->changed,NULL);
+  if (pthread_create(&p->helper,NULL,helperThread,r)) {
+    pipelineFree(r);
+    return FALSE;
+  }
+  p->haveHelper = TRUE;
+
+  return TRUE;
+}
+
+
+void pipelineFree(fileReader *r) {
+
+  struct readerPipeline *p = r->pipe;
+  int i;
+
+  if (p == NULL)
+    return;
+
+  if (p->haveHelper) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = TRUE;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->helper,NULL);
+  }
+
+#ifdef HAVE_IO_URING
+  if (p->useUring)
+    uringFree(&p->ring);
+#endif
+
+  for (i = 0 ; i < PIPELINE_DEPTH ; i++)
+    free(p->buf[i]);
+  free(p);
+  r->pipe = NULL;
+}
+
+
+/* Called once the file is open. Starts reading the first blocks. */
+void pipelineStart(fileReader *r) {
+
+  struct readerPipeline *p = r->pipe;
+  int slot;
+
+  p->head = 0;
+  p->last = -1;
+  p->nextOffset = 0;
+  p->stopped = FALSE;
+
+  if (p->haveHelper) {
+    pthread_mutex_lock(&p->lock);
+    p->fd = r->fd;
+    p->helperNext = 0;
+    pthread_mutex_unlock(&p->lock);
+  }
+
+  for (slot = 0 ; slot < PIPELINE_DEPTH ; slot++)
+    request(r,slot);
+}
+
+
+/* Called before the file is closed. We have to wait for any reads that
+   are still going on, as they're using our buffers and the descriptor. */
+void pipelineStop(fileReader *r) {
+
+  struct readerPipeline *p = r->pipe;
+  int slot;
+
+#ifdef HAVE_IO_URING
+  if (p->useUring) {
+    while (p->inFlight > 0)
+      reap(r,TRUE);
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&p->lock);
+  while (p->inFlight > 0)
+    pthread_cond_wait(&p->changed,&p->lock);
+  for (slot = 0 ; slot < PIPELINE_DEPTH ; slot++)
+    p->ready[slot] = FALSE;
+  pthread_mutex_unlock(&p->lock);
+}
+
+
+/* Works just like readerNext, but hands out the buffers from the ring */
+long pipelineNext(fileReader *r, unsigned char **data) {
+
+  struct readerPipeline *p = r->pipe;
+  int slot;
+  long len;
+
+  /* We've already handed out the last block of this file */
+  if (p->stopped) {
+    *data = p->buf[p->head];
+    return 0;
+  }
+
+  /* The hashing code is done with the buffer we gave it last time,
+     so it can go read the next block we haven't asked for yet. */
+  if (p->last >= 0)
+    request(r,p->last);
+
+  slot = p->head;
+  waitFor(r,slot);
+
+  len = p->len[slot];
+  *data = p->buf[slot];
+  p->ready[slot] = FALSE;
+  p->last = slot;
+  p->head = (slot + 1) % PIPELINE_DEPTH;
+
+  /* Once we've seen the end of the file or an error there's no point
+     in asking for more. The reads already going will just come back
+     empty. */
+  if (len < (long)r->size)
+    p->stopped = TRUE;
+
+  if (len < 0) {
+    errno = -len;
+    return -1;
+  }
+
+  return len;
+}
+
+#endif /* ifdef __UNIX */
@@ -0,0 +1,394 @@
+/* MD5DEEP - reader.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* All of the reading of input files goes through here. A fileReader
+   owns one buffer of readBlockSize bytes and is reused for file after
+   file, so we don't allocate a big buffer for every small file. Each
+   hashing thread has its own reader.
+
+   On *nix we read with read(2) on a descriptor. That skips the copy
+   through the stdio buffer and lets us tell the kernel how we're going
+   to use the file. With -D we also try to bypass the page cache
+   entirely using O_DIRECT. With -A the reading is handed off to
+   pipeline.c so that it overlaps with the hashing, and with -M regular
+   files are memory mapped by mapped.c instead of read. Files with big
+   holes in them are read around the holes by sparse.c. Everywhere else
+   we use plain stdio. */
+
+#ifdef __UNIX
+#include <fcntl.h>
+#endif
+
+unsigned long readBlockSize = DEFAULT_BLOCK_SIZE;
+int modeDirect = FALSE;
+
+
+/* Parses a size like "4096", "64k", "16m" or "2g". Returns 0 if the
+   size is invalid. */
+unsigned long long parseSize(char *arg) {
+
+  char *end;
+  unsigned long long size = strtoull(arg,&end,10);
+
+  switch (tolower(*end)) {
+  case 'k':
+    size *= 1024;
+    end++;
+    break;
+  case 'm':
+    size *= ONE_MEGABYTE;
+    end++;
+    break;
+  case 'g':
+    size *= 1024 * ONE_MEGABYTE;
+    end++;
+    break;
+  }
+
+  if (*end != 0 || !isdigit(*arg))
+    return 0;
+
+  return size;
+}
+
+
+/* Parses a block size for -B. The result is rounded up to a multiple
+   of DIRECT_ALIGNMENT, which is also a multiple of the 64 byte MD5
+   block size. Returns 0 if the size is invalid. */
+unsigned long parseBlockSize(char *arg) {
+
+  unsigned long long size = parseSize(arg);
+
+  if (size == 0 || size > MAX_BLOCK_SIZE)
+    return 0;
+
+  return ((size + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT) * DIRECT_ALIGNMENT;
+}
+
+
+fileReader *readerInit(void) {
+
+  fileReader *r = (fileReader *)calloc(1,sizeof(fileReader));
+  if (r == NULL)
+    return NULL;
+
+  r->size = readBlockSize;
+
+#ifdef __UNIX
+  r->fd = -1;
+
+  if (modeMmap)
+    mappedRegister(r);
+
+  /* The pipeline has its own buffers. If we can't get it going, we
+     just read the normal way. */
+  if (modePipeline && pipelineInit(r))
+    return r;
+
+  /* O_DIRECT needs the buffer to be aligned. We do it every time
+     as it doesn't cost us anything. */
+  if (posix_memalign((void **)&r->buf,DIRECT_ALIGNMENT,r->size))
+    r->buf = NULL;
+#else
+  r->buf = (unsigned char *)malloc(r->size);
+#endif
+
+  if (r->buf == NULL) {
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+
+void readerFree(fileReader *r) {
+  if (r == NULL)
+    return;
+  readerClose(r);
+#ifdef __UNIX
+  pipelineFree(r);
+  mappedUnregister(r);
+#endif
+  free(r->buf);
+  free(r);
+}
+
+
+int readerOpen(fileReader *r, char *filename) {
+
+#ifdef __UNIX
+
+  return readerOpenAt(r,AT_FDCWD,filename,filename);
+
+#else
+
+  r->filename = filename;
+  r->offset = 0;
+
+  if ((r->f = fopen(filename,"rb")) == NULL) {
+    printError(filename);
+    return FALSE;
+  }
+
+  return TRUE;
+
+#endif
+}
+
+
+#ifdef __UNIX
+
+/* Opens the file called name in the directory we have open on dirfd,
+   which is how the walk finds files without looking up their whole
+   path again. Filename is the whole path, for messages and output.
+   Somebody could put a symlink where the file was after we read the
+   directory, so we won't follow one there. */
+int readerOpenAt(fileReader *r, int dirfd, char *name, char *filename) {
+
+  int flags = O_RDONLY;
+
+  r->filename = filename;
+  r->offset = 0;
+  r->direct = FALSE;
+
+#ifdef O_NOFOLLOW
+  if (dirfd != AT_FDCWD)
+    flags |= O_NOFOLLOW;
+#endif
+
+#ifdef O_DIRECT
+  if (modeDirect) {
+    if ((r->fd = openat(dirfd,name,flags | O_DIRECT)) >= 0)
+      r->direct = TRUE;
+  }
+#endif
+
+  /* Not every filesystem supports O_DIRECT. If it failed we try again
+     the normal way and drop the pages behind us as we go instead. */
+  if (!r->direct && (r->fd = openat(dirfd,name,flags)) < 0) {
+    printError(filename);
+    return FALSE;
+  }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(r->fd,0,0,POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(r->fd,0,0,POSIX_FADV_NOREUSE);
+#endif
+
+  if (sparseOpen(r))
+    return TRUE;
+
+  /* Files we can't map still get read the normal way */
+  if (modeMmap && mappedOpen(r))
+    return TRUE;
+
+  if (r->pipe != NULL)
+    pipelineStart(r);
+
+  return TRUE;
+}
+
+#endif /* ifdef __UNIX */
+
+
+void readerClose(fileReader *r) {
+#ifdef __UNIX
+  if (r->fd >= 0) {
+    if (r->mapped)
+      mappedClose(r);
+    else if (r->sparse)
+      sparseClose(r);
+    else if (r->pipe != NULL)
+      pipelineStop(r);
+    close(r->fd);
+  }
+  r->fd = -1;
+#else
+  if (r->f != NULL)
+    fclose(r->f);
+  r->f = NULL;
+#endif
+}
+
+
+/* Fills in info for the file r has open. Returns FALSE on error. */
+int readerStat(fileReader *r, struct stat *info) {
+#ifdef __UNIX
+  return !fstat(r->fd,info);
+#else
+  return !fstat(fileno(r->f),info);
+#endif
+}
+
+
+#ifdef __UNIX
+/* Fills buf with up to len bytes, only stopping short at the end of
+   the file. Returns the number of bytes read, or -1 on error. */
+static long readFully(fileReader *r, unsigned char *buf, unsigned long len) {
+
+  unsigned long total = 0;
+  ssize_t count;
+
+  while (total < len) {
+
+    count = read(r->fd,buf + total,len - total);
+
+    if (count < 0) {
+      if (errno == EINTR)
+	continue;
+
+#ifdef O_DIRECT
+      /* Some devices and filesystems accept O_DIRECT on open but then
+	 won't do it. Turn it off and carry on. */
+      if (errno == EINVAL && r->direct) {
+	fcntl(r->fd,F_SETFL,fcntl(r->fd,F_GETFL) & ~O_DIRECT);
+	r->direct = FALSE;
+	continue;
+      }
+#endif
+      return -1;
+    }
+
+    if (count == 0)
+      break;
+    total += count;
+
+    /* O_DIRECT reads have to be aligned. If we got a short read, the
+       next one wouldn't be, so it had better be the end of the file. */
+    if (r->direct && (total % DIRECT_ALIGNMENT))
+      break;
+  }
+
+  return total;
+}
+#endif
+
+
+/* Reads the next block of the file. *data is set to point at the bytes
+   we read, which stay valid until the next call. Returns the number of
+   bytes read, 0 at the end of the file, or -1 on error. Every block but
+   the last one is exactly readBlockSize bytes long. */
+long readerNext(fileReader *r, unsigned char **data) {
+
+  long count;
+
+  *data = r->buf;
+
+#ifdef __UNIX
+  if (r->mapped)
+    count = mappedNext(r,data);
+  else if (r->sparse)
+    count = sparseNext(r,data);
+  else if (r->pipe != NULL)
+    count = pipelineNext(r,data);
+  else
+    count = readFully(r,r->buf,r->size);
+
+#ifdef POSIX_FADV_DONTNEED
+  /* If the user asked us not to use the page cache and we couldn't
+     avoid it, at least don't leave our pages behind in it. */
+  if (modeDirect && !r->direct && count > 0)
+    posix_fadvise(r->fd,r->offset,count,POSIX_FADV_DONTNEED);
+#endif
+
+#else
+  count = fread(r->buf,1,r->size,r->f);
+  if (count == 0 && ferror(r->f))
+    count = -1;
+#endif
+
+  if (count < 0) {
+    printError(r->filename);
+    return -1;
+  }
+
+  r->offset += count;
+  return count;
+}
+
+
+/* Returns TRUE if something went wrong with the file after readerNext
+   handed us the data, in which case the error has been reported and the
+   hash is no good. This has to be checked before the file is closed. */
+int readerFailed(fileReader *r) {
+#ifdef __UNIX
+  if (r->mapped)
+    return mappedFailed(r);
+#endif
+  return FALSE;
+}
+
+
+/* Return the size, in bytes, of the rest of an open file. On error,
+   return -1 */
+unsigned long long measureOpenFile(fileReader *r) {
+
+#ifdef __LINUX
+  struct stat info;
+
+  /* I don't know why, but if you don't initialize this value you'll
+     get wildly innacurate results when you try to run this function */
+  unsigned long long numsectors = 0;
+#endif
+
+#ifdef __UNIX
+  off_t total;
+
+  if ((total = lseek(r->fd,0,SEEK_END)) < 0)
+    return -1;
+  if (lseek(r->fd,r->offset,SEEK_SET) < 0)
+    return -1;
+#else
+  unsigned long long total = 0, original = ftello(r->f);
+
+  if ((fseeko(r->f,0,SEEK_END)))
+    return -1;
+  total = ftello(r->f);
+  if ((fseeko(r->f,original,SEEK_SET)))
+    return -1;
+#endif
+
+#ifdef __LINUX
+
+  /* Block devices, like /dev/hda, don't return a normal filesize.
+     If we are working with a block device, we have to ask the operating
+     system to tell us the true size of the device.
+
+     The following only works on Linux as far as I know. If you know
+     how to port this code to another operating system, please contact
+     the current maintainer of this program! */
+
+  /* I'd prefer not to use fstat as it will follow symbolic links. We don't
+     follow symbolic links. That being said, all symbolic links *should*
+     have been caught before we got here. */
+
+  fstat(r->fd,&info);
+  if (S_ISBLK(info.st_mode)) {
+    if (ioctl(r->fd, BLKGETSIZE, &numsectors)){
+#ifdef __DEBUG
+      perror("BLKGETSIZE failed");
+#endif
+    } else {
+
+      /* We're going to assume that this device has 512 byte sectors.
+	 Eventually we should add a way to get the real number of sectors
+	 from the device. */
+      total = numsectors * 512;
+    }
+  }
+#endif /* ifdef __LINUX */
+
+  return (total - r->offset);
+}
@@ -0,0 +1,167 @@
+/* MD5DEEP - scan.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* Scanning kernels for reading hash files. Loading a big hash set means
+   looking at every byte of hundreds of millions of lines, so doing it one
+   byte at a time is where all of the time goes. These look at 16 or 32
+   bytes at once. Like the multi-buffer code, the instruction set is
+   chosen by the compiler flags: plain x86-64 gets SSE2, -mavx2 gets AVX2,
+   and everything else gets the byte at a time versions.
+
+   None of these ever read past the end they are given. */
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+/* Returns a pointer to the nth c in buf, or NULL if there aren't that
+   many before end. n must be at least one. */
+char *scanNthChar(char *buf, char *end, char c, int n) {
+
+#if defined(__SSE2__)
+  unsigned int mask;
+  int count;
+
+#if defined(__AVX2__)
+  __m256i wide = _mm256_set1_epi8(c);
+
+  while (end - buf >= 32) {
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8
+				(_mm256_loadu_si256((__m256i *)buf),wide));
+    count = __builtin_popcount(mask);
+    if (count >= n) {
+      while (--n)
+	mask &= mask - 1;
+      return buf + __builtin_ctz(mask);
+    }
+    n -= count;
+    buf += 32;
+  }
+#endif
+
+  __m128i needle = _mm_set1_epi8(c);
+
+  while (end - buf >= 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8
+			     (_mm_loadu_si128((__m128i *)buf),needle));
+    count = __builtin_popcount(mask);
+    if (count >= n) {
+      while (--n)
+	mask &= mask - 1;
+      return buf + __builtin_ctz(mask);
+    }
+    n -= count;
+    buf += 16;
+  }
+#endif
+
+  for ( ; buf < end ; buf++)
+    if (*buf == c && --n == 0)
+      return buf;
+
+  return NULL;
+}
+
+
+#if defined(__SSE2__)
+
+/* Turns 16 hex characters into their values, one per byte. Any byte
+   that wasn't a hex character is cleared in valid. */
+static __m128i hexValues(__m128i v, __m128i *valid) {
+
+  __m128i digit  = _mm_sub_epi8(v,_mm_set1_epi8('0'));
+  __m128i letter = _mm_sub_epi8(_mm_or_si128(v,_mm_set1_epi8(0x20)),
+				_mm_set1_epi8('a'));
+
+  /* The comparisons are signed, so anything that went below zero or
+     had the top bit set to start with is ruled out by the first half */
+  __m128i isDigit  = _mm_and_si128(_mm_cmpgt_epi8(digit,_mm_set1_epi8(-1)),
+				   _mm_cmplt_epi8(digit,_mm_set1_epi8(10)));
+  __m128i isLetter = _mm_and_si128(_mm_cmpgt_epi8(letter,_mm_set1_epi8(-1)),
+				   _mm_cmplt_epi8(letter,_mm_set1_epi8(6)));
+
+  *valid = _mm_or_si128(isDigit,isLetter);
+  return _mm_or_si128(_mm_and_si128(isDigit,digit),
+		      _mm_and_si128(isLetter,
+				    _mm_add_epi8(letter,_mm_set1_epi8(10))));
+}
+
+
+/* Puts each pair of values together into one byte. The first of each
+   pair is the high half. The results end up in the low byte of each
+   16 bit word. */
+static __m128i hexPairs(__m128i x) {
+  return _mm_and_si128(_mm_or_si128(_mm_slli_epi16(x,4),_mm_srli_epi16(x,8)),
+		       _mm_set1_epi16(0x00ff));
+}
+
+#endif /* if defined(__SSE2__) */
+
+
+#if !defined(__SSE2__)
+
+/* Convert a single hexadecimal character to decimal. If c is not a valid
+   hex character, returns -1. */
+static int translateChar(char c) {
+
+  /* If this is a digit */
+  if (c > 47 && c < 58)
+    return (c - 48);
+
+  c = toupper(c);
+  /* If this is a letter... 'A' should be equal to 10 */
+  if (c > 64 && c < 71)
+    return (c - 55);
+
+  return -1;
+}
+
+#endif /* if !defined(__SSE2__) */
+
+
+/* Checks that the HASH_STRING_LENGTH characters at buf are all hex and
+   decodes them into digest at the same time. Returns FALSE if they
+   aren't all hex, in which case digest is garbage. There must be at
+   least HASH_STRING_LENGTH characters at buf. */
+int scanHexDigest(char *buf, unsigned char *digest) {
+
+#if defined(__SSE2__)
+  __m128i low, high, lowValid, highValid;
+
+  low  = hexValues(_mm_loadu_si128((__m128i *)buf),&lowValid);
+  high = hexValues(_mm_loadu_si128((__m128i *)(buf + 16)),&highValid);
+
+  if (_mm_movemask_epi8(_mm_and_si128(lowValid,highValid)) != 0xffff)
+    return FALSE;
+
+  _mm_storeu_si128((__m128i *)digest,
+		   _mm_packus_epi16(hexPairs(low),hexPairs(high)));
+  return TRUE;
+
+#else
+  int count, high, low;
+
+  for (count = 0 ; count < MD5_HASH_LENGTH ; count++) {
+    high = translateChar(buf[2 * count]);
+    low  = translateChar(buf[2 * count + 1]);
+    if (high < 0 || low < 0)
+      return FALSE;
+    digest[count] = (high << 4) | low;
+  }
+
+  return TRUE;
+#endif
+}
@@ -0,0 +1,227 @@
+/* MD5DEEP - sha1.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* SHA-1 as described in FIPS 180-4. It works like the MD5 code: whole
+   blocks are hashed straight out of the caller's buffer and only the
+   odd bytes at the ends are copied into the context.
+
+   If the compiler was told it can use the SHA extensions (-msha), we
+   use those instead of doing the rounds ourselves. They do four rounds
+   per instruction and are several times as fast. */
+
+#if defined(__SHA__) && defined(__SSE4_1__)
+#define SHA1_NI
+#include <immintrin.h>
+#endif
+
+#define ROL(x,n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void putBE32(unsigned char *p, u_int32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+
+#ifdef SHA1_NI
+
+/* Rounds 4g to 4g+3. m holds the message words for these rounds, which
+   get added to E in e, and eNext gets what it needs for the next four.
+   While the rounds go, we work on the message schedule: next, far, and
+   prev hold the words for the rounds four, eight and twelve rounds on.
+   Which steps of the schedule are needed depends on how far along we
+   are, but g is always a constant so the compiler throws the tests away. */
+#define SHA1_QUAD(g,e,eNext,m,next,far,prev)				\
+  do {									\
+    e = (g) ? _mm_sha1nexte_epu32(e,m) : _mm_add_epi32(e,m);		\
+    eNext = abcd;							\
+    if ((g) >= 3 && (g) <= 18)						\
+      next = _mm_sha1msg2_epu32(next,m);				\
+    abcd = _mm_sha1rnds4_epu32(abcd,e,(g) / 5);				\
+    if ((g) >= 1 && (g) <= 16)						\
+      prev = _mm_sha1msg1_epu32(prev,m);				\
+    if ((g) >= 2 && (g) <= 17)						\
+      far = _mm_xor_si128(far,m);					\
+  } while (0)
+
+static void SHA1TransformBlocks(u_int32_t state[5], unsigned char const *data,
+				unsigned long blocks) {
+
+  const __m128i swap = _mm_set_epi64x(0x0001020304050607ULL,
+				      0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcdSave, e0, e0Save, e1, m0, m1, m2, m3;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)state),0x1B);
+  e0 = _mm_set_epi32(state[4],0,0,0);
+
+  while (blocks-- > 0) {
+
+    abcdSave = abcd;
+    e0Save = e0;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)data),swap);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 16)),swap);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 32)),swap);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 48)),swap);
+
+    SHA1_QUAD( 0,e0,e1,m0,m1,m2,m3);
+    SHA1_QUAD( 1,e1,e0,m1,m2,m3,m0);
+    SHA1_QUAD( 2,e0,e1,m2,m3,m0,m1);
+    SHA1_QUAD( 3,e1,e0,m3,m0,m1,m2);
+    SHA1_QUAD( 4,e0,e1,m0,m1,m2,m3);
+    SHA1_QUAD( 5,e1,e0,m1,m2,m3,m0);
+    SHA1_QUAD( 6,e0,e1,m2,m3,m0,m1);
+    SHA1_QUAD( 7,e1,e0,m3,m0,m1,m2);
+    SHA1_QUAD( 8,e0,e1,m0,m1,m2,m3);
+    SHA1_QUAD( 9,e1,e0,m1,m2,m3,m0);
+    SHA1_QUAD(10,e0,e1,m2,m3,m0,m1);
+    SHA1_QUAD(11,e1,e0,m3,m0,m1,m2);
+    SHA1_QUAD(12,e0,e1,m0,m1,m2,m3);
+    SHA1_QUAD(13,e1,e0,m1,m2,m3,m0);
+    SHA1_QUAD(14,e0,e1,m2,m3,m0,m1);
+    SHA1_QUAD(15,e1,e0,m3,m0,m1,m2);
+    SHA1_QUAD(16,e0,e1,m0,m1,m2,m3);
+    SHA1_QUAD(17,e1,e0,m1,m2,m3,m0);
+    SHA1_QUAD(18,e0,e1,m2,m3,m0,m1);
+    SHA1_QUAD(19,e1,e0,m3,m0,m1,m2);
+
+    e0 = _mm_sha1nexte_epu32(e0,e0Save);
+    abcd = _mm_add_epi32(abcd,abcdSave);
+    data += 64;
+  }
+
+  _mm_storeu_si128((__m128i *)state,_mm_shuffle_epi32(abcd,0x1B));
+  state[4] = _mm_extract_epi32(e0,3);
+}
+
+#else
+
+static u_int32_t getBE32(unsigned char const *p) {
+  return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) |
+    ((u_int32_t)p[2] << 8) | p[3];
+}
+
+/* One round, with f the round function and k its constant */
+#define SHA1STEP(f,k)							\
+  do {									\
+    t = ROL(a,5) + (f) + e + (k) + w[i];				\
+    e = d;								\
+    d = c;								\
+    c = ROL(b,30);							\
+    b = a;								\
+    a = t;								\
+  } while (0)
+
+static void SHA1TransformBlocks(u_int32_t state[5], unsigned char const *data,
+				unsigned long blocks) {
+
+  u_int32_t w[80], a, b, c, d, e, t;
+  int i;
+
+  while (blocks-- > 0) {
+
+    for (i = 0 ; i < 16 ; i++)
+      w[i] = getBE32(data + 4 * i);
+    for ( ; i < 80 ; i++)
+      w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16],1);
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    for (i = 0 ; i < 20 ; i++)
+      SHA1STEP(d ^ (b & (c ^ d)),0x5A827999);
+    for ( ; i < 40 ; i++)
+      SHA1STEP(b ^ c ^ d,0x6ED9EBA1);
+    for ( ; i < 60 ; i++)
+      SHA1STEP((b & c) | (d & (b | c)),0x8F1BBCDC);
+    for ( ; i < 80 ; i++)
+      SHA1STEP(b ^ c ^ d,0xCA62C1D6);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    data += 64;
+  }
+}
+
+#endif /* ifdef SHA1_NI */
+
+
+void SHA1Init(SHA1_CTX *ctx) {
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xEFCDAB89;
+  ctx->state[2] = 0x98BADCFE;
+  ctx->state[3] = 0x10325476;
+  ctx->state[4] = 0xC3D2E1F0;
+  ctx->count = 0;
+}
+
+
+void SHA1Update(SHA1_CTX *ctx, unsigned char const *buf, unsigned long len) {
+
+  unsigned long used = ctx->count & 63, take;
+
+  ctx->count += len;
+
+  if (used > 0) {
+    take = 64 - used;
+    if (len < take) {
+      memcpy(ctx->in + used,buf,len);
+      return;
+    }
+    memcpy(ctx->in + used,buf,take);
+    SHA1TransformBlocks(ctx->state,ctx->in,1);
+    buf += take;
+    len -= take;
+  }
+
+  if (len >= 64) {
+    SHA1TransformBlocks(ctx->state,buf,len / 64);
+    buf += len & ~63UL;
+    len &= 63;
+  }
+
+  memcpy(ctx->in,buf,len);
+}
+
+
+void SHA1Final(unsigned char digest[SHA1_HASH_LENGTH], SHA1_CTX *ctx) {
+
+  unsigned long used = ctx->count & 63;
+  unsigned long long bits = ctx->count * 8;
+  int i;
+
+  ctx->in[used++] = 0x80;
+  if (used > 56) {
+    memset(ctx->in + used,0,64 - used);
+    SHA1TransformBlocks(ctx->state,ctx->in,1);
+    used = 0;
+  }
+  memset(ctx->in + used,0,56 - used);
+
+  putBE32(ctx->in + 56,bits >> 32);
+  putBE32(ctx->in + 60,bits);
+  SHA1TransformBlocks(ctx->state,ctx->in,1);
+
+  for (i = 0 ; i < 5 ; i++)
+    putBE32(digest + 4 * i,ctx->state[i]);
+  memset(ctx,0,sizeof(*ctx));
+}
@@ -0,0 +1,249 @@
+/* MD5DEEP - sha256.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* SHA-256 as described in FIPS 180-4. This is laid out the same way as
+   sha1.c, including the use of the SHA extensions when the compiler was
+   told about them (-msha). */
+
+#if defined(__SHA__) && defined(__SSE4_1__)
+#define SHA256_NI
+#include <immintrin.h>
+#endif
+
+static const u_int32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void putBE32(unsigned char *p, u_int32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+
+#ifdef SHA256_NI
+
+/* Rounds 4g to 4g+3, two at a time. m holds the message words for these
+   rounds. While the rounds go, we work on the message schedule: next
+   gets finished off for the rounds four on, and prev gets started on
+   for the rounds twelve on. g is always a constant, so the compiler
+   throws the tests away. */
+#define SHA256_QUAD(g,m,next,prev)					\
+  do {									\
+    msg = _mm_add_epi32(m,_mm_loadu_si128((__m128i *)&K[4 * (g)]));	\
+    cdgh = _mm_sha256rnds2_epu32(cdgh,abef,msg);			\
+    if ((g) >= 3 && (g) <= 14) {					\
+      next = _mm_add_epi32(next,_mm_alignr_epi8(m,prev,4));		\
+      next = _mm_sha256msg2_epu32(next,m);				\
+    }									\
+    abef = _mm_sha256rnds2_epu32(abef,cdgh,_mm_shuffle_epi32(msg,0x0E)); \
+    if ((g) >= 1 && (g) <= 12)						\
+      prev = _mm_sha256msg1_epu32(prev,m);				\
+  } while (0)
+
+static void SHA256TransformBlocks(u_int32_t state[8], unsigned char const *data,
+				  unsigned long blocks) {
+
+  const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+				      0x0405060700010203ULL);
+  __m128i abef, cdgh, abefSave, cdghSave, msg, tmp, m0, m1, m2, m3;
+
+  /* The instructions want the state as ABEF and CDGH */
+  tmp  = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)state),0xB1);
+  cdgh = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)(state + 4)),0x1B);
+  abef = _mm_alignr_epi8(tmp,cdgh,8);
+  cdgh = _mm_blend_epi16(cdgh,tmp,0xF0);
+
+  while (blocks-- > 0) {
+
+    abefSave = abef;
+    cdghSave = cdgh;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)data),swap);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 16)),swap);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 32)),swap);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 48)),swap);
+
+    SHA256_QUAD( 0,m0,m1,m3);
+    SHA256_QUAD( 1,m1,m2,m0);
+    SHA256_QUAD( 2,m2,m3,m1);
+    SHA256_QUAD( 3,m3,m0,m2);
+    SHA256_QUAD( 4,m0,m1,m3);
+    SHA256_QUAD( 5,m1,m2,m0);
+    SHA256_QUAD( 6,m2,m3,m1);
+    SHA256_QUAD( 7,m3,m0,m2);
+    SHA256_QUAD( 8,m0,m1,m3);
+    SHA256_QUAD( 9,m1,m2,m0);
+    SHA256_QUAD(10,m2,m3,m1);
+    SHA256_QUAD(11,m3,m0,m2);
+    SHA256_QUAD(12,m0,m1,m3);
+    SHA256_QUAD(13,m1,m2,m0);
+    SHA256_QUAD(14,m2,m3,m1);
+    SHA256_QUAD(15,m3,m0,m2);
+
+    abef = _mm_add_epi32(abef,abefSave);
+    cdgh = _mm_add_epi32(cdgh,cdghSave);
+    data += 64;
+  }
+
+  tmp  = _mm_shuffle_epi32(abef,0x1B);
+  cdgh = _mm_shuffle_epi32(cdgh,0xB1);
+  _mm_storeu_si128((__m128i *)state,_mm_blend_epi16(tmp,cdgh,0xF0));
+  _mm_storeu_si128((__m128i *)(state + 4),_mm_alignr_epi8(cdgh,tmp,8));
+}
+
+#else
+
+#define ROR(x,n)   (((x) >> (n)) | ((x) << (32 - (n))))
+
+static u_int32_t getBE32(unsigned char const *p) {
+  return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) |
+    ((u_int32_t)p[2] << 8) | p[3];
+}
+
+static void SHA256TransformBlocks(u_int32_t state[8], unsigned char const *data,
+				  unsigned long blocks) {
+
+  u_int32_t w[64], a, b, c, d, e, f, g, h, s0, s1, t1, t2;
+  int i;
+
+  while (blocks-- > 0) {
+
+    for (i = 0 ; i < 16 ; i++)
+      w[i] = getBE32(data + 4 * i);
+    for ( ; i < 64 ; i++) {
+      s0 = ROR(w[i - 15],7) ^ ROR(w[i - 15],18) ^ (w[i - 15] >> 3);
+      s1 = ROR(w[i - 2],17) ^ ROR(w[i - 2],19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+
+    for (i = 0 ; i < 64 ; i++) {
+      t1 = h + (ROR(e,6) ^ ROR(e,11) ^ ROR(e,25)) + (g ^ (e & (f ^ g))) +
+	K[i] + w[i];
+      t2 = (ROR(a,2) ^ ROR(a,13) ^ ROR(a,22)) + ((a & b) | (c & (a | b)));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+    data += 64;
+  }
+}
+
+#endif /* ifdef SHA256_NI */
+
+
+void SHA256Init(SHA256_CTX *ctx) {
+  ctx->state[0] = 0x6a09e667;
+  ctx->state[1] = 0xbb67ae85;
+  ctx->state[2] = 0x3c6ef372;
+  ctx->state[3] = 0xa54ff53a;
+  ctx->state[4] = 0x510e527f;
+  ctx->state[5] = 0x9b05688c;
+  ctx->state[6] = 0x1f83d9ab;
+  ctx->state[7] = 0x5be0cd19;
+  ctx->count = 0;
+}
+
+
+void SHA256Update(SHA256_CTX *ctx, unsigned char const *buf,
+		  unsigned long len) {
+
+  unsigned long used = ctx->count & 63, take;
+
+  ctx->count += len;
+
+  if (used > 0) {
+    take = 64 - used;
+    if (len < take) {
+      memcpy(ctx->in + used,buf,len);
+      return;
+    }
+    memcpy(ctx->in + used,buf,take);
+    SHA256TransformBlocks(ctx->state,ctx->in,1);
+    buf += take;
+    len -= take;
+  }
+
+  if (len >= 64) {
+    SHA256TransformBlocks(ctx->state,buf,len / 64);
+    buf += len & ~63UL;
+    len &= 63;
+  }
+
+  memcpy(ctx->in,buf,len);
+}
+
+
+void SHA256Final(unsigned char digest[SHA256_HASH_LENGTH], SHA256_CTX *ctx) {
+
+  unsigned long used = ctx->count & 63;
+  unsigned long long bits = ctx->count * 8;
+  int i;
+
+  ctx->in[used++] = 0x80;
+  if (used > 56) {
+    memset(ctx->in + used,0,64 - used);
+    SHA256TransformBlocks(ctx->state,ctx->in,1);
+    used = 0;
+  }
+  memset(ctx->in + used,0,56 - used);
+
+  putBE32(ctx->in + 56,bits >> 32);
+  putBE32(ctx->in + 60,bits);
+  SHA256TransformBlocks(ctx->state,ctx->in,1);
+
+  for (i = 0 ; i < 8 ; i++)
+    putBE32(digest + 4 * i,ctx->state[i]);
+  memset(ctx,0,sizeof(*ctx));
+}
@@ -0,0 +1,215 @@
+/* MD5DEEP - sparse.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* Sparse files. Disk images and database files are often mostly holes,
+   and reading a hole gets you nothing but zeros that the filesystem made
+   up. When a file takes up less space on the disk than its size says,
+   and the filesystem says it has a hole before the end, we ask where
+   its data is with SEEK_DATA and SEEK_HOLE and only read that. The
+   first test alone isn't enough. A file on a filesystem that compresses
+   takes up less space than its size too, without any holes.
+
+   Blocks that are all hole are handed to the hashing code out of one
+   block of zeros we keep around for the purpose, so they cost nothing
+   but the hashing. Blocks that are part hole get the zeros filled in.
+   Either way the hash is the same as if we'd read every byte.
+
+   This is used instead of -M or -A for the files it applies to, and we
+   say so the first time it happens. It isn't used with O_DIRECT (-D),
+   where everything we read has to be lined up. Only called by reader.c. */
+
+#if defined(__UNIX) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+
+#include <pthread.h>
+
+/* Files with fewer bytes of holes than this aren't worth the trouble */
+#define SPARSE_MIN_HOLES   (64 * 1024)
+
+static unsigned char *zeros = NULL;
+static bool warned = FALSE;
+
+static unsigned long sparseFiles = 0;
+static unsigned long long holeBytes = 0;
+static pthread_mutex_t sparseLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Decides whether the file that was just opened is worth reading around
+   the holes. Returns TRUE if it is. */
+int sparseOpen(fileReader *r) {
+
+  struct stat info;
+  off_t hole;
+
+  r->sparse = FALSE;
+
+  if (r->direct)
+    return FALSE;
+
+  if (fstat(r->fd,&info) || !S_ISREG(info.st_mode) ||
+      (unsigned long long)info.st_blocks * 512 + SPARSE_MIN_HOLES >
+      (unsigned long long)info.st_size)
+    return FALSE;
+
+  /* The end of the file always counts as a hole, so that's where
+     SEEK_HOLE goes when there aren't any others */
+  hole = lseek(r->fd,0,SEEK_HOLE);
+  lseek(r->fd,0,SEEK_SET);
+  if (hole < 0 || hole >= info.st_size)
+    return FALSE;
+
+  /* Every reader hands out the same block of zeros. With -A the reader
+     doesn't have a buffer of its own, so we give it one. */
+  pthread_mutex_lock(&sparseLock);
+  if (zeros == NULL)
+    zeros = (unsigned char *)calloc(1,readBlockSize);
+  if (!warned && (modeMmap || modePipeline) && !modeSilent)
+    fprintf(stderr,"%s: Reading sparse files around their holes instead "
+	    "of with %s\n", __progname,modeMmap ? "-M" : "-A");
+  warned = TRUE;
+  pthread_mutex_unlock(&sparseLock);
+
+  if (r->buf == NULL &&
+      posix_memalign((void **)&r->buf,DIRECT_ALIGNMENT,r->size))
+    r->buf = NULL;
+  if (zeros == NULL || r->buf == NULL)
+    return FALSE;
+
+  r->fileSize  = info.st_size;
+  r->dataStart = 0;
+  r->holeStart = 0;
+  r->holeBytes = 0;
+  r->sparse = TRUE;
+  return TRUE;
+}
+
+
+void sparseClose(fileReader *r) {
+  pthread_mutex_lock(&sparseLock);
+  sparseFiles++;
+  holeBytes += r->holeBytes;
+  pthread_mutex_unlock(&sparseLock);
+  r->sparse = FALSE;
+}
+
+
+/* Finds the data at or after pos and the hole after that. If there's
+   no more data, the rest of the file is a hole. If the filesystem can't
+   tell us, we say the rest of the file is data. */
+static void findData(fileReader *r, unsigned long long pos) {
+
+  off_t where;
+
+  if ((where = lseek(r->fd,pos,SEEK_DATA)) < 0) {
+    if (errno == ENXIO)
+      r->dataStart = r->holeStart = r->fileSize;
+    else {
+      r->dataStart = pos;
+      r->holeStart = r->fileSize;
+    }
+    return;
+  }
+  r->dataStart = where;
+
+  if ((where = lseek(r->fd,r->dataStart,SEEK_HOLE)) < 0 ||
+      (unsigned long long)where <= r->dataStart)
+    r->holeStart = r->fileSize;
+  else
+    r->holeStart = where;
+}
+
+
+/* Works just like readerNext, but only reads the parts of the block
+   that aren't holes */
+long sparseNext(fileReader *r, unsigned char **data) {
+
+  unsigned long long pos = r->offset, end, stop;
+  ssize_t count;
+
+  if (pos >= r->fileSize)
+    return 0;
+
+  end = pos + r->size;
+  if (end > r->fileSize)
+    end = r->fileSize;
+
+  if (pos >= r->holeStart)
+    findData(r,pos);
+
+  /* The whole block is a hole */
+  if (end <= r->dataStart) {
+    *data = zeros;
+    r->holeBytes += end - pos;
+    return end - pos;
+  }
+
+  while (pos < end) {
+
+    if (pos >= r->holeStart)
+      findData(r,pos);
+
+    if (pos < r->dataStart) {
+      stop = r->dataStart < end ? r->dataStart : end;
+      memset(r->buf + (pos - r->offset),0,stop - pos);
+      r->holeBytes += stop - pos;
+      pos = stop;
+      continue;
+    }
+
+    stop = r->holeStart < end ? r->holeStart : end;
+    count = pread(r->fd,r->buf + (pos - r->offset),stop - pos,pos);
+
+    if (count < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+
+    /* Somebody cut the file short. This is as far as it goes. */
+    if (count == 0) {
+      r->fileSize = pos;
+      break;
+    }
+    pos += count;
+  }
+
+  *data = r->buf;
+  return pos - r->offset;
+}
+
+
+void printSparseStats(void) {
+  fprintf(stderr,"%s: %llu bytes of holes in %lu sparse files were not read\n",
+	  __progname,holeBytes,sparseFiles);
+}
+
+#else
+
+/* Without SEEK_DATA and SEEK_HOLE we can't find the holes */
+
+int sparseOpen(fileReader *r) {
+  return FALSE;
+}
+
+void sparseClose(fileReader *r) {
+}
+
+long sparseNext(fileReader *r, unsigned char **data) {
+  return -1;
+}
+
+void printSparseStats(void) {
+}
+
+#endif
@@ -0,0 +1,520 @@
+/* MD5DEEP - threads.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+
+/* The directory traversal hands us filenames through threadsSubmit.
+   They go into a work queue that is drained by the hashing threads.
+   Every file gets a sequence number when it is submitted so that we
+   can print the results in the same order as a serial run if the
+   user asked for it (modeOrdered).
+
+   The number of files that have been submitted but whose output
+   has not been printed yet is capped at MAX_OUTSTANDING_PER_THREAD
+   times the number of threads. When we hit that cap, threadsSubmit
+   blocks until the printer catches up. That keeps the queue from
+   growing without bound on huge trees and also bounds the size of
+   the reordering window.
+
+   With -L each hashing thread keeps several files open at once and
+   runs them through the multi-buffer MD5 code in md5mb.c. Those files
+   all count as outstanding, so we leave room for them in the window.
+
+   Normally there's one queue. With -G every disk gets a queue of its
+   own, so that a run that covers several disks keeps all of them busy
+   instead of working through them in the order the walk found them.
+   Partitions on the same disk share its queue. A disk that spins only
+   gets one file read at a time, as it would spend all of its time
+   seeking back and forth between files otherwise. Anything else, like
+   an SSD, or something that isn't a local disk at all, gets as many
+   files at once as there are threads to hash them. The threads take
+   files from the queues in turn. */
+
+int modeDevices = FALSE;
+
+#ifdef __UNIX
+
+#include <pthread.h>
+
+/* glibc keeps major and minor here, whether or not we're built for
+   Linux. Everybody else has them in sys/types.h. */
+#if defined(__LINUX) || defined(__GLIBC__)
+#include <sys/sysmacros.h>
+#endif
+
+#define MAX_OUTSTANDING_PER_THREAD   4
+
+/* How many files can be read from a spinning disk at once */
+#define ROTATING_DISK_FILES   1
+
+/* How many files a spinning disk's queue can have that haven't been
+   hashed yet. Each queue has its own limit, so that while one slow disk
+   works through its files, the walk can go on and find files on other
+   disks for the rest of the threads. Other queues get the same number
+   as the whole pool would have without -G. */
+#define ROTATING_DISK_BACKLOG   1024
+
+typedef struct deviceQueue {
+  dev_t disk;
+  int rotational, active, limit;
+  unsigned long files, pending, room;
+  struct workItem *head, *tail;
+  struct deviceQueue *next;
+} deviceQueue;
+
+/* Which queue each device we've seen goes to */
+typedef struct deviceMap {
+  dev_t dev;
+  deviceQueue *queue;
+  struct deviceMap *next;
+} deviceMap;
+
+typedef struct workItem {
+  char *filename;
+  unsigned long seq;
+  struct stat info;
+  deviceQueue *queue;
+  struct workItem *next;
+} workItem;
+
+static pthread_t *workers = NULL;
+static int workerCount = 0;
+
+static pthread_mutex_t lock       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  workReady  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  slotFree   = PTHREAD_COND_INITIALIZER;
+
+/* The threads start looking for work at nextQueue */
+static deviceQueue *queues = NULL, *nextQueue = NULL;
+static deviceMap *devices = NULL;
+static bool shuttingDown = FALSE;
+
+static unsigned long nextSeq = 0, nextPrint = 0;
+static unsigned long outstanding = 0, maxOutstanding = 0;
+
+/* The reordering window. Slot (seq % maxOutstanding) holds the output
+   for file number seq once it has been hashed. With -O, no more than
+   maxOutstanding files can be waiting to be printed no matter what
+   queue they're in. */
+static char **pendingLines = NULL;
+static bool *pendingDone = NULL;
+
+
+/* Must be called with the lock held */
+static void printLine(char *line) {
+  if (line != NULL) {
+    fputs(line,stdout);
+    free(line);
+  }
+}
+
+
+/* Records that item is done. Line is the output for that file, or NULL
+   if there's nothing to print. We take ownership of line and item. */
+static void threadsOutput(workItem *item, char *line) {
+
+  unsigned long slot, seq = item->seq;
+  deviceQueue *q = item->queue;
+
+  pthread_mutex_lock(&lock);
+
+  /* Somebody may be waiting to read another file from this disk */
+  if (q->active-- == q->limit && q->head != NULL)
+    pthread_cond_signal(&workReady);
+  q->pending--;
+
+  if (!modeOrdered) {
+    printLine(line);
+    outstanding--;
+  } else {
+
+    slot = seq % maxOutstanding;
+    pendingLines[slot] = line;
+    pendingDone[slot]  = TRUE;
+
+    /* Print everything we can without leaving a gap */
+    slot = nextPrint % maxOutstanding;
+    while (pendingDone[slot]) {
+      printLine(pendingLines[slot]);
+      pendingLines[slot] = NULL;
+      pendingDone[slot]  = FALSE;
+      nextPrint++;
+      outstanding--;
+      slot = nextPrint % maxOutstanding;
+    }
+  }
+
+  pthread_cond_broadcast(&slotFree);
+  pthread_mutex_unlock(&lock);
+
+  free(item);
+}
+
+
+/* Takes a file off of the first queue, starting at nextQueue, whose
+   disk can take another one. Must be called with the lock held. */
+static workItem *takeItem(void) {
+
+  deviceQueue *q, *start;
+  workItem *item;
+
+  if ((start = nextQueue) == NULL)
+    start = queues;
+  q = start;
+
+  do {
+    if (q->head != NULL && q->active < q->limit) {
+      item = q->head;
+      q->head = item->next;
+      if (q->head == NULL)
+	q->tail = NULL;
+      q->active++;
+      nextQueue = q->next;
+      return item;
+    }
+    q = (q->next != NULL) ? q->next : queues;
+  } while (q != start);
+
+  return NULL;
+}
+
+
+/* Takes the next file off of the queues. If wait is TRUE and there's
+   nothing we can take, we wait for more work. Returns NULL if there's
+   no work available, or if we're shutting down and there's nothing
+   left we can take. Files left on a busy disk's queue will be taken by
+   the threads that are reading from it. */
+static workItem *nextItem(bool wait) {
+
+  workItem *item;
+
+  pthread_mutex_lock(&lock);
+  while ((item = takeItem()) == NULL && wait && !shuttingDown)
+    pthread_cond_wait(&workReady,&lock);
+  pthread_mutex_unlock(&lock);
+
+  return item;
+}
+
+
+static deviceQueue *newQueue(dev_t disk, int rotational) {
+
+  deviceQueue *q = (deviceQueue *)calloc(1,sizeof(deviceQueue));
+  if (q == NULL) {
+    fprintf(stderr,"%s: Out of memory\n", __progname);
+    exit (1);
+  }
+
+  q->disk = disk;
+  q->rotational = rotational;
+  q->limit = (rotational == 1) ? ROTATING_DISK_FILES : INT_MAX;
+  q->room  = (rotational == 1) ? ROTATING_DISK_BACKLOG : maxOutstanding;
+
+  q->next = queues;
+  queues = q;
+  return q;
+}
+
+
+#ifdef __LINUX
+/* Looks up the disk that dev is on in sysfs. If dev is a partition, the
+   disk is the directory above it. Sets rotational to 1 if the disk
+   spins, 0 if it doesn't, and -1 if we can't tell. */
+static void findDisk(dev_t dev, dev_t *disk, int *rotational) {
+
+  char path[PATH_MAX + 32], real[PATH_MAX];
+  unsigned int maj, min;
+  FILE *f;
+
+  *disk = dev;
+  *rotational = -1;
+
+  snprintf(path,sizeof(path),"/sys/dev/block/%u:%u",major(dev),minor(dev));
+  if (realpath(path,real) == NULL)
+    return;
+
+  snprintf(path,sizeof(path),"%s/partition",real);
+  if (access(path,F_OK) == 0)
+    *strrchr(real,'/') = 0;
+
+  snprintf(path,sizeof(path),"%s/dev",real);
+  if ((f = fopen(path,"r")) != NULL) {
+    if (fscanf(f,"%u:%u",&maj,&min) == 2)
+      *disk = makedev(maj,min);
+    fclose(f);
+  }
+
+  snprintf(path,sizeof(path),"%s/queue/rotational",real);
+  if ((f = fopen(path,"r")) != NULL) {
+    if (fscanf(f,"%d",rotational) != 1)
+      *rotational = -1;
+    fclose(f);
+  }
+}
+#endif
+
+
+/* Returns the queue for files on dev. Must be called with the lock
+   held. The first time we see a device we have to find out what disk
+   it's on, but that only happens a handful of times. */
+static deviceQueue *queueFor(dev_t dev) {
+
+  deviceMap *m;
+  deviceQueue *q;
+  dev_t disk = dev;
+  int rotational = -1;
+
+  for (m = devices ; m != NULL ; m = m->next)
+    if (m->dev == dev)
+      return m->queue;
+
+#ifdef __LINUX
+  findDisk(dev,&disk,&rotational);
+#endif
+
+  for (q = queues ; q != NULL ; q = q->next)
+    if (q->disk == disk && q->rotational == rotational)
+      break;
+  if (q == NULL)
+    q = newQueue(disk,rotational);
+
+  if ((m = (deviceMap *)malloc(sizeof(deviceMap))) == NULL) {
+    fprintf(stderr,"%s: Out of memory\n", __progname);
+    exit (1);
+  }
+  m->dev = dev;
+  m->queue = q;
+  m->next = devices;
+  devices = m;
+
+  return q;
+}
+
+
+#ifdef MD5_MULTI_BUFFER
+static void *multiBufferThread(void *arg) {
+
+  MD5MultiContext *mb = MD5MultiInit();
+  char result[2 * MD5_HASH_LENGTH + 1];
+  workItem *item;
+  int opened;
+
+  if (mb == NULL)
+    return NULL;
+
+  for (;;) {
+
+    /* Keep the lanes full. We only wait for new work when we don't
+       have anything else to do. */
+    while (MD5MultiActive(mb) < MD5_LANES &&
+	   (item = nextItem(MD5MultiActive(mb) == 0)) != NULL) {
+
+      /* With -G the file was stat'ed when it was submitted */
+      if (item->info.st_nlink > 0 ? lookupHash(&item->info,result) != NULL :
+	  knownHash(item->filename,&item->info,result) != NULL)
+	threadsOutput(item,makeOutputLine(item->filename,result));
+      else if (cannotMatch(&item->info))
+	threadsOutput(item,NULL);
+      else {
+
+	/* If knownHash didn't stat the file, MD5MultiStart fills in
+	   info from the open file, and it may turn out to be a link */
+	opened = (item->info.st_nlink == 0);
+	if (!MD5MultiStart(mb,item->filename,&item->info,item))
+	  threadsOutput(item,NULL);
+	else if (opened && lookupHash(&item->info,result)) {
+	  MD5MultiCancel(mb,item);
+	  threadsOutput(item,makeOutputLine(item->filename,result));
+	}
+      }
+    }
+
+    if ((item = MD5MultiStep(mb,result)) == NULL)
+      break;
+
+    /* An empty result means there was a read error, which has
+       already been reported */
+    if (result[0] == 0)
+      threadsOutput(item,NULL);
+    else {
+      rememberHash(item->filename,&item->info,result);
+      threadsOutput(item,makeOutputLine(item->filename,result));
+    }
+  }
+
+  MD5MultiFree(mb);
+  return NULL;
+}
+#endif  /* ifdef MD5_MULTI_BUFFER */
+
+
+static void *workerThread(void *arg) {
+
+  workItem *item;
+  fileReader *r;
+
+#ifdef MD5_MULTI_BUFFER
+  if (modeMultiBuffer)
+    return multiBufferThread(arg);
+#endif
+
+  if ((r = readerInit()) == NULL)
+    return NULL;
+
+  while ((item = nextItem(TRUE)) != NULL)
+    threadsOutput(item,hashStatToLine(r,item->filename,&item->info));
+
+  readerFree(r);
+  return NULL;
+}
+
+
+int threadsInit(int count) {
+
+  int i;
+
+  maxOutstanding = count * MAX_OUTSTANDING_PER_THREAD;
+#ifdef MD5_MULTI_BUFFER
+  if (modeMultiBuffer)
+    maxOutstanding += count * MD5_LANES;
+#endif
+  pendingLines = (char **)calloc(maxOutstanding,sizeof(char *));
+  pendingDone  = (bool *)calloc(maxOutstanding,sizeof(bool));
+  workers = (pthread_t *)malloc(sizeof(pthread_t) * count);
+  if (pendingLines == NULL || pendingDone == NULL || workers == NULL)
+    return FALSE;
+
+  /* Without -G everything goes in this queue */
+  newQueue(0,-1);
+
+  for (i = 0 ; i < count ; i++) {
+    if (pthread_create(&workers[i],NULL,workerThread,NULL))
+      break;
+    workerCount++;
+  }
+
+  /* If we couldn't get any threads at all, the caller has to fall
+     back to hashing the files itself. */
+  return (workerCount > 0);
+}
+
+
+void threadsSubmit(char *filename) {
+
+  size_t len = strlen(filename) + 1;
+  workItem *item = (workItem *)malloc(sizeof(workItem) + len);
+  bool known = FALSE;
+  deviceQueue *q;
+
+  if (item == NULL) {
+    fprintf(stderr,"%s: Out of memory\n", __progname);
+    exit (1);
+  }
+  /* The filename goes right after the item, so they're freed together */
+  item->filename = memcpy(item + 1,filename,len);
+  item->next = NULL;
+
+  /* If we can't stat the file, the thread that hashes it will say so.
+     Otherwise the thread uses what we found instead of asking again. */
+  if (modeDevices)
+    known = !stat(filename,&item->info);
+  if (!known)
+    item->info.st_nlink = 0;
+
+  pthread_mutex_lock(&lock);
+
+  /* The queue we made in threadsInit is always at the end */
+  q = queues;
+  while (!known && q->next != NULL)
+    q = q->next;
+  if (known)
+    q = queueFor(item->info.st_dev);
+
+  /* We only wait for room in this file's own queue, unless we need a
+     slot in the reordering window */
+  while (q->pending >= q->room ||
+	 (modeOrdered && outstanding >= maxOutstanding))
+    pthread_cond_wait(&slotFree,&lock);
+
+  item->seq = nextSeq++;
+  outstanding++;
+
+  item->queue = q;
+  q->pending++;
+  q->files++;
+  if (q->tail == NULL)
+    q->head = item;
+  else
+    q->tail->next = item;
+  q->tail = item;
+
+  pthread_cond_signal(&workReady);
+  pthread_mutex_unlock(&lock);
+}
+
+
+void printDeviceStats(void) {
+
+  deviceQueue *q;
+
+  for (q = queues ; q != NULL ; q = q->next)
+    if (q->files > 0 && q->next != NULL)
+      fprintf(stderr,"%s: %lu files on device %u:%u, read %s\n", __progname,
+	      q->files,major(q->disk),minor(q->disk),
+	      q->rotational == 1 ? "one at a time" : "several at a time");
+}
+
+
+/* Waits for all submitted files to be hashed and printed */
+void threadsFinish(void) {
+
+  int i;
+
+  if (workerCount == 0)
+    return;
+
+  pthread_mutex_lock(&lock);
+  shuttingDown = TRUE;
+  pthread_cond_broadcast(&workReady);
+  pthread_mutex_unlock(&lock);
+
+  for (i = 0 ; i < workerCount ; i++)
+    pthread_join(workers[i],NULL);
+
+  workerCount = 0;
+  free(workers);
+  free(pendingLines);
+  free(pendingDone);
+}
+
+#else
+
+/* There's no pthreads on Windows. We just tell the caller that we
+   couldn't start any threads and let it hash the files itself, so
+   threadsSubmit never gets called. */
+
+int threadsInit(int count) {
+  return FALSE;
+}
+
+void threadsSubmit(char *filename) {
+}
+
+void threadsFinish(void) {
+}
+
+void printDeviceStats(void) {
+}
+
+#endif  /* ifdef __UNIX */
@@ -0,0 +1,151 @@
+/* MD5DEEP - uring.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+
+/* The kernel and we share the ring head and tail indexes. We need the
+   memory barriers to make sure we see each other's updates in the
+   right order. */
+#define LOAD_ACQUIRE(p)       __atomic_load_n((p),__ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p,v)    __atomic_store_n((p),(v),__ATOMIC_RELEASE)
+
+
+/* Releases whatever uringInit managed to set up */
+void uringFree(uring *u) {
+
+  if (u->sqes != MAP_FAILED)
+    munmap(u->sqes,u->sqesSize);
+  if (u->cqRing != MAP_FAILED && u->cqRing != u->sqRing)
+    munmap(u->cqRing,u->cqRingSize);
+  if (u->sqRing != MAP_FAILED)
+    munmap(u->sqRing,u->sqRingSize);
+  if (u->fd >= 0)
+    close(u->fd);
+
+  u->sqes = u->cqRing = u->sqRing = MAP_FAILED;
+  u->fd = -1;
+}
+
+
+int uringInit(uring *u, unsigned entries) {
+
+  struct io_uring_params p;
+
+  memset(u,0,sizeof(uring));
+  memset(&p,0,sizeof(p));
+  u->sqes = u->cqRing = u->sqRing = MAP_FAILED;
+
+  if ((u->fd = syscall(__NR_io_uring_setup,entries,&p)) < 0)
+    return FALSE;
+
+  u->entries = p.sq_entries;
+  u->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  /* Newer kernels let us map both rings at once */
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cqRingSize > u->sqRingSize)
+      u->sqRingSize = u->cqRingSize;
+    u->cqRingSize = u->sqRingSize;
+  }
+
+  u->sqRing = mmap(NULL,u->sqRingSize,PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE,u->fd,IORING_OFF_SQ_RING);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->cqRing = u->sqRing;
+  else
+    u->cqRing = mmap(NULL,u->cqRingSize,PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE,u->fd,IORING_OFF_CQ_RING);
+
+  u->sqes = mmap(NULL,u->sqesSize,PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE,u->fd,IORING_OFF_SQES);
+
+  if (u->sqRing == MAP_FAILED || u->cqRing == MAP_FAILED ||
+      u->sqes == MAP_FAILED) {
+    uringFree(u);
+    return FALSE;
+  }
+
+  u->sqHead  = (unsigned *)((char *)u->sqRing + p.sq_off.head);
+  u->sqTail  = (unsigned *)((char *)u->sqRing + p.sq_off.tail);
+  u->sqMask  = (unsigned *)((char *)u->sqRing + p.sq_off.ring_mask);
+  u->sqArray = (unsigned *)((char *)u->sqRing + p.sq_off.array);
+  u->cqHead  = (unsigned *)((char *)u->cqRing + p.cq_off.head);
+  u->cqTail  = (unsigned *)((char *)u->cqRing + p.cq_off.tail);
+  u->cqMask  = (unsigned *)((char *)u->cqRing + p.cq_off.ring_mask);
+  u->cqes    = (struct io_uring_cqe *)((char *)u->cqRing + p.cq_off.cqes);
+
+  return TRUE;
+}
+
+
+struct io_uring_sqe *uringGetSqe(uring *u) {
+
+  unsigned tail = *u->sqTail + u->toSubmit;
+  struct io_uring_sqe *sqe;
+
+  if (tail - LOAD_ACQUIRE(u->sqHead) >= u->entries)
+    return NULL;
+
+  sqe = &u->sqes[tail & *u->sqMask];
+  memset(sqe,0,sizeof(struct io_uring_sqe));
+  u->sqArray[tail & *u->sqMask] = tail & *u->sqMask;
+  u->toSubmit++;
+  return sqe;
+}
+
+
+int uringSubmit(uring *u, unsigned wait) {
+
+  unsigned count = u->toSubmit;
+  int status;
+
+  if (count > 0) {
+    STORE_RELEASE(u->sqTail,*u->sqTail + count);
+    u->toSubmit = 0;
+  }
+
+  if (count == 0 && wait == 0)
+    return 0;
+
+  do {
+    status = syscall(__NR_io_uring_enter,u->fd,count,wait,
+		     wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+  } while (status < 0 && errno == EINTR);
+
+  return status;
+}
+
+
+struct io_uring_cqe *uringPeek(uring *u) {
+
+  unsigned head = *u->cqHead;
+
+  if (head == LOAD_ACQUIRE(u->cqTail))
+    return NULL;
+  return &u->cqes[head & *u->cqMask];
+}
+
+
+void uringSeen(uring *u) {
+  STORE_RELEASE(u->cqHead,*u->cqHead + 1);
+}
+
+#endif /* ifdef HAVE_IO_URING */
@@ -0,0 +1,75 @@
+/* MD5DEEP - uring.h
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/* A very small wrapper around the Linux io_uring system calls. We don't
+   use liburing so that md5deep doesn't pick up another dependency. Only
+   the code that does asynchronous I/O needs this, so it isn't in
+   md5deep.h. Everything in here is only available if HAVE_IO_URING is
+   defined. Otherwise callers have to fall back to something else. */
+
+#ifndef __URING_H
+#define __URING_H
+
+#ifdef __LINUX
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING
+#endif
+
+#endif
+#endif
+#endif /* ifdef __LINUX */
+
+
+#ifdef HAVE_IO_URING
+
+typedef struct uring {
+  int fd;
+  unsigned entries;
+
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+
+  /* How many entries we've queued but not yet handed to the kernel */
+  unsigned toSubmit;
+
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize, sqesSize;
+} uring;
+
+/* Returns FALSE if io_uring isn't available. errno tells you why. */
+int uringInit(uring *u, unsigned entries);
+void uringFree(uring *u);
+
+/* Returns a cleared submission entry, or NULL if the queue is full */
+struct io_uring_sqe *uringGetSqe(uring *u);
+
+/* Hands everything we've queued to the kernel. If wait is non-zero, we
+   also wait until at least that many completions are available. */
+int uringSubmit(uring *u, unsigned wait);
+
+/* Returns the next completion, or NULL if there aren't any. Each
+   completion has to be given back with uringSeen. */
+struct io_uring_cqe *uringPeek(uring *u);
+void uringSeen(uring *u);
+
+#endif /* ifdef HAVE_IO_URING */
+
+#endif /* ifndef __URING_H */
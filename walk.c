@@ -0,0 +1,692 @@
+/* MD5DEEP - walk.c
+ *
+ * By Jesse Kornblum
+ *
+ * This is a work of the US Government. In accordance with 17 USC 105,
+ * copyright protection is not available for any work of the US Government.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "md5deep.h"
+
+/* Walking the directory tree in recursive mode. On Windows this is
+   still done by processDirectory in md5deep.c.
+
+   On *nix we walk the tree with directory file descriptors. Each entry
+   is looked up relative to the directory it's in, so the kernel never
+   has to walk the full path again, and most of the time the directory
+   entry itself tells us what kind of file it is and we don't have to
+   stat it at all. The full path of the current entry is built up in a
+   single buffer that we reuse for the whole walk. Anything that needs
+   to keep a filename, like the hashing threads, makes its own copy.
+
+   On network filesystems every readdir and stat is a round trip to the
+   server, and one thread walking the tree can't find files as fast as
+   the hashing threads can hash them. With -W we walk with several
+   threads. Each walker keeps its own deque of directories it has found
+   but not read yet. It takes directories from the back of its own deque,
+   so it works depth first like the single threaded walk, and when it
+   runs out it steals from the front of somebody else's, which is where
+   the biggest parts of the tree that nobody has started on are. Each
+   walker only has one directory open at a time, so we never use more
+   than walkThreads directory handles, no matter how deep the tree is.
+   The files go to the hashing threads with threadsSubmit.
+
+   With -P we hash the files in each directory in the order they are on
+   the disk instead of the order the directory lists them, so that a
+   spinning disk doesn't spend all its time seeking. We read the whole
+   directory first, with big getdents64 calls on Linux so that even
+   directories with millions of entries don't take forever, then ask
+   the filesystem where each file starts with FIEMAP and sort by that.
+   Filesystems that can't tell us get sorted by inode number, which is
+   usually close. Subdirectories are done after the files, in inode
+   order. With -O and a single hashing thread, everything is printed in
+   the same order as a walk without -P. */
+
+#ifdef __UNIX
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef __LINUX
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#define WALK_MIN_DEQUE      64
+#define WALK_DIRENT_BUFFER  (ONE_MEGABYTE)
+
+int walkThreads = 1;
+int modePhysical = FALSE;
+
+typedef struct walker {
+  char *path;
+  size_t size;
+
+  /* The deque. Entries head to tail - 1 (mod capacity) are in use */
+  char **deque;
+  unsigned long head, tail, capacity;
+  pthread_mutex_t lock;
+
+  pthread_t thread;
+  bool started;
+} walker;
+
+static walker *walkers = NULL;
+static int walkerCount = 0;
+
+/* The number of directories that have been found but not finished.
+   generation goes up every time one is added, so that a walker that
+   went looking for work can tell if it missed any. */
+static pthread_mutex_t walkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  walkMore = PTHREAD_COND_INITIALIZER;
+static unsigned long pending = 0, generation = 0;
+
+
+static void outOfMemory(void) {
+  fprintf(stderr,"%s: Out of memory\n", __progname);
+  exit (1);
+}
+
+
+static void growPath(walker *w, size_t needed) {
+
+  char *bigger;
+  size_t size = w->size ? w->size : PATH_MAX;
+
+  while (size < needed)
+    size *= 2;
+
+  if (size == w->size)
+    return;
+
+  if ((bigger = (char *)realloc(w->path,size)) == NULL)
+    outOfMemory();
+
+  w->path = bigger;
+  w->size = size;
+}
+
+
+/* d_type isn't in POSIX, but just about everybody has it */
+#ifdef DT_UNKNOWN
+#define HAVE_D_TYPE
+#define DIRENT_TYPE(entry)   ((entry)->d_type)
+#else
+#define DIRENT_TYPE(entry)   0
+#endif
+
+
+/* Works out what kind of file the entry called name in the directory
+   open on fd is. type is the d_type from its directory entry. The path
+   of w is its full name, for error messages. */
+static int entryStatus(walker *w, int fd, char *name, int type) {
+
+  struct stat info;
+
+#ifdef HAVE_D_TYPE
+  switch (type) {
+  case DT_DIR:
+    return FILE_DIRECTORY;
+  case DT_LNK:
+    return FILE_SYMLINK;
+  case DT_UNKNOWN:
+    /* Some filesystems don't fill in d_type */
+    break;
+  default:
+    return FILE_REGULAR;
+  }
+#endif
+
+  if (fstatat(fd,name,&info,AT_SYMLINK_NOFOLLOW)) {
+    printError(w->path);
+    return FILE_ERROR;
+  }
+
+  return fileStatus(info.st_mode);
+}
+
+
+static void pushDirectory(walker *w, char *path);
+static void walkDirectory(walker *w, int fd, size_t len);
+static void walkPhysical(walker *w, int fd, size_t len);
+
+
+/* Handles the entry called name in the directory open on fd. Its full
+   path is in w, and is len characters long. */
+static void walkEntry(walker *w, int fd, char *name, size_t len,
+		      int status) {
+
+  int child;
+  char *copy;
+
+  switch (status) {
+
+  case FILE_SYMLINK:
+    if (!modeSilent)
+      fprintf (stderr,"%s: %s: Is a symbolic link\n", __progname,w->path);
+    break;
+
+  case FILE_REGULAR:
+    md5At(fd,name,w->path);
+    break;
+
+  case FILE_DIRECTORY:
+    /* The fact that we're in this function means that we're in
+       recursive mode and therefore we don't have to check for it. */
+    if (walkerCount > 1) {
+      if ((copy = strdup(w->path)) == NULL)
+	outOfMemory();
+      pushDirectory(w,copy);
+      break;
+    }
+
+    /* If the directory was swapped for a symlink since we read its
+       entry, O_NOFOLLOW makes the open fail. */
+    child = openat(fd,name,O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (child < 0)
+      printError(w->path);
+    else if (modePhysical)
+      walkPhysical(w,child,len);
+    else
+      walkDirectory(w,child,len);
+    break;
+
+  case FILE_ERROR:
+    /* An error message has already been printed */
+    break;
+  }
+}
+
+
+/* Puts name on the end of the path of w, after the first start
+   characters. Returns the length of name. */
+static size_t setName(walker *w, size_t start, char *name) {
+  size_t nameLen = strlen(name);
+  growPath(w,start + nameLen + 2);
+  memcpy(w->path + start,name,nameLen + 1);
+  return nameLen;
+}
+
+
+/* Processes everything in the directory open on fd, whose name is the
+   first len characters of the path of w. Takes care of closing fd.
+   Subdirectories are walked right away when there's only one walker,
+   and go on the walker's deque otherwise. */
+static void walkDirectory(walker *w, int fd, size_t len) {
+
+  DIR *dir;
+  struct dirent *entry;
+  size_t start, nameLen;
+
+  if ((dir = fdopendir(fd)) == NULL) {
+    printError(w->path);
+    close(fd);
+    return;
+  }
+
+  /* The root directory already ends with a slash */
+  start = len;
+  if (w->path[len - 1] != DIR_TRAIL_CHAR)
+    w->path[start++] = DIR_TRAIL_CHAR;
+
+  while ((entry = readdir(dir)) != NULL) {
+
+    /* Check that we're not trying to look at "." or ".."
+       These special directories would cause us to move back UP
+       the directory tree. We only want to go down. */
+    if (isSpecialDirectory(entry->d_name))
+      continue;
+
+    nameLen = setName(w,start,entry->d_name);
+    walkEntry(w,fd,entry->d_name,start + nameLen,
+	      entryStatus(w,fd,entry->d_name,DIRENT_TYPE(entry)));
+  }
+
+  w->path[len] = 0;
+  closedir(dir);
+}
+
+
+/* ---------------------------------------------------------------------- */
+
+
+/* One directory, read all at once for -P. The names are kept one after
+   the other in names. */
+typedef struct physicalEntry {
+  unsigned long long key, ino;
+  size_t name;
+  int status;
+  unsigned long index;
+} physicalEntry;
+
+typedef struct physicalBatch {
+  physicalEntry *entries;
+  unsigned long count, capacity;
+  char *names;
+  size_t namesLen, namesSize;
+} physicalBatch;
+
+
+static void addEntry(physicalBatch *b, char *name, unsigned long long ino,
+		     int type) {
+
+  size_t nameLen = strlen(name) + 1;
+  physicalEntry *e;
+
+  if (b->count == b->capacity) {
+    b->capacity = b->capacity ? b->capacity * 2 : WALK_MIN_DEQUE;
+    b->entries = (physicalEntry *)realloc(b->entries,
+					  b->capacity * sizeof(physicalEntry));
+    if (b->entries == NULL)
+      outOfMemory();
+  }
+
+  while (b->namesLen + nameLen > b->namesSize) {
+    b->namesSize = b->namesSize ? b->namesSize * 2 : PATH_MAX;
+    if ((b->names = (char *)realloc(b->names,b->namesSize)) == NULL)
+      outOfMemory();
+  }
+
+  e = &b->entries[b->count];
+  e->name   = b->namesLen;
+  e->ino    = ino;
+  e->status = type;
+  e->index  = b->count++;
+  memcpy(b->names + b->namesLen,name,nameLen);
+  b->namesLen += nameLen;
+}
+
+
+#ifdef __LINUX
+
+/* What getdents64 gives us. glibc doesn't declare it. */
+typedef struct linuxDirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+} linuxDirent64;
+
+
+/* Reads the directory open on fd into b. Returns FALSE on error. */
+static int readBatch(int fd, physicalBatch *b) {
+
+  char *buf;
+  linuxDirent64 *entry;
+  long got, pos;
+
+  if ((buf = (char *)malloc(WALK_DIRENT_BUFFER)) == NULL)
+    outOfMemory();
+
+  while ((got = syscall(SYS_getdents64,fd,buf,WALK_DIRENT_BUFFER)) > 0)
+    for (pos = 0 ; pos < got ; pos += entry->d_reclen) {
+      entry = (linuxDirent64 *)(buf + pos);
+      if (!isSpecialDirectory(entry->d_name))
+	addEntry(b,entry->d_name,entry->d_ino,entry->d_type);
+    }
+
+  free(buf);
+  return (got == 0);
+}
+
+#else
+
+static int readBatch(int fd, physicalBatch *b) {
+
+  DIR *dir;
+  struct dirent *entry;
+
+  /* closedir closes the descriptor fdopendir was given, and we still
+     need ours */
+  if ((dir = fdopendir(dup(fd))) == NULL)
+    return FALSE;
+
+  while ((entry = readdir(dir)) != NULL)
+    if (!isSpecialDirectory(entry->d_name))
+      addEntry(b,entry->d_name,entry->d_ino,DIRENT_TYPE(entry));
+
+  closedir(dir);
+  return TRUE;
+}
+
+#endif /* ifdef __LINUX */
+
+
+/* Returns where the file called name in the directory open on fd starts
+   on the disk. If the filesystem can't tell us, returns ino instead and
+   clears useFiemap so we don't ask again for this directory. */
+static unsigned long long physicalStart(int fd, char *name,
+					unsigned long long ino,
+					bool *useFiemap) {
+
+#if defined(__LINUX) && defined(FS_IOC_FIEMAP)
+  struct {
+    struct fiemap map;
+    struct fiemap_extent extent;
+  } f;
+  int file, status;
+
+  if (!*useFiemap)
+    return ino;
+
+  /* O_NONBLOCK so that opening a FIFO doesn't hang */
+  if ((file = openat(fd,name,O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) < 0)
+    return ino;
+
+  memset(&f,0,sizeof(f));
+  f.map.fm_length = ~0ULL;
+  f.map.fm_extent_count = 1;
+  status = ioctl(file,FS_IOC_FIEMAP,&f.map);
+  close(file);
+
+  if (status < 0) {
+    *useFiemap = FALSE;
+    return ino;
+  }
+
+  /* Empty files don't have any extents and don't need any seeking */
+  if (f.map.fm_mapped_extents == 0)
+    return 0;
+
+  return f.map.fm_extents[0].fe_physical;
+#else
+  return ino;
+#endif
+}
+
+
+/* Files go first, in order of key, then directories */
+static int comparePhysical(const void *a, const void *b) {
+
+  const physicalEntry *x = (const physicalEntry *)a;
+  const physicalEntry *y = (const physicalEntry *)b;
+
+  if (x->status != y->status)
+    return (x->status == FILE_REGULAR) ? -1 : 1;
+  if (x->key != y->key)
+    return (x->key < y->key) ? -1 : 1;
+  return (x->index < y->index) ? -1 : 1;
+}
+
+
+/* Like walkDirectory, but reads the whole directory first and does the
+   files in the order they are on the disk. */
+static void walkPhysical(walker *w, int fd, size_t len) {
+
+  physicalBatch b;
+  physicalEntry *e;
+  size_t start, nameLen;
+  unsigned long count, total, kept = 0;
+  bool useFiemap = TRUE, restore;
+  char **lines;
+  physicalEntry **dirs;
+
+  memset(&b,0,sizeof(b));
+  if (!readBatch(fd,&b))
+    printError(w->path);
+
+  start = len;
+  if (w->path[len - 1] != DIR_TRAIL_CHAR)
+    w->path[start++] = DIR_TRAIL_CHAR;
+
+  /* Anything that isn't a file or a directory we can deal with now */
+  total = b.count;
+  for (count = 0 ; count < total ; count++) {
+    e = &b.entries[count];
+    setName(w,start,b.names + e->name);
+    e->status = entryStatus(w,fd,b.names + e->name,e->status);
+
+    if (e->status == FILE_REGULAR)
+      e->key = physicalStart(fd,b.names + e->name,e->ino,&useFiemap);
+    else if (e->status == FILE_DIRECTORY)
+      e->key = e->ino;
+    else {
+      walkEntry(w,fd,b.names + e->name,strlen(w->path),e->status);
+      continue;
+    }
+    b.entries[kept++] = *e;
+  }
+  b.count = kept;
+
+  qsort(b.entries,b.count,sizeof(physicalEntry),comparePhysical);
+
+  /* To put the results back in the directory's order, we have to be
+     the ones doing the hashing. Anything md5() would have handed off
+     somewhere else (-d, -U) has to go through it as usual. */
+  restore = (modeOrdered && threadCount == 1 && !modeMultiBuffer &&
+	     !modeDupes && !modeBatch && !piecewiseSize && !treeLeafSize);
+
+  if (!restore) {
+    for (count = 0 ; count < b.count ; count++) {
+      e = &b.entries[count];
+      nameLen = setName(w,start,b.names + e->name);
+      walkEntry(w,fd,b.names + e->name,start + nameLen,e->status);
+    }
+  }
+
+  else {
+
+    /* We hash the files in disk order and keep the results. Then we go
+       through the directory in its own order, printing the results
+       and walking the subdirectories as we come to them, which is
+       exactly what a walk without -P would have printed. The entries
+       were numbered before we took out the ones we did first. */
+    if ((lines = (char **)calloc(total + 1,sizeof(char *))) == NULL ||
+	(dirs = (physicalEntry **)calloc(total + 1,sizeof(physicalEntry *))) == NULL)
+      outOfMemory();
+
+    for (count = 0 ; count < b.count ; count++) {
+      e = &b.entries[count];
+      if (e->status == FILE_REGULAR) {
+	setName(w,start,b.names + e->name);
+	lines[e->index] = hashFileAtToLine(mainReader,fd,b.names + e->name,
+						   w->path);
+      }
+      else
+	dirs[e->index] = e;
+    }
+
+    for (count = 0 ; count < total ; count++) {
+      if (lines[count] != NULL) {
+	fputs(lines[count],stdout);
+	free(lines[count]);
+      }
+      else if (dirs[count] != NULL) {
+	e = dirs[count];
+	nameLen = setName(w,start,b.names + e->name);
+	walkEntry(w,fd,b.names + e->name,start + nameLen,e->status);
+      }
+    }
+
+    free(lines);
+    free(dirs);
+  }
+
+  w->path[len] = 0;
+  free(b.entries);
+  free(b.names);
+  close(fd);
+}
+
+
+/* Opens the directory path and walks it with w */
+static void walkPath(walker *w, char *path) {
+
+  int fd;
+  size_t len = strlen(path);
+
+  growPath(w,len + 2);
+  memcpy(w->path,path,len + 1);
+
+  if ((fd = open(path,O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0) {
+    printError(path);
+    return;
+  }
+
+  if (modePhysical)
+    walkPhysical(w,fd,len);
+  else
+    walkDirectory(w,fd,len);
+}
+
+
+/* ---------------------------------------------------------------------- */
+
+
+static void pushDirectory(walker *w, char *path) {
+
+  char **bigger;
+  unsigned long count;
+
+  /* Count it before anybody can steal it, so that nobody thinks we're
+     done while it's being walked */
+  pthread_mutex_lock(&walkLock);
+  pending++;
+  generation++;
+  pthread_cond_signal(&walkMore);
+  pthread_mutex_unlock(&walkLock);
+
+  pthread_mutex_lock(&w->lock);
+
+  if (w->tail - w->head == w->capacity) {
+    count = w->capacity ? w->capacity * 2 : WALK_MIN_DEQUE;
+    if ((bigger = (char **)malloc(count * sizeof(char *))) == NULL)
+      outOfMemory();
+    for (count = w->head ; count < w->tail ; count++)
+      bigger[count - w->head] = w->deque[count % w->capacity];
+    w->tail -= w->head;
+    w->head = 0;
+    free(w->deque);
+    w->deque = bigger;
+    w->capacity = w->capacity ? w->capacity * 2 : WALK_MIN_DEQUE;
+  }
+
+  w->deque[w->tail++ % w->capacity] = path;
+  pthread_mutex_unlock(&w->lock);
+}
+
+
+/* Takes a directory from the back of our own deque or, if fromFront is
+   set, from the front of somebody else's */
+static char *takeDirectory(walker *w, bool fromFront) {
+
+  char *path = NULL;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->tail > w->head) {
+    if (fromFront)
+      path = w->deque[w->head++ % w->capacity];
+    else
+      path = w->deque[--w->tail % w->capacity];
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return path;
+}
+
+
+static void *walkerThread(void *arg) {
+
+  walker *w = (walker *)arg;
+  unsigned long seen;
+  char *path;
+  int i;
+
+  for (;;) {
+
+    pthread_mutex_lock(&walkLock);
+    seen = generation;
+    pthread_mutex_unlock(&walkLock);
+
+    path = takeDirectory(w,FALSE);
+    for (i = 1 ; path == NULL && i < walkerCount ; i++)
+      path = takeDirectory(&walkers[(w - walkers + i) % walkerCount],TRUE);
+
+    if (path != NULL) {
+      walkPath(w,path);
+      free(path);
+
+      pthread_mutex_lock(&walkLock);
+      if (--pending == 0)
+	pthread_cond_broadcast(&walkMore);
+      pthread_mutex_unlock(&walkLock);
+      continue;
+    }
+
+    /* There was nothing to take. Unless somebody added a directory
+       while we were looking, wait until they do or we're all done. */
+    pthread_mutex_lock(&walkLock);
+    while (pending > 0 && generation == seen)
+      pthread_cond_wait(&walkMore,&walkLock);
+    if (pending == 0) {
+      pthread_mutex_unlock(&walkLock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&walkLock);
+  }
+}
+
+
+/* Walks the tree at fn with walkThreads threads. The calling thread
+   is one of them. */
+static void walkParallel(char *fn) {
+
+  char *root;
+  int i;
+
+  walkerCount = walkThreads;
+  if ((walkers = (walker *)calloc(walkerCount,sizeof(walker))) == NULL ||
+      (root = strdup(fn)) == NULL)
+    outOfMemory();
+
+  for (i = 0 ; i < walkerCount ; i++)
+    pthread_mutex_init(&walkers[i].lock,NULL);
+
+  pushDirectory(&walkers[0],root);
+
+  /* If we can't start some of the threads, the rest do their share */
+  for (i = 1 ; i < walkerCount ; i++)
+    walkers[i].started =
+      !pthread_create(&walkers[i].thread,NULL,walkerThread,&walkers[i]);
+
+  walkerThread(&walkers[0]);
+
+  for (i = 0 ; i < walkerCount ; i++) {
+    if (walkers[i].started)
+      pthread_join(walkers[i].thread,NULL);
+    pthread_mutex_destroy(&walkers[i].lock);
+    free(walkers[i].deque);
+    free(walkers[i].path);
+  }
+
+  free(walkers);
+  walkers = NULL;
+  walkerCount = 0;
+}
+
+
+void processDirectory(char *fn) {
+
+  walker w;
+
+  if (walkThreads > 1) {
+    walkParallel(fn);
+    return;
+  }
+
+  memset(&w,0,sizeof(w));
+  walkerCount = 1;
+  walkPath(&w,fn);
+  walkerCount = 0;
+  free(w.path);
+}
+
+#endif /* ifdef __UNIX */